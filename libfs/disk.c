@@ -1,84 +1,885 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "disk.h"
+#include "fs_crc.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Largest number of member files of a striped disk */
+#define DISK_MAX_MEMBERS 64
+
+/* Largest single read or write of the image of an in-memory disk */
+#define DISK_IO_CHUNK (64 << 20)
+
+/* Blocks of an in-memory disk read at most at once, aligned on as many */
+#define DISK_LOAD_BLOCKS 256
+
+/* Checksums held by one block, and blocks holding @n of them */
+#define BLOCK_CSUM_ENTRIES (BLOCK_SIZE / sizeof(uint32_t))
+#define BLOCK_CSUM_BLOCKS(n) \
+	(((n) + BLOCK_CSUM_ENTRIES - 1) / BLOCK_CSUM_ENTRIES)
+
+/* State of a block of an in-memory disk */
+enum {
+	DISK_ABSENT,	/* not read from the file yet */
+	DISK_CLEAN,	/* as in the file */
+	DISK_DIRTY,	/* written since the last sync */
+};
+
+/* Share of a multi-block transfer going to one member file */
+struct disk_job {
+	struct disk_job *next;
+	int write;
+	int fd;
+	off_t offset;
+	struct iovec *iov;
+	int iovcnt;
+	/* Transfer the job belongs to */
+	struct disk_xfer *xfer;
+};
+
+/* Multi-block transfer spread over several member files */
+struct disk_xfer {
+	int pending;
+	int error;
+};
+
+/* Member file of the disk, with its worker thread if the disk is striped */
+struct disk_member {
+	int fd;
+	size_t bcount;
+	pthread_t thread;
+	pthread_cond_t cond;
+	struct disk_job *head, **tail;
+};
+
+/* Most requests merged into a single transfer by the scheduler */
+#define DISK_SCHED_MERGE 64
+
+/* Block transfer waiting in the queue of the scheduler */
+struct disk_req {
+	struct disk_req *next;
+	int write;
+	size_t block;
+	size_t count;
+	void *buf;
+	/* Arrival time, in nanoseconds, and order */
+	uint64_t arrival;
+	uint64_t seq;
+	/* Requests carried out by this one, itself first, when it leads them */
+	struct disk_req **group;
+	int ngroup;
+	/* Completion, under the lock of the scheduler */
+	int done;
+	int ret;
+	/* Signalled when the caller has something to do or is done */
+	pthread_cond_t cond;
+};
+
+/* Request scheduler, see block_sched_set() */
+struct disk_sched {
+	pthread_mutex_t lock;
+	pthread_cond_t arrived;
+	/* Pending requests, in arrival order */
+	struct disk_req *head, **tail;
+	size_t depth;
+	uint64_t seq;
+	/* Request of the caller dispatching a batch, whose transfers are not
+	 * all done */
+	struct disk_req *dispatcher;
+	size_t running;
+	/* Collection window, in nanoseconds, 0 if disabled */
+	uint64_t window;
+	/* Size of the last batch: as many requests are waited for */
+	size_t expected;
+	struct block_sched_stats stats;
+};
 
 /* Disk instance description */
 struct disk {
-	/* File descriptor */
-	int fd;
+	/* Member files, one unless striped */
+	struct disk_member *members;
+	int nmembers;
+	/* Stripe unit, in blocks */
+	size_t stripe;
 	/* Block count */
 	size_t bcount;
+	/* Opened with block_disk_open_readonly() */
+	int readonly;
+	/* Whole image, and the state of each block, when opened with
+	 * block_disk_open_memory() */
+	uint8_t *image;
+	uint8_t *state;
+	/* Taken by the transfers of concurrent callers to and from the image,
+	 * so that loading blocks never overwrites those written meanwhile */
+	pthread_mutex_t image_lock;
+	/* Job queues of the members, and completion of the transfers */
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int stopping;
+	/* Checksums of the blocks covered, see block_csum_attach(), and the
+	 * first block they are written through to, 0 if kept in memory */
+	uint32_t *sums;
+	size_t sums_first;
+	size_t sums_count;
+	size_t sums_store;
+	/* Taken while updating the checksums and writing them through, so that
+	 * an older copy of a checksum block never overwrites a newer one */
+	pthread_mutex_t sums_lock;
+	uint32_t (*crc32c)(uint32_t crc, const void *buf, size_t len);
+	/* CRC32C of a block of zeros */
+	uint32_t zero_crc;
+	struct disk_sched sched;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.image_lock = PTHREAD_MUTEX_INITIALIZER,
+	.sums_lock = PTHREAD_MUTEX_INITIALIZER,
+	.sched = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.arrived = PTHREAD_COND_INITIALIZER,
+		.tail = &disk.sched.head,
+		.expected = 1,
+	},
+};
 
-int block_disk_open(const char *diskname)
+/*
+ * Locate logical block @block: member file *@member, at block *@offset of it.
+ * Return the number of blocks from there to the end of the stripe unit.
+ */
+static size_t disk_locate(size_t block, int *member, size_t *offset)
 {
-	int fd;
-	struct stat st;
+	size_t unit = block / disk.stripe;
+
+	*member = unit % disk.nmembers;
+	*offset = unit / disk.nmembers * disk.stripe + block % disk.stripe;
+	return disk.stripe - block % disk.stripe;
+}
+
+/* Number of logical blocks before the first one beyond its member file */
+static size_t disk_capacity(void)
+{
+	size_t block = 0;
+
+	for (;;) {
+		size_t offset, n;
+		int member;
+
+		n = disk_locate(block, &member, &offset);
+		if (offset + n > disk.members[member].bcount)
+			return block + (disk.members[member].bcount > offset ?
+					disk.members[member].bcount - offset :
+					0);
+		block += n;
+	}
+}
+
+static int disk_job_run(struct disk_job *job)
+{
+	struct iovec *iov = job->iov;
+	int left = job->iovcnt;
+
+	/*
+	 * A member gets at most IOV_MAX stripe units per system call, and the
+	 * vectors are advanced past what a short transfer did before the next
+	 */
+	while (left > 0) {
+		int cnt = left < IOV_MAX ? left : IOV_MAX;
+		ssize_t ret;
+
+		if (job->write)
+			ret = pwritev(job->fd, iov, cnt, job->offset);
+		else
+			ret = preadv(job->fd, iov, cnt, job->offset);
+		if (ret <= 0) {
+			if (ret < 0)
+				perror(job->write ? "pwritev" : "preadv");
+			else
+				block_error("unexpected end of file");
+			return -1;
+		}
+		job->offset += ret;
+
+		while (left > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			left--;
+		}
+		if (ret > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+static void disk_job_done(struct disk_job *job, int ret)
+{
+	pthread_mutex_lock(&disk.lock);
+	if (ret < 0)
+		job->xfer->error = 1;
+	if (--job->xfer->pending == 0)
+		pthread_cond_broadcast(&disk.done);
+	pthread_mutex_unlock(&disk.lock);
+}
+
+static void *disk_worker(void *arg)
+{
+	struct disk_member *member = arg;
+
+	pthread_mutex_lock(&disk.lock);
+	for (;;) {
+		struct disk_job *job = member->head;
+
+		if (!job) {
+			if (disk.stopping)
+				break;
+			pthread_cond_wait(&member->cond, &disk.lock);
+			continue;
+		}
+		member->head = job->next;
+		if (!member->head)
+			member->tail = &member->head;
+
+		pthread_mutex_unlock(&disk.lock);
+		disk_job_done(job, disk_job_run(job));
+		pthread_mutex_lock(&disk.lock);
+	}
+	pthread_mutex_unlock(&disk.lock);
+	return NULL;
+}
+
+/* Transfer @len bytes at @offset of @fd, in chunks, to or from @buf */
+static int disk_io_all(int write, int fd, uint8_t *buf, size_t len,
+		       off_t offset)
+{
+	while (len > 0) {
+		size_t n = len < DISK_IO_CHUNK ? len : DISK_IO_CHUNK;
+		ssize_t ret;
+
+		if (write)
+			ret = pwrite(fd, buf, n, offset);
+		else
+			ret = pread(fd, buf, n, offset);
+		if (ret <= 0) {
+			if (ret < 0)
+				perror(write ? "pwrite" : "pread");
+			else
+				block_error("unexpected end of file");
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+/*
+ * Read the blocks among @block to @block + @count - 1 of an in-memory disk
+ * that are not in memory yet, with their absent neighbours in the same
+ * aligned window of DISK_LOAD_BLOCKS blocks, so that sequential accesses are
+ * served by large reads. Called with the lock of the image held.
+ */
+static int disk_load(size_t block, size_t count)
+{
+	for (size_t i = block; i < block + count; i++) {
+		size_t low = i - i % DISK_LOAD_BLOCKS;
+		size_t high = low + DISK_LOAD_BLOCKS;
+		size_t start = i, end = i + 1;
+
+		if (disk.state[i] != DISK_ABSENT)
+			continue;
+
+		if (high > disk.bcount)
+			high = disk.bcount;
+		while (start > low && disk.state[start - 1] == DISK_ABSENT)
+			start--;
+		while (end < high && disk.state[end] == DISK_ABSENT)
+			end++;
+
+		if (disk_io_all(0, disk.members[0].fd,
+				disk.image + start * BLOCK_SIZE,
+				(end - start) * BLOCK_SIZE,
+				(off_t)start * BLOCK_SIZE) < 0)
+			return -1;
+		memset(disk.state + start, DISK_CLEAN, end - start);
+		i = end - 1;
+	}
+	return 0;
+}
+
+/*
+ * Transfer @count blocks from block @block on, to or from @buf. The share of
+ * each member file of a striped disk is contiguous in that file: it is
+ * transferred with a single vectored call, in parallel with the others.
+ */
+static int disk_transfer(int write, size_t block, size_t count, void *buf)
+{
+	struct disk_xfer xfer = { 0 };
+	struct disk_job *jobs;
+	struct iovec *iov;
+	size_t offset, n, units;
+	int first, member, used, pos = 0, ret = 0;
 
-	if (!diskname) {
-		block_error("invalid file diskname");
+	/* In memory, a copy; the blocks written are persisted later */
+	if (disk.image) {
+		pthread_mutex_lock(&disk.image_lock);
+		if (write) {
+			memcpy(disk.image + block * BLOCK_SIZE, buf,
+			       count * BLOCK_SIZE);
+			memset(disk.state + block, DISK_DIRTY, count);
+		} else {
+			ret = disk_load(block, count);
+			if (ret == 0)
+				memcpy(buf, disk.image + block * BLOCK_SIZE,
+				       count * BLOCK_SIZE);
+		}
+		pthread_mutex_unlock(&disk.image_lock);
+		return ret;
+	}
+
+	n = disk_locate(block, &first, &offset);
+	if (count <= n) {
+		/* Within a stripe unit, a plain positioned transfer */
+		return disk_io_all(write, disk.members[first].fd, buf,
+				   count * BLOCK_SIZE, offset * BLOCK_SIZE);
+	}
+
+	/* Stripe unit #k of the transfer goes to member first + k */
+	units = 1 + (count - n + disk.stripe - 1) / disk.stripe;
+	used = units < (size_t)disk.nmembers ? (int)units : disk.nmembers;
+	iov = malloc(units * sizeof(*iov));
+	jobs = malloc(used * sizeof(*jobs));
+	if (!iov || !jobs) {
+		free(iov);
+		free(jobs);
 		return -1;
 	}
 
-	if (disk.fd != INVALID_FD) {
+	for (int j = 0; j < used; j++) {
+		struct disk_job *job = &jobs[j];
+
+		job->write = write;
+		job->iov = iov + pos;
+		job->iovcnt = 0;
+		job->xfer = &xfer;
+		for (size_t k = j; k < units; k += disk.nmembers) {
+			size_t start = k ? block + n + (k - 1) * disk.stripe
+					 : block;
+			size_t len = k ? disk.stripe : n;
+
+			if (len > block + count - start)
+				len = block + count - start;
+			if (k == (size_t)j) {
+				disk_locate(start, &member, &offset);
+				job->fd = disk.members[member].fd;
+				job->offset = (off_t)offset * BLOCK_SIZE;
+			}
+			iov[pos].iov_base = (char *)buf + (start - block) *
+					    BLOCK_SIZE;
+			iov[pos].iov_len = len * BLOCK_SIZE;
+			pos++;
+			job->iovcnt++;
+		}
+	}
+
+	/* The first member is served by the calling thread */
+	xfer.pending = used;
+	pthread_mutex_lock(&disk.lock);
+	for (int j = 1; j < used; j++) {
+		struct disk_member *m = &disk.members[(first + j) %
+						      disk.nmembers];
+
+		jobs[j].next = NULL;
+		*m->tail = &jobs[j];
+		m->tail = &jobs[j].next;
+		pthread_cond_signal(&m->cond);
+	}
+	pthread_mutex_unlock(&disk.lock);
+
+	disk_job_done(&jobs[0], disk_job_run(&jobs[0]));
+
+	pthread_mutex_lock(&disk.lock);
+	while (xfer.pending > 0)
+		pthread_cond_wait(&disk.done, &disk.lock);
+	pthread_mutex_unlock(&disk.lock);
+	if (xfer.error)
+		ret = -1;
+
+	free(iov);
+	free(jobs);
+	return ret;
+}
+
+static uint64_t disk_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Order of the scheduler: by block, then by arrival */
+static int disk_req_cmp(const void *a, const void *b)
+{
+	const struct disk_req *x = *(struct disk_req *const *)a;
+	const struct disk_req *y = *(struct disk_req *const *)b;
+
+	if (x->block != y->block)
+		return x->block < y->block ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * Do the @count requests of @reqs, of consecutive blocks in the same
+ * direction, as a single vectored transfer
+ */
+static int disk_sched_run(struct disk_req **reqs, int count)
+{
+	struct iovec iov[DISK_SCHED_MERGE];
+	struct disk_job job = {
+		.write = reqs[0]->write,
+		.fd = disk.members[0].fd,
+		.offset = (off_t)reqs[0]->block * BLOCK_SIZE,
+		.iov = iov,
+		.iovcnt = count,
+	};
+
+	if (count == 1)
+		return disk_transfer(reqs[0]->write, reqs[0]->block,
+				     reqs[0]->count, reqs[0]->buf);
+
+	for (int i = 0; i < count; i++) {
+		iov[i].iov_base = reqs[i]->buf;
+		iov[i].iov_len = reqs[i]->count * BLOCK_SIZE;
+	}
+	return disk_job_run(&job);
+}
+
+/*
+ * Do the transfer of the requests led by @req, for their callers. Called with
+ * the lock of the scheduler held.
+ */
+static void disk_sched_lead(struct disk_req *req)
+{
+	struct disk_sched *s = &disk.sched;
+	struct disk_req **group = req->group;
+	int count = req->ngroup, ret;
+
+	req->group = NULL;
+	pthread_mutex_unlock(&s->lock);
+	ret = disk_sched_run(group, count);
+	pthread_mutex_lock(&s->lock);
+
+	for (int i = 0; i < count; i++) {
+		group[i]->ret = ret;
+		group[i]->done = 1;
+		pthread_cond_signal(&group[i]->cond);
+	}
+	if (--s->running == 0)
+		pthread_cond_signal(&s->dispatcher->cond);
+}
+
+/*
+ * Collect the pending requests for the window, then sort them by block and
+ * merge the adjacent ones. The caller of the first request of each merged
+ * transfer does it, so that the transfers still run in parallel. Called with
+ * the lock of the scheduler held, by one caller at a time, whose request is
+ * @self.
+ */
+static void disk_sched_dispatch(struct disk_req *self)
+{
+	struct disk_sched *s = &disk.sched;
+	uint64_t deadline = s->head->arrival + s->window;
+	struct disk_req *list, **reqs, *req;
+	size_t n, i = 0;
+
+	/* Until as many requests as last time are there, or the oldest one has
+	 * waited long enough */
+	while (s->depth < s->expected) {
+		uint64_t now = disk_now(), left;
+		struct timespec ts;
+
+		if (now >= deadline) {
+			s->stats.expired++;
+			break;
+		}
+		left = deadline - now;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += left % 1000000000;
+		ts.tv_sec += left / 1000000000 + ts.tv_nsec / 1000000000;
+		ts.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&s->arrived, &s->lock, &ts);
+	}
+
+	list = s->head;
+	n = s->depth;
+	s->head = NULL;
+	s->tail = &s->head;
+	s->depth = 0;
+	s->expected = n;
+	s->stats.batches++;
+	if (n > s->stats.max_depth)
+		s->stats.max_depth = n;
+	pthread_mutex_unlock(&s->lock);
+
+	reqs = malloc(n * sizeof(*reqs));
+	if (!reqs) {
+		/* In arrival order then */
+		for (req = list; req; req = req->next)
+			req->ret = disk_transfer(req->write, req->block,
+						 req->count, req->buf);
+
+		pthread_mutex_lock(&s->lock);
+		for (req = list; req; req = req->next) {
+			req->done = 1;
+			pthread_cond_signal(&req->cond);
+		}
+		s->stats.transfers += n;
+		return;
+	}
+
+	for (req = list; req; req = req->next)
+		reqs[i++] = req;
+	qsort(reqs, n, sizeof(*reqs), disk_req_cmp);
+
+	pthread_mutex_lock(&s->lock);
+	for (i = 0; i < n; s->running++) {
+		size_t j = i + 1;
+
+		/* Only the blocks of a single file are consecutive */
+		while (disk.nmembers == 1 && j < n &&
+		       j - i < DISK_SCHED_MERGE &&
+		       reqs[j]->write == reqs[i]->write &&
+		       reqs[j]->block == reqs[j - 1]->block +
+					 reqs[j - 1]->count)
+			j++;
+		reqs[i]->group = reqs + i;
+		reqs[i]->ngroup = j - i;
+		if (reqs[i] != self)
+			pthread_cond_signal(&reqs[i]->cond);
+		i = j;
+	}
+	s->stats.transfers += s->running;
+
+	/* The batch is over when every transfer is done */
+	while (s->running > 0) {
+		if (self->group)
+			disk_sched_lead(self);
+		else
+			pthread_cond_wait(&self->cond, &s->lock);
+	}
+	free(reqs);
+}
+
+/*
+ * Transfer @count blocks from block @block on, to or from @buf, through the
+ * scheduler if it is enabled. The first caller to wait dispatches the batch of
+ * requests, its own included, for all the callers.
+ */
+static int disk_submit(int write, size_t block, size_t count, void *buf)
+{
+	struct disk_sched *s = &disk.sched;
+	struct disk_req req = {
+		.write = write,
+		.block = block,
+		.count = count,
+		.buf = buf,
+	};
+
+	/* In memory, there is nothing to gain */
+	if (!s->window || disk.image)
+		return disk_transfer(write, block, count, buf);
+
+	pthread_cond_init(&req.cond, NULL);
+	pthread_mutex_lock(&s->lock);
+	req.arrival = disk_now();
+	req.seq = s->seq++;
+	*s->tail = &req;
+	s->tail = &req.next;
+	s->depth++;
+	s->stats.requests++;
+	pthread_cond_signal(&s->arrived);
+
+	while (!req.done) {
+		if (req.group) {
+			disk_sched_lead(&req);
+		} else if (!s->dispatcher) {
+			s->dispatcher = &req;
+			disk_sched_dispatch(&req);
+			s->dispatcher = NULL;
+			/* Requests that arrived meanwhile need a dispatcher */
+			if (s->head)
+				pthread_cond_signal(&s->head->cond);
+		} else {
+			pthread_cond_wait(&req.cond, &s->lock);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	pthread_cond_destroy(&req.cond);
+
+	return req.ret;
+}
+
+/* Stop the worker threads of the first @count members and close them */
+static void disk_release(int count)
+{
+	pthread_mutex_lock(&disk.lock);
+	disk.stopping = 1;
+	for (int i = 0; i < count; i++)
+		pthread_cond_signal(&disk.members[i].cond);
+	pthread_mutex_unlock(&disk.lock);
+
+	for (int i = 0; i < count; i++) {
+		struct disk_member *member = &disk.members[i];
+
+		if (disk.nmembers > 1) {
+			pthread_join(member->thread, NULL);
+			pthread_cond_destroy(&member->cond);
+		}
+		close(member->fd);
+	}
+	free(disk.members);
+	disk.members = NULL;
+	disk.nmembers = 0;
+	disk.stopping = 0;
+	if (disk.image)
+		munmap(disk.image, disk.bcount * BLOCK_SIZE);
+	free(disk.state);
+	disk.image = NULL;
+	disk.state = NULL;
+}
+
+/* Write the runs of blocks written since the last sync back to the file */
+static int disk_flush_image(void)
+{
+	size_t block = 0;
+	int ret = 0;
+
+	pthread_mutex_lock(&disk.image_lock);
+
+	while (block < disk.bcount) {
+		uint8_t *next = memchr(disk.state + block, DISK_DIRTY,
+				       disk.bcount - block);
+		size_t end;
+
+		if (!next)
+			break;
+		block = next - disk.state;
+		for (end = block; end < disk.bcount &&
+		     disk.state[end] == DISK_DIRTY; end++)
+			;
+
+		if (disk_io_all(1, disk.members[0].fd,
+				disk.image + block * BLOCK_SIZE,
+				(end - block) * BLOCK_SIZE,
+				(off_t)block * BLOCK_SIZE) < 0) {
+			ret = -1;
+			break;
+		}
+		memset(disk.state + block, DISK_CLEAN, end - block);
+		block = end;
+	}
+	pthread_mutex_unlock(&disk.image_lock);
+	return ret;
+}
+
+static int disk_open(const char *const *disknames, int count, size_t stripe,
+		     int flags)
+{
+	struct stat st;
+
+	if (disk.nmembers) {
 		block_error("disk already open");
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
-		perror("open");
+	if (!disknames || count < 1 || count > DISK_MAX_MEMBERS ||
+	    stripe == 0) {
+		block_error("invalid disk members");
+		return -1;
+	}
+
+	disk.members = calloc(count, sizeof(*disk.members));
+	if (!disk.members) {
+		perror("calloc");
+		return -1;
+	}
+	disk.nmembers = count;
+	disk.stripe = count > 1 ? stripe : SIZE_MAX;
+
+	for (int i = 0; i < count; i++) {
+		struct disk_member *member = &disk.members[i];
+
+		if (!disknames[i]) {
+			block_error("invalid file diskname");
+			goto fail;
+		}
+
+		if ((member->fd = open(disknames[i], flags, 0644)) < 0) {
+			perror("open");
+			goto fail;
+		}
+
+		if (fstat(member->fd, &st)) {
+			perror("fstat");
+			close(member->fd);
+			goto fail;
+		}
+
+		/* The disk image's size should be a multiple of the block size */
+		if (st.st_size % BLOCK_SIZE != 0) {
+			block_error("size '%zu' is not multiple of '%d'",
+				    st.st_size, BLOCK_SIZE);
+			close(member->fd);
+			goto fail;
+		}
+		member->bcount = st.st_size / BLOCK_SIZE;
+		member->tail = &member->head;
+
+		if (count > 1) {
+			pthread_cond_init(&member->cond, NULL);
+			if (pthread_create(&member->thread, NULL, disk_worker,
+					   member)) {
+				block_error("cannot start member thread");
+				pthread_cond_destroy(&member->cond);
+				close(member->fd);
+				goto fail;
+			}
+		}
+		continue;
+
+fail:
+		disk_release(i);
+		return -1;
+	}
+
+	disk.bcount = count > 1 ? disk_capacity() : disk.members[0].bcount;
+	disk.readonly = flags == O_RDONLY;
+
+	return 0;
+}
+
+int block_disk_open(const char *diskname)
+{
+	return disk_open(&diskname, 1, 1, O_RDWR);
+}
+
+int block_disk_open_readonly(const char *diskname)
+{
+	return disk_open(&diskname, 1, 1, O_RDONLY);
+}
+
+int block_disk_open_striped(const char *const *disknames, int count,
+			    size_t stripe)
+{
+	return disk_open(disknames, count, stripe, O_RDWR);
+}
+
+int block_disk_open_memory(const char *diskname)
+{
+	if (disk_open(&diskname, 1, 1, O_RDWR) < 0)
+		return -1;
+
+	if (!disk.bcount) {
+		block_error("empty disk");
+		disk_release(disk.nmembers);
 		return -1;
 	}
 
-	if (fstat(fd, &st)) {
-		perror("fstat");
+	/*
+	 * The memory of the image is only committed as it is used; the blocks
+	 * are read from the file when first accessed, see disk_load(). Huge
+	 * pages keep the cost of faulting it in low.
+	 */
+	disk.state = calloc(disk.bcount, 1);
+	if (!disk.state) {
+		perror("calloc");
+		disk_release(disk.nmembers);
+		return -1;
+	}
+	disk.image = mmap(NULL, disk.bcount * BLOCK_SIZE,
+			  PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (disk.image == MAP_FAILED) {
+		perror("mmap");
+		disk.image = NULL;
+		disk_release(disk.nmembers);
 		return -1;
 	}
+	madvise(disk.image, disk.bcount * BLOCK_SIZE, MADV_HUGEPAGE);
+
+	return 0;
+}
 
-	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
-		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+int block_disk_sync(void)
+{
+	if (!disk.nmembers) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	if (disk.readonly)
+		return 0;
+
+	if (disk.image && disk_flush_image() < 0)
+		return -1;
+
+	for (int i = 0; i < disk.nmembers; i++) {
+		if (fdatasync(disk.members[i].fd)) {
+			perror("fdatasync");
+			return -1;
+		}
+	}
 
 	return 0;
 }
 
 int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.nmembers) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	/* Nothing of an in-memory disk is lost, it stays open otherwise */
+	if (disk.image && disk_flush_image() < 0)
+		return -1;
+
+	disk_release(disk.nmembers);
 
-	disk.fd = INVALID_FD;
+	disk.sums = NULL;
+	disk.sums_count = 0;
+	disk.sums_store = 0;
+
+	disk.sched.window = 0;
+	disk.sched.expected = 1;
+	memset(&disk.sched.stats, 0, sizeof(disk.sched.stats));
 
 	return 0;
 }
 
 int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.nmembers) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -86,59 +887,225 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
-int block_write(size_t block, const void *buf)
+int block_sched_set(unsigned int window_us)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.nmembers) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	disk.sched.window = (uint64_t)window_us * 1000;
+
+	return 0;
+}
+
+int block_sched_stats(struct block_sched_stats *stats)
+{
+	if (!disk.nmembers) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	pthread_mutex_lock(&disk.sched.lock);
+	*stats = disk.sched.stats;
+	pthread_mutex_unlock(&disk.sched.lock);
+
+	return 0;
+}
+
+int block_csum_attach(size_t first, size_t count, uint32_t *sums,
+		      size_t store)
+{
+	static const uint8_t zero[BLOCK_SIZE];
+
+	if (!disk.nmembers) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (sums && (first > disk.bcount || count > disk.bcount - first)) {
+		block_error("checksummed blocks out of bounds (%zu+%zu/%zu)",
+			    first, count, disk.bcount);
 		return -1;
 	}
 
+	if (sums && store && (store > disk.bcount ||
+			      BLOCK_CSUM_BLOCKS(count) > disk.bcount - store)) {
+		block_error("checksum blocks out of bounds (%zu+%zu/%zu)",
+			    store, BLOCK_CSUM_BLOCKS(count), disk.bcount);
+		return -1;
+	}
+
+	disk.crc32c = crc_ops()->crc32c;
+	disk.zero_crc = disk.crc32c(0, zero, BLOCK_SIZE);
+	disk.sums = sums;
+	disk.sums_first = first;
+	disk.sums_count = sums ? count : 0;
+	disk.sums_store = sums ? store : 0;
+
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+/* Checksum of @buf, the content of a block, as stored */
+static uint32_t block_csum(const void *buf)
+{
+	return disk.crc32c(0, buf, BLOCK_SIZE) ^ disk.zero_crc;
+}
+
+/*
+ * Range of the blocks @block to @block + @count - 1 that have a checksum,
+ * relative to @block, in [*@from, *@to)
+ */
+static void block_csum_range(size_t block, size_t count, size_t *from,
+			     size_t *to)
+{
+	size_t first = disk.sums_first, end = first + disk.sums_count;
+
+	*from = block < first ? first - block : 0;
+	*to = block + count > end ? (end > block ? end - block : 0) : count;
+}
+
+int block_write_range(size_t block, size_t count, const void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	size_t from, to;
+
+	if (!disk.nmembers) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (disk.readonly) {
+		block_error("disk open read-only");
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (block >= disk.bcount || count > disk.bcount - block) {
+		block_error("block index out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	/*
+	 * Perform the actual write into the disk image, at the specified block
+	 * number (positioned I/O so that concurrent callers do not race on the
+	 * file offset)
+	 */
+	if (disk_submit(1, block, count, (void *)buf) < 0)
 		return -1;
+
+	block_csum_range(block, count, &from, &to);
+	if (from >= to)
+		return 0;
+
+	pthread_mutex_lock(&disk.sums_lock);
+	for (size_t i = from; i < to; i++)
+		disk.sums[block + i - disk.sums_first] =
+			block_csum((const char *)buf + i * BLOCK_SIZE);
+
+	/*
+	 * Write the checksum blocks holding the entries just updated through, so
+	 * that the blocks still match them if the disk is not closed cleanly
+	 */
+	if (disk.sums_store) {
+		size_t lo = (block + from - disk.sums_first) / BLOCK_CSUM_ENTRIES;
+		size_t hi = (block + to - 1 - disk.sums_first) /
+			    BLOCK_CSUM_ENTRIES;
+
+		if (disk_submit(1, disk.sums_store + lo, hi - lo + 1,
+				(char *)disk.sums + lo * BLOCK_SIZE) < 0) {
+			pthread_mutex_unlock(&disk.sums_lock);
+			return -1;
+		}
 	}
+	pthread_mutex_unlock(&disk.sums_lock);
 
 	return 0;
 }
 
+int block_write(size_t block, const void *buf)
+{
+	return block_write_range(block, 1, buf);
+}
+
+int block_read_range(size_t block, size_t count, void *buf)
+{
+	size_t from, to;
+
+	if (!disk.nmembers) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= disk.bcount || count > disk.bcount - block) {
+		block_error("block index out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		return -1;
+	}
+
+	/* Perform the actual read from the disk image, at the specified block */
+	if (disk_submit(0, block, count, buf) < 0)
+		return -1;
+
+	block_csum_range(block, count, &from, &to);
+	for (size_t i = from; i < to; i++) {
+		if (block_csum((char *)buf + i * BLOCK_SIZE) !=
+		    disk.sums[block + i - disk.sums_first]) {
+			block_error("checksum mismatch on block %zu",
+				    block + i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int block_read(size_t block, void *buf)
+{
+	return block_read_range(block, 1, buf);
+}
+
+void *block_map(size_t block, size_t count)
+{
+	size_t offset;
+	void *addr;
+	int member;
+
+	if (!disk.nmembers) {
+		block_error("no disk currently open");
+		return NULL;
+	}
+
+	if (count == 0 || block >= disk.bcount ||
+	    count > disk.bcount - block) {
+		block_error("block index out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		return NULL;
+	}
+
+	/* The file is stale under an in-memory disk */
+	if (disk.image)
+		return NULL;
+
+	/* Only blocks consecutive in a member file can be mapped together */
+	if (disk_locate(block, &member, &offset) < count)
+		return NULL;
+
+	addr = mmap(NULL, count * BLOCK_SIZE, PROT_READ, MAP_SHARED,
+		    disk.members[member].fd, offset * BLOCK_SIZE);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	return addr;
+}
+
+int block_unmap(void *addr, size_t count)
+{
+	if (munmap(addr, count * BLOCK_SIZE)) {
+		perror("munmap");
+		return -1;
+	}
+
+	return 0;
+}
@@ -2,6 +2,11 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
@@ -19,13 +24,83 @@
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_readonly - Open virtual disk file for reading only
+ * @diskname: Name of the virtual disk file
+ *
+ * Open virtual disk file @diskname like block_disk_open(), but for reading
+ * only: block_write() and block_write_range() fail until it is closed. Any
+ * number of processes can open the same virtual disk file this way.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or is already open. 0 otherwise.
+ */
+int block_disk_open_readonly(const char *diskname);
+
+/**
+ * block_disk_open_striped - Open several virtual disk files as one disk
+ * @disknames: Names of the virtual disk files, the members of the disk
+ * @count: Number of members, at most 64
+ * @stripe: Stripe unit, in blocks
+ *
+ * Open the @count virtual disk files of @disknames as a single disk, whose
+ * blocks are striped over them: the first @stripe blocks are those of the
+ * first member, the next @stripe blocks those of the second member, and so
+ * on, round-robin. Ideally, the members lie on different devices. A transfer
+ * of several blocks spanning several members is split into one transfer per
+ * member, all of them done in parallel, so that the bandwidth of sequential
+ * accesses adds up. The disk ends at the first block past the end of its
+ * member, so the members should hold the same number of stripe units (the
+ * last one may be partial). A single member makes the disk of
+ * block_disk_open().
+ *
+ * Return: -1 if any of @disknames is invalid, if any of the virtual disk files
+ * cannot be opened, if @count or @stripe is invalid, or if a disk is already
+ * open. 0 otherwise.
+ */
+int block_disk_open_striped(const char *const *disknames, int count,
+			    size_t stripe);
+
+/**
+ * block_disk_open_memory - Open virtual disk file in memory
+ * @diskname: Name of the virtual disk file
+ *
+ * Open virtual disk file @diskname like block_disk_open(), but keep its image
+ * in memory: the blocks are read from and written to memory only, each one
+ * read from the file the first time it is accessed. The blocks written go back
+ * to the file when block_disk_sync() or block_disk_close() is called, each run
+ * of consecutive blocks in a single sequential write. Until then, the file is
+ * left untouched, and the changes are lost if the process dies. block_map() is
+ * not supported.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or mapped in memory, or if a disk is already open. 0 otherwise.
+ */
+int block_disk_open_memory(const char *diskname);
+
 /**
  * block_disk_close - Close virtual disk file
  *
- * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ * Close the virtual disk, after writing the blocks of an in-memory disk back
+ * to its file (see block_disk_open_memory()).
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the blocks of an
+ * in-memory disk cannot be written back, the disk staying open. 0 otherwise.
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_sync - Persist the blocks written to the disk
+ *
+ * Write the blocks of an in-memory disk written since the last call back to
+ * its file (see block_disk_open_memory()), and have the data of the virtual
+ * disk files reach the storage.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the blocks cannot
+ * be written back or persisted. 0 otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -34,6 +109,67 @@ int block_disk_close(void);
  */
 int block_disk_count(void);
 
+/** Activity of the request scheduler, see block_sched_stats() */
+struct block_sched_stats {
+	size_t requests;  /* transfers requested */
+	size_t batches;   /* batches dispatched, requests / batches is the
+			     mean queue depth */
+	size_t max_depth; /* largest batch */
+	size_t transfers; /* transfers done, requests - transfers were merged */
+	size_t expired;   /* batches dispatched when the window expired */
+};
+
+/**
+ * block_sched_set - Schedule the transfers of concurrent callers
+ * @window_us: Collection window in microseconds, 0 to disable scheduling
+ *
+ * With a collection window, the transfers requested at the same time by
+ * several threads, e.g. the workers of fs_read_async() and fs_write_async(),
+ * are queued, then done in batches: by block order, the transfers of adjacent
+ * blocks in the same direction merged into a single one, so that the disk is
+ * accessed in sequence rather than in arrival order. One of the waiting callers
+ * dispatches the batch when as many transfers as in the previous batch are
+ * queued, or once the oldest one has waited for @window_us: a lone caller is
+ * never delayed, and no transfer waits for more than the window and a batch.
+ * On a striped disk, transfers are sorted but not merged, and a disk in memory
+ * is never scheduled. Scheduling pays off where seeks are costly, e.g. on
+ * rotating disks; where they are not, the waits cost more than the order saves.
+ * Must not be called while transfers are in progress.
+ *
+ * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ */
+int block_sched_set(unsigned int window_us);
+
+/**
+ * block_sched_stats - Get the activity of the request scheduler
+ * @stats: Filled with the counters since the disk was opened
+ *
+ * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ */
+int block_sched_stats(struct block_sched_stats *stats);
+
+/**
+ * block_csum_attach - Verify the blocks of the disk against checksums
+ * @first: Index of the first block with a checksum
+ * @count: Number of blocks with a checksum
+ * @sums: Checksum of each of these blocks, NULL to detach them
+ * @store: Index of the first block holding @sums on disk, 0 if none
+ *
+ * Once attached, the blocks @first to @first + @count - 1 are verified against
+ * their entry of @sums when they are read, and their entry is updated when
+ * they are written. An entry is the CRC32C of the block, xored with the CRC32C
+ * of a block of zeros (see fs_format.h). @sums remains owned by the caller.
+ *
+ * Unless @store is 0, the blocks of @sums holding the entries updated by a
+ * write are written to the disk right after the blocks written, from block
+ * @store on.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the blocks are out
+ * of bounds. 0 otherwise.
+ */
+int block_csum_attach(size_t first, size_t count, uint32_t *sums,
+		      size_t store);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
@@ -55,10 +191,70 @@ int block_write(size_t block, const void *buf);
  * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
  * buffer @buf.
  *
- * Return: -1 if @block is out of bounds or inaccessible, or if the reading
- * operation fails. 0 otherwise.
+ * Return: -1 if @block is out of bounds or inaccessible, if the reading
+ * operation fails, or if the content of the block does not match its checksum
+ * (@buf is filled nevertheless). 0 otherwise.
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_range - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count * %BLOCK_SIZE bytes) in the virtual
+ * disk's blocks @block to @block + @count - 1, in a single transfer.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_range - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count * %BLOCK_SIZE bytes) into buffer @buf, in a single transfer.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, if the
+ * reading operation fails, or if the content of any of the blocks does not
+ * match its checksum. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * block_map - Map consecutive blocks of the disk in memory
+ * @block: Index of the first block to map
+ * @count: Number of blocks to map
+ *
+ * Map the virtual disk's blocks @block to @block + @count - 1 read-only in
+ * memory. The mapping is shared: the processes mapping the same blocks share
+ * the pages, and see the blocks as last written. Checksums are not verified.
+ * The mapping remains valid after the disk is closed, until block_unmap().
+ *
+ * Return: NULL if there was no virtual disk file opened, if it is in memory,
+ * if any of the blocks is out of bounds, or if the blocks cannot be mapped (in
+ * a single piece on a striped disk). The address of the first block
+ * otherwise.
+ */
+void *block_map(size_t block, size_t count);
+
+/**
+ * block_unmap - Unmap blocks mapped in memory
+ * @addr: Address returned by block_map()
+ * @count: Number of blocks mapped
+ *
+ * Return: -1 if the blocks cannot be unmapped. 0 otherwise.
+ */
+int block_unmap(void *addr, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* _DISK_H */
 
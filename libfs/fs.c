@@ -1,85 +1,264 @@
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/uio.h>
 
 #include "disk.h"
 #include "fs.h"
+#include "fs_internal.h"
+#include "fs_simd.h"
 
-#define UNUSED_SUPERBLOCK 4079
-#define UNUSED_ROOTDIR 10
-#define SIGNATURE "ECS150FS"
-#define SIGNATURELENGTH 8
-#define FAT_EOC 0xffff
-
-/* Data structure for superblock */
-struct __attribute__((packed)) Superblock {
-  uint8_t signature[SIGNATURELENGTH];
-  uint16_t total_blocks;
-  uint16_t root_dir_blk_index;
-  uint16_t data_blk_start_index;
-  uint16_t num_data_blks;
-  uint8_t num_blk_FAT;
-  uint8_t unused[UNUSED_SUPERBLOCK];
+/* Size of the bounce buffer of fs_copy_range(), in blocks */
+#define COPY_CHUNK_BLOCKS 64
+
+/* Data structure for the file descriptor, the state of one fs_open() */
+struct FileDescriptor {
+  int ifopened;
+  uint32_t fdoffset;
+  uint32_t indexinroot;
+  /* Next free descriptor, when not opened */
+  int nextfree;
 };
 
+struct Superblock superblock;
+/* Superblock of a version 1 disk as read, updated when writing it back */
+static struct SuperblockV1 superblock_v1;
+uint32_t *fat;
+/* Checksums of the blocks from the root directory on, NULL if none */
+static uint32_t *csums;
+/* Descriptor table, grown as needed, with a stack of the free descriptors */
+static struct FileDescriptor *FD;
+static int fd_capacity;
+static int fd_free = -1;
+static int fd_opened;
+/* For the sake of error management */
+int mounted = 0;
+int readonly = 0;
+/* The FAT is mapped from the disk rather than allocated */
+static int fat_mapped;
 
+const uint8_t zero_block[BLOCK_SIZE];
 
-/* Data structure for rootdir */
-struct __attribute__((packed)) RootDir {
-  uint8_t filename[FS_FILENAME_LEN];
-  uint32_t size_of_file;
-  uint16_t index_first_datablk;
-  uint8_t unused[UNUSED_ROOTDIR];
+/* Position in a plain chain, to avoid walking it from its head each time */
+struct bmap_hint {
+  uint32_t lclu;
+  uint32_t block;
 };
 
-/* Data structure for the file descriptor */
-struct  __attribute__((packed)) FileDescriptor {
-  int ifopened;
-  uint8_t filename[FS_FILENAME_LEN];
-  uint16_t fdnumber;
-  uint16_t fdoffset;
-  uint16_t indexinroot;
-
+/*
+ * Position in a vector of user buffers, consumed as data is copied in or out
+ * of the file. A plain buffer is a vector of one.
+ */
+struct fs_iter {
+  const struct iovec *iov;
+  int iovcnt;
+  /* bytes of iov[0] already consumed */
+  size_t skip;
 };
 
-struct Superblock superblock;
-uint16_t *fat;
-struct RootDir rootdir[FS_FILE_MAX_COUNT];
-struct FileDescriptor FD[FS_OPEN_MAX_COUNT];
-/* For the sake of error management */
-int mounted = 0;
+/* Number of blocks needed to hold @size bytes */
+static uint32_t fs_size_blocks(uint32_t size)
+{
+  return ((uint64_t)size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
 
-int fs_mount(const char *diskname) {
-  /* Open the virtual disk */
-  if (block_disk_open(diskname) == -1) {
+/*
+ * Read the superblock, the version being given by the signature. The fields
+ * of a version 1 superblock are widened.
+ */
+static int fs_super_load(void)
+{
+  if (block_read(0, (void*)&superblock) == -1) {
     return -1;
   }
 
-  /* Read the block */
-  if (block_read(0, (void*)&superblock) == -1) {
+  if (memcmp(superblock.signature, SIGNATURE_V2, SIGNATURELENGTH) == 0) {
+    return superblock.version == 2 &&
+           superblock.cluster_shift <= FS_MAX_CLUSTER_SHIFT ? 0 : -1;
+  }
+  if (memcmp(superblock.signature, SIGNATURE, SIGNATURELENGTH) != 0) {
     return -1;
   }
 
-  /* Check the signature */
-  if (strncmp((char *)superblock.signature, SIGNATURE, SIGNATURELENGTH) != 0) { //jjjjjjjj
-    return -1;
+  memcpy(&superblock_v1, &superblock, sizeof(superblock_v1));
+  memset(&superblock, 0, sizeof(superblock));
+  memcpy(superblock.signature, SIGNATURE, SIGNATURELENGTH);
+  superblock.total_blocks = superblock_v1.total_blocks;
+  superblock.root_dir_blk_index = superblock_v1.root_dir_blk_index;
+  superblock.data_blk_start_index = superblock_v1.data_blk_start_index;
+  superblock.num_data_blks = superblock_v1.num_data_blks;
+  superblock.num_blk_FAT = superblock_v1.num_blk_FAT;
+  superblock.dir_blk_ext = superblock_v1.dir_blk_ext;
+  superblock.version = 1;
+  return 0;
+}
+
+static int fs_super_store(void)
+{
+  if (superblock.version != 1) {
+    return block_write(0, (void*)&superblock);
   }
 
-  /* Check if total amount of block corresponds to block_disk_count */
-  if (superblock.total_blocks != block_disk_count()) {
+  superblock_v1.dir_blk_ext = superblock.dir_blk_ext;
+  return block_write(0, (void*)&superblock_v1);
+}
+
+/* Read the FAT, widening the 16-bit entries of version 1 */
+static int fs_fat_load(void)
+{
+  uint32_t per_block = fs_fat_entries_per_block();
+  size_t entries = (size_t)superblock.num_blk_FAT * per_block;
+  uint16_t raw[FAT_ENTRIES_PER_BLOCK];
+
+  /* Read-only, the FAT of version 2 is used in place, the pages shared with
+   * the other processes mounting the disk */
+  fat_mapped = readonly && superblock.version != 1 &&
+               entries >= superblock.num_data_blks;
+  if (fat_mapped) {
+    fat = block_map(1, superblock.num_blk_FAT);
+    return fat ? 0 : -1;
+  }
+
+  /* Even if the superblock gives too few FAT blocks, see fs_check() */
+  if (entries < superblock.num_data_blks) {
+    entries = superblock.num_data_blks;
+  }
+  fat = calloc(entries, sizeof(*fat));
+  if (!fat) {
     return -1;
   }
 
-  fat = (uint16_t *)malloc( BLOCK_SIZE * superblock.num_blk_FAT * sizeof(uint16_t));
   for (size_t i = 0; i < superblock.num_blk_FAT; i++) {
-    if (block_read(i + 1, &fat[BLOCK_SIZE/2 * i]) == -1) {
+    if (superblock.version != 1) {
+      if (block_read(i + 1, &fat[per_block * i]) == -1) {
+        return -1;
+      }
+      continue;
+    }
+    if (block_read(i + 1, raw) == -1) {
+      return -1;
+    }
+    for (size_t j = 0; j < per_block; j++) {
+      fat[per_block * i + j] = raw[j] == FAT_EOC_V1 ? FAT_EOC : raw[j];
+    }
+  }
+  return 0;
+}
+
+static int fs_fat_store(void)
+{
+  uint32_t per_block = fs_fat_entries_per_block();
+  uint16_t raw[FAT_ENTRIES_PER_BLOCK];
+
+  for (size_t i = 0; i < superblock.num_blk_FAT; i++) {
+    if (superblock.version != 1) {
+      if (block_write(i + 1, &fat[per_block * i]) == -1) {
+        return -1;
+      }
+      continue;
+    }
+    for (size_t j = 0; j < per_block; j++) {
+      uint32_t next = fat[per_block * i + j];
+      raw[j] = next == FAT_EOC ? FAT_EOC_V1 : next;
+    }
+    if (block_write(i + 1, raw) == -1) {
       return -1;
     }
   }
+  return 0;
+}
+
+/* Number of blocks covered by the checksums */
+static size_t fs_csum_count(void)
+{
+  return superblock.total_blocks - superblock.root_dir_blk_index;
+}
+
+/*
+ * Read the checksums of a volume that has them, and have the disk verify the
+ * blocks against them from now on
+ */
+static int fs_csum_load(void)
+{
+  size_t count = fs_csum_count();
 
-  if (block_read(superblock.root_dir_blk_index, &rootdir) == -1) {
+  if (superblock.csum_blk_index == 0) {
+    return 0;
+  }
+  if (superblock.csum_blk_index != superblock.num_blk_FAT + 1 ||
+      superblock.root_dir_blk_index !=
+      superblock.csum_blk_index + superblock.num_blk_csum ||
+      superblock.root_dir_blk_index >= superblock.total_blocks ||
+      (size_t)superblock.num_blk_csum * CSUM_ENTRIES_PER_BLOCK < count) {
+    return -1;
+  }
+
+  /* Read-only, the checksums are never updated and can be shared */
+  if (readonly) {
+    csums = block_map(superblock.csum_blk_index, superblock.num_blk_csum);
+    if (!csums) {
+      return -1;
+    }
+    return block_csum_attach(superblock.root_dir_blk_index, count, csums, 0);
+  }
+
+  csums = malloc((size_t)superblock.num_blk_csum * BLOCK_SIZE);
+  if (!csums) {
+    return -1;
+  }
+  if (block_read_range(superblock.csum_blk_index, superblock.num_blk_csum,
+                       csums) == -1) {
+    return -1;
+  }
+  /* Written through, a crash leaves the blocks written matching them */
+  return block_csum_attach(superblock.root_dir_blk_index, count, csums,
+                           superblock.csum_blk_index);
+}
+
+/*
+ * Load the file system of the virtual disk just opened, made of @count files
+ * striped by units of @stripe blocks
+ */
+static int fs_load_disk(int count, size_t stripe)
+{
+  /* Read the superblock, checking the signature */
+  if (fs_super_load() == -1) {
+    return -1;
+  }
+
+  /* A striped image is only read with the geometry it was made with */
+  int members = superblock.version == 1 || superblock.stripe_count == 0
+                ? 1 : superblock.stripe_count;
+  if (count != members || (count > 1 && stripe != superblock.stripe_blocks)) {
+    return -1;
+  }
+
+  /* Check if total amount of block corresponds to block_disk_count */
+  if (superblock.total_blocks != (uint32_t)block_disk_count()) {
+    return -1;
+  }
+
+  if (fs_fat_load() == -1) {
+    return -1;
+  }
+
+  /* Before reading any block that has a checksum */
+  if (fs_csum_load() == -1) {
+    return -1;
+  }
+
+  if (fs_dir_load() == -1) {
+    return -1;
+  }
+
+  if (fs_pack_load() == -1) {
+    return -1;
+  }
+
+  if (fs_dedup_load() == -1) {
     return -1;
   }
 
@@ -87,23 +266,151 @@ int fs_mount(const char *diskname) {
   return 0;
 }
 
-int fs_umount(void) {
-  /* If no virtual disk is being opened */
-  if (!mounted) {
+/* Release what fs_load_disk() loaded, even partly */
+static void fs_unload(void)
+{
+  if (fat && fat_mapped) {
+    block_unmap(fat, superblock.num_blk_FAT);
+  } else {
+    free(fat);
+  }
+  if (csums && readonly) {
+    block_unmap(csums, superblock.num_blk_csum);
+  } else {
+    free(csums);
+  }
+  fat = NULL;
+  csums = NULL;
+  fs_map_reset();
+  fs_compress_reset();
+  fs_dedup_unload();
+  fs_pack_unload();
+  fs_dir_unload();
+  fs_reclaim_reset();
+}
+
+/* Same, the disk being closed again if no file system can be mounted */
+static int fs_load(int count, size_t stripe)
+{
+  if (fs_load_disk(count, stripe) == -1) {
+    fs_unload();
+    block_disk_close();
     return -1;
   }
+  return 0;
+}
 
-  if (block_write(0, (void*)&superblock) == -1) {
+int fs_mount(const char *diskname) {
+  /* Open the virtual disk */
+  if (block_disk_open(diskname) == -1) {
     return -1;
   }
 
-  for (size_t i = 0; i < superblock.num_blk_FAT; i++) {
-    if (block_write(i + 1, &fat[BLOCK_SIZE/2 * i]) == -1) {
+  readonly = 0;
+  return fs_load(1, 0);
+}
+
+int fs_mount_striped(const char *const *disknames, int count, size_t stripe) {
+  size_t blocks = stripe / BLOCK_SIZE;
+
+  if (stripe % BLOCK_SIZE) {
+    return -1;
+  }
+
+  /* Unless given, the stripe unit is the recorded one: the superblock is the
+   * first block of the first file whatever the unit */
+  if (blocks == 0 && count > 1) {
+    if (block_disk_open_striped(disknames, count, 1) == -1) {
+      return -1;
+    }
+    int ret = fs_super_load();
+    block_disk_close();
+    if (ret == -1 || superblock.version == 1 ||
+        superblock.stripe_blocks == 0) {
       return -1;
     }
+    blocks = superblock.stripe_blocks;
+  }
+
+  if (block_disk_open_striped(disknames, count, blocks ? blocks : 1) == -1) {
+    return -1;
   }
 
-  if (block_write(superblock.root_dir_blk_index, &rootdir) == -1) {
+  readonly = 0;
+  return fs_load(count, blocks);
+}
+
+int fs_mount_readonly(const char *diskname) {
+  if (block_disk_open_readonly(diskname) == -1) {
+    return -1;
+  }
+
+  readonly = 1;
+  return fs_load(1, 0);
+}
+
+int fs_mount_memory(const char *diskname) {
+  if (block_disk_open_memory(diskname) == -1) {
+    return -1;
+  }
+
+  readonly = 0;
+  return fs_load(1, 0);
+}
+
+/* Write the metadata kept in memory back to the disk */
+static int fs_store(void)
+{
+  /* Queued blocks are never written back as such */
+  fs_reclaim_all();
+
+  /* Before the FAT, which links the blocks of the directory */
+  fs_dir_shrink();
+
+  if (fs_super_store() == -1) {
+    return -1;
+  }
+
+  if (fs_fat_store() == -1) {
+    return -1;
+  }
+
+  /* The checksums are written through by the disk, see fs_csum_load() */
+  return fs_dir_store();
+}
+
+int fs_sync(void) {
+  if (!mounted) {
+    return -1;
+  }
+
+  if (readonly) {
+    return 0;
+  }
+
+  /* Asynchronous writes are part of what is persisted */
+  fs_async_drain();
+
+  if (fs_store() == -1) {
+    return -1;
+  }
+
+  return block_disk_sync();
+}
+
+int fs_umount(void) {
+  /* If no virtual disk is being opened */
+  if (!mounted) {
+    return -1;
+  }
+
+  /* Descriptors refer to the entries of the mounted root directory */
+  if (fd_opened || fs_async_busy()) {
+    return -1;
+  }
+
+  /* Nothing was changed when mounted read-only */
+  if (!readonly && fs_store() == -1) {
     return -1;
   }
 
@@ -111,8 +418,10 @@ int fs_umount(void) {
     return -1;
   }
 
-  free(fat);
+  fs_async_stop();
+  fs_unload();
   mounted = 0;
+  readonly = 0;
 
   return 0;
 
@@ -123,30 +432,29 @@ int fs_info(void) {
     return -1;
   }
 
-  printf("FS Info:\n");
-  printf("total_blk_count=%d\n", superblock.total_blocks);
-  printf("fat_blk_count=%d\n", superblock.num_blk_FAT);
-  printf("rdir_blk=%d\n", superblock.root_dir_blk_index);
-  printf("data_blk=%d\n", superblock.data_blk_start_index);
-  printf("data_blk_count=%d\n", superblock.num_data_blks);
+  /* The free blocks are counted once the queued ones are reclaimed */
+  fs_reclaim_all();
 
-  int free_fat_count = 0;
-  for(size_t i = 0; i < superblock.num_data_blks; i++) {
-    if(fat[i] == 0) {
-      free_fat_count++;
-    }
+  printf("FS Info:\n");
+  printf("total_blk_count=%u\n", superblock.total_blocks);
+  printf("fat_blk_count=%u\n", superblock.num_blk_FAT);
+  printf("rdir_blk=%u\n", superblock.root_dir_blk_index);
+  printf("data_blk=%u\n", superblock.data_blk_start_index);
+  printf("data_blk_count=%u\n", superblock.num_data_blks);
+  if (superblock.cluster_shift) {
+    printf("cluster_blk_count=%u\n", 1u << superblock.cluster_shift);
+  }
+  if (superblock.csum_blk_index) {
+    printf("csum_blk=%u\n", superblock.csum_blk_index);
+    printf("csum_blk_count=%u\n", superblock.num_blk_csum);
   }
 
-  printf("fat_free_ratio=%d/%d\n", free_fat_count, superblock.num_data_blks);
+  uint32_t free_fat_count = simd_ops()->count_zero32(fat,
+                                                     superblock.num_data_blks);
 
-  int free_root_count = 0;
-  for(size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
-    if(*rootdir[i].filename == 0) {
-      free_root_count++;
-    }
-  }
+  printf("fat_free_ratio=%u/%u\n", free_fat_count, superblock.num_data_blks);
 
-  printf("rdir_free_ratio=%d/%d\n", free_root_count, FS_FILE_MAX_COUNT);
+  printf("rdir_free_ratio=%u/%u\n", fs_dir_nfree(), rootdir_count);
 
   return 0;
 
@@ -154,14 +462,72 @@ int fs_info(void) {
 
 }
 
+/* Zero-pad @filename into a fixed-width key for the root directory scans */
+static void fs_name_key(const char *filename, uint8_t key[FS_FILENAME_LEN])
+{
+  memset(key, 0, FS_FILENAME_LEN);
+  strncpy((char*)key, filename, FS_FILENAME_LEN - 1);
+}
+
+uint32_t fs_lookup(const char *filename)
+{
+  uint8_t key[FS_FILENAME_LEN];
+
+  if (!mounted)
+    return DIR_NONE;
+  fs_name_key(filename, key);
+  return fs_dir_lookup(key);
+}
+
+int fs_entry_open(uint32_t entry)
+{
+  return rootdir_opens[entry] != 0;
+}
+
+/* Return whether @fd is an open file descriptor */
+static int fs_fd_valid(int fd)
+{
+  return fd >= 0 && fd < fd_capacity && FD[fd].ifopened;
+}
+
+uint32_t fs_fd_entry(int fd)
+{
+  return fs_fd_valid(fd) ? FD[fd].indexinroot : DIR_NONE;
+}
+
+/* Double the descriptor table, pushing the new descriptors as free */
+static int fs_fd_grow(void)
+{
+  int capacity = fd_capacity ? fd_capacity * 2 : FS_OPEN_MAX_COUNT;
+  struct FileDescriptor *table;
+
+  if(fd_capacity > INT_MAX / 2) {
+    return -1;
+  }
+  table = realloc(FD, capacity * sizeof(*table));
+  if(!table) {
+    return -1;
+  }
+  FD = table;
+
+  /* Lowest descriptors first */
+  for(int i = capacity - 1; i >= fd_capacity; i--) {
+    FD[i].ifopened = 0;
+    FD[i].nextfree = fd_free;
+    fd_free = i;
+  }
+  fd_capacity = capacity;
+  return 0;
+}
+
 int fs_create(const char *filename) {
   /* If filename is null */
-  if(!filename) {
+  if(!mounted || readonly || !filename) {
     return -1;
   }
 
   /* If filename is too long */
-  if(strlen(filename) > FS_FILENAME_LEN) {
+  if(strlen(filename) >= FS_FILENAME_LEN) {
     return -1;
   }
 
@@ -170,48 +536,39 @@ int fs_create(const char *filename) {
     return -1;
   }
 
-  /* Check if filename already exist */
-  for(size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
-    if(strcmp((char*)rootdir[i].filename, filename) == 0) {
-      return -1;
-    }
+  /* An empty filename would match the empty entries */
+  if(*filename == '\0') {
+    return -1;
   }
 
-  /* Check if if the root directory already contains
-    FS_FILE_MAX_COUNT files*/
-  int count = 0;
-  for(size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
-    if(strlen((char*)rootdir[i].filename)) {
-      count++;
-    }
-  }
-  if(count == FS_FILE_MAX_COUNT){
+  /* Check if filename already exist */
+  if(fs_lookup(filename) != DIR_NONE) {
     return -1;
   }
 
-  size_t first_entry = 0;
-  for(size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
-    if(!strlen((char*)rootdir[i].filename)) {
-      first_entry = i;
-      strcpy((char*)rootdir[first_entry].filename, filename);
-      rootdir[first_entry].size_of_file = 0;
-      rootdir[first_entry].index_first_datablk = FAT_EOC;
-      return 0;
-    }
+  /* Take an empty entry, the root directory grows by a block when it is
+    full */
+  uint8_t key[FS_FILENAME_LEN];
+  fs_name_key(filename, key);
+  uint32_t first_entry = fs_dir_alloc(key);
+  if(first_entry == DIR_NONE){
+    return -1;
   }
 
+  rootdir[first_entry].size_of_file = 0;
+  rootdir[first_entry].index_first_datablk = FAT_EOC;
   return 0;
 
 }
 
 int fs_delete(const char *filename) {
   /* If filename is null */
-  if(!filename) {
+  if(readonly || !filename) {
     return -1;
   }
 
   /* If filename is too long */
-  if(strlen(filename) > FS_FILENAME_LEN) {
+  if(strlen(filename) >= FS_FILENAME_LEN) {
     return -1;
   }
 
@@ -221,47 +578,31 @@ int fs_delete(const char *filename) {
   }
 
   /* Check if the file exist */
-  int ifexist = 0;
-  for(size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
-    if(strcmp((char*)rootdir[i].filename, filename) == 0) {
-      ifexist = 1;
-    }
-  }
-  if(!ifexist) {
+  uint32_t i = fs_lookup(filename);
+  if(*filename == '\0' || i == DIR_NONE) {
     return -1;
   }
 
   /* To check if the file is currently opened */
-  for(size_t i = 0; i <FS_OPEN_MAX_COUNT; i++) {
-    if(strcmp((char*)FD[i].filename, filename) == 0) {
-      if(FD[i].ifopened) {
-        return -1;
-      } else{
-        break;
-      }
-    }
+  if(fs_entry_open(i)) {
+    return -1;
   }
 
-  /* Now we need to clear the content in the root and deal with the fat */
-  for(size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
-    if(strcmp((char*)rootdir[i].filename, filename) == 0) {
-      memset(rootdir[i].filename, '\0', strlen(filename));
-      rootdir[i].size_of_file = 0;
-      size_t get_datablk = rootdir[i].index_first_datablk;
-      rootdir[i].index_first_datablk = 0;
-
-      if (get_datablk == FAT_EOC) {
-        return 0;
-      }
-      /* Here we free the allocation in the fat */
-      while(fat[get_datablk] != FAT_EOC) {
-        size_t new_getblk = fat[get_datablk];
-        fat[get_datablk] = 0;
-        get_datablk = new_getblk;
-      }
-    }
+  /* Here we free the allocation in the fat, including the last block */
+  if(rootdir[i].flags & RDIR_SNAPSHOT) {
+    fs_snapshot_free(&rootdir[i]);
+  } else if(rootdir[i].flags & RDIR_PACKED) {
+    fs_pack_free(i);
+  } else if(rootdir[i].flags & RDIR_MAPPED) {
+    fs_reclaim_mapped(&rootdir[i]);
+  } else {
+    fs_reclaim_chain(rootdir[i].index_first_datablk);
   }
 
+  /* Now we need to clear the content in the root */
+  fs_dir_free(i);
+  fs_compress_forget(i);
+
   return 0;
 
 }
@@ -271,15 +612,85 @@ int fs_ls(void) {
     return -1;
   }
   printf("FS Ls:\n");
-  for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-    if (strlen((char*)rootdir[i].filename)) {
-      printf("file: %s, size: %d, ", rootdir[i].filename, rootdir[i].size_of_file);
-      printf("data_blk: %d\n", rootdir[i].index_first_datablk);
+  for (uint32_t i = 0; i < rootdir_count; i++) {
+    if (rootdir[i].flags & RDIR_SNAPSHOT) {
+      printf("snapshot: %s, data_blk: %u\n", rootdir[i].filename,
+             rootdir[i].index_first_datablk);
+    } else if (strlen((char*)rootdir[i].filename)) {
+      uint32_t first = rootdir[i].index_first_datablk;
+      /* Print FAT_EOC as stored on the disk */
+      if (superblock.version == 1 && first == FAT_EOC) {
+        first = FAT_EOC_V1;
+      }
+      printf("file: %s, size: %u, ", rootdir[i].filename, rootdir[i].size_of_file);
+      printf("data_blk: %u\n", first);
     }
   }
   return 0;
 }
 
+/* Count the blocks of data of file @entry, and those actually stored */
+static void fs_usage(uint32_t entry, size_t *data, size_t *stored)
+{
+  if (rootdir[entry].flags & RDIR_MAPPED) {
+    fs_compress_usage(entry, data, stored);
+  } else {
+    *data = fs_size_blocks(rootdir[entry].size_of_file);
+    *stored = *data;
+  }
+}
+
+/* Describe file @entry from its directory entry alone */
+static void fs_dirent_fill(uint32_t entry, struct fs_dirent *ent)
+{
+  struct RootDir *file = &rootdir[entry];
+
+  memcpy(ent->name, file->filename, FS_FILENAME_LEN);
+  ent->name[FS_FILENAME_LEN - 1] = '\0';
+  ent->size = file->size_of_file;
+  ent->first_block = file->index_first_datablk == FAT_EOC ?
+                     0 : file->index_first_datablk;
+  ent->blocks = 0;
+  ent->runs = 0;
+}
+
+int fs_readdir(size_t *pos, struct fs_dirent *ents, int count) {
+  if(!mounted || !pos || count < 0 || (count > 0 && !ents)) {
+    return -1;
+  }
+
+  int filled = 0;
+  for (; *pos < rootdir_count && filled < count; (*pos)++) {
+    /* Snapshots are not files */
+    if (*rootdir[*pos].filename == 0 ||
+        (rootdir[*pos].flags & RDIR_SNAPSHOT)) {
+      continue;
+    }
+    fs_dirent_fill(*pos, &ents[filled++]);
+  }
+  return filled;
+}
+
+int fs_stat_name(const char *filename, struct fs_dirent *ent) {
+  if(!mounted || !filename || !ent || *filename == '\0' ||
+     strlen(filename) >= FS_FILENAME_LEN) {
+    return -1;
+  }
+
+  uint32_t found = fs_lookup(filename);
+  if(found == DIR_NONE || (rootdir[found].flags & RDIR_SNAPSHOT)) {
+    return -1;
+  }
+
+  size_t data;
+
+  fs_dirent_fill(found, ent);
+  /* Walking the data is left out of fs_readdir() */
+  fs_usage(found, &data, &ent->blocks);
+  ent->runs = fs_defrag_runs(found);
+  return 0;
+}
+
 int fs_open(const char *filename) {
   /* If filename is null */
   if(!filename) {
@@ -287,7 +698,7 @@ int fs_open(const char *filename) {
   }
 
   /* If filename is too long */
-  if(strlen(filename) > FS_FILENAME_LEN) {
+  if(strlen(filename) >= FS_FILENAME_LEN) {
     return -1;
   }
 
@@ -297,251 +708,955 @@ int fs_open(const char *filename) {
   }
 
   /* Check if the file exist */
-  int ifexist = 0;
-  uint16_t correspondroot = 0;
-
-  for(size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
-    if(strcmp((char*)rootdir[i].filename, filename) == 0) {
-      ifexist = 1;
-      correspondroot = (uint16_t )i;
-      break;
-    }
-  }
-  if(!ifexist) {
+  uint32_t found = fs_lookup(filename);
+  if(*filename == '\0' || found == DIR_NONE) {
     return -1;
   }
+  uint32_t correspondroot = found;
 
-  /* To check if already maximum amount */
-  int openfilecount = 0;
-  for(int i = 0; i < FS_OPEN_MAX_COUNT; i++)
-  {
-    if(strlen((char*)FD[i].filename) != 0){
-      openfilecount++;
-    }
-  }
-  if(openfilecount == FS_OPEN_MAX_COUNT) {
+  /* Snapshots are not files */
+  if(rootdir[found].flags & RDIR_SNAPSHOT) {
     return -1;
   }
 
-  /* Now we try to initialize the file descrpitor */
-  uint16_t i;
-  for(i = 0; i < FS_OPEN_MAX_COUNT; i++)
-  {
-    if(FD[i].ifopened == 0){
-      strcpy((char*)FD[i].filename, filename);
-      FD[i].ifopened = 1;
-      FD[i].fdnumber = i;
-      FD[i].fdoffset = 0;
-      FD[i].indexinroot = correspondroot;
-      break;
-    }
+  /* Take a free descriptor, the table grows when there is none */
+  if(fd_free < 0 && fs_fd_grow() == -1) {
+    return -1;
   }
+
+  int i = fd_free;
+  fd_free = FD[i].nextfree;
+  FD[i].ifopened = 1;
+  FD[i].fdoffset = 0;
+  FD[i].indexinroot = correspondroot;
+  rootdir_opens[correspondroot]++;
+  fd_opened++;
   return i;
 
 }
 
 int fs_close(int fd) {
-  if(fd > FS_OPEN_MAX_COUNT - 1 || fd < 0 ) {
-    return -1;
-  }
-
-  if(FD[fd].ifopened == 0) {
+  if(!fs_fd_valid(fd)) {
     return -1;
   }
 
-  FD[fd].fdnumber = (uint16_t )-1;
+  rootdir_opens[FD[fd].indexinroot]--;
+  fd_opened--;
   FD[fd].ifopened = 0;
   FD[fd].fdoffset = 0;
-  FD[fd].indexinroot = (uint16_t )-1;
-  strcpy((char*)FD[fd].filename, "");
+  FD[fd].indexinroot = DIR_NONE;
+  FD[fd].nextfree = fd_free;
+  fd_free = fd;
   return 0;
 
 
 }
 
 int fs_stat(int fd) {
-  if(fd > FS_OPEN_MAX_COUNT - 1 || fd < 0 ) {
+  if(!fs_fd_valid(fd)) {
     return -1;
   }
 
-  if(FD[fd].ifopened == 0) {
+  return rootdir[FD[fd].indexinroot].size_of_file;
+}
+
+int fs_lseek(int fd, size_t offset) {
+  if(!fs_fd_valid(fd)) {
     return -1;
   }
 
-  for(int i = 0; i < FS_OPEN_MAX_COUNT; i++)
-  {
-    if(FD[i].fdnumber == fd)
-    {
-      return rootdir[FD[i].indexinroot].size_of_file;
-    }
+  /* Seeking past the end of the file is allowed, the gap becomes a hole if
+   * data gets written there. File sizes are stored on 32 bits though. */
+  if(offset > UINT32_MAX) {
+    return -1;
   }
 
+  FD[fd].fdoffset = (uint32_t)offset;
+
   return 0;
 }
 
-int fs_lseek(int fd, size_t offset) {
-  if(fd > FS_OPEN_MAX_COUNT - 1 ||fd < 0 ) {
+int fs_seek(int fd, size_t offset, int whence) {
+  if(!fs_fd_valid(fd)) {
+    return -1;
+  }
+
+  if(whence != FS_SEEK_DATA && whence != FS_SEEK_HOLE) {
+    return -1;
+  }
+
+  uint32_t entry = FD[fd].indexinroot;
+  uint32_t size = rootdir[entry].size_of_file;
+  if(offset >= size) {
     return -1;
   }
 
-  if(FD[fd].ifopened == 0) {
+  /* The end of the file counts as a hole */
+  uint32_t pos = whence == FS_SEEK_DATA ? offset : size;
+  if(rootdir[entry].flags & RDIR_MAPPED) {
+    uint32_t nblocks = fs_size_blocks(size);
+    int want_data = whence == FS_SEEK_DATA;
+    int compressed = rootdir[entry].flags & RDIR_COMPRESSED;
+    uint32_t lblk = offset / BLOCK_SIZE;
+
+    /* compressed files have data or holes by whole chunks: the blocks of a
+     * chunk come first, the unused entries that follow them are not holes */
+    if(compressed) {
+      lblk -= lblk % COMPRESS_CHUNK_BLOCKS;
+    }
+    lblk = fs_map_next(entry, lblk, nblocks, want_data);
+    while(compressed && !want_data && lblk < nblocks &&
+          lblk % COMPRESS_CHUNK_BLOCKS) {
+      lblk = fs_map_next(entry, lblk - lblk % COMPRESS_CHUNK_BLOCKS
+                         + COMPRESS_CHUNK_BLOCKS, nblocks, 0);
+    }
+
+    if(lblk == nblocks) {
+      if(want_data) {
+        return -1;
+      }
+      pos = size;
+    } else if((uint64_t)lblk * BLOCK_SIZE > offset) {
+      pos = lblk * BLOCK_SIZE;
+    } else {
+      pos = offset;
+    }
+  }
+
+  FD[fd].fdoffset = pos;
+  return pos;
+}
+
+
+/*
+ * Switch empty file @filename to storage mode @mode (RDIR_COMPRESSED or
+ * RDIR_DEDUP), or back to a plain file. Modes cannot be combined.
+ */
+static int fs_set_mode(const char *filename, uint8_t mode, int enable) {
+  if(!mounted || readonly || !filename) {
     return -1;
   }
 
-  if(offset > rootdir[FD[fd].indexinroot].size_of_file) {
+  uint32_t i = fs_lookup(filename);
+  if(*filename == '\0' || i == DIR_NONE) {
     return -1;
   }
 
-  FD[fd].fdoffset = (uint16_t)offset;
+  struct RootDir *file = &rootdir[i];
+  if(!enable == !(file->flags & mode)) {
+    return 0;
+  }
+
+  /* existing data is not converted, and block maps are per block */
+  if(file->size_of_file != 0 || (enable && superblock.cluster_shift)) {
+    return -1;
+  }
+
+  fs_async_drain();
+
+  if(enable) {
+    if(!(file->flags & RDIR_MAPPED) && fs_make_mapped(i) < 0) {
+      return -1;
+    }
+    file->flags &= ~(RDIR_COMPRESSED | RDIR_DEDUP);
+    file->flags |= mode;
+  } else {
+    /* back to an empty plain file */
+    fs_free_mapped(file);
+    fs_compress_forget(i);
+    file->index_first_datablk = FAT_EOC;
+    file->flags = 0;
+  }
 
   return 0;
 }
 
+int fs_set_compression(const char *filename, int enable) {
+  return fs_set_mode(filename, RDIR_COMPRESSED, enable);
+}
+
+int fs_set_dedup(const char *filename, int enable) {
+  return fs_set_mode(filename, RDIR_DEDUP, enable);
+}
+
+int fs_compression_stats(int fd, struct fs_compression_stats *stats) {
+  if(!fs_fd_valid(fd) || !stats) {
+    return -1;
+  }
+
+  fs_usage(FD[fd].indexinroot, &stats->data_blocks, &stats->stored_blocks);
+
+  return 0;
+}
 
-uint16_t fs_findfirstblock()
+uint32_t fs_findfirstblock()
 {
-  /* data block will start at block 1 to have same index with FAT */
-  uint16_t block = superblock.data_blk_start_index + 1;
-  while(block < superblock.total_blocks && fat[block]!= 0)
-    block++;
+  /* FAT entry #0 is reserved, allocation is first-fit from entry #1 */
+  uint32_t block = simd_ops()->find_zero32(fat, 1, superblock.num_data_blks);
 
-  if (block == superblock.total_blocks)
+  /* the blocks of deleted files may still be waiting to be reclaimed */
+  if (block >= superblock.num_data_blks && fs_reclaim_all())
+    block = simd_ops()->find_zero32(fat, 1, superblock.num_data_blks);
+  if (block >= superblock.num_data_blks)
     return FAT_EOC;
 
-  /* update in fat array */
-  fat[block] = block;
-  return block - superblock.data_blk_start_index;
+  /* the new block terminates its chain until it gets linked */
+  fat[block] = FAT_EOC;
+
+  /* the block may have been a cached map block before being freed */
+  fs_map_forget(block);
+  return block;
+}
+
+void fs_free_chain(uint32_t block)
+{
+  while(block != FAT_EOC && block != 0 && block < superblock.num_data_blks) {
+    uint32_t next = fat[block];
+    fat[block] = 0;
+    block = next;
+  }
 }
 
-uint16_t fs_get_block_from_offset(uint16_t firstblock, uint16_t offset)
+/*
+ * Return the FAT index of logical cluster @lclu of the file at root entry
+ * @entry, 0 if it lies in a hole of a mapped file, or FAT_EOC if it lies past
+ * the end of a plain chain. If @alloc is set, a missing cluster is allocated
+ * (and @fresh is set), FAT_EOC is then returned only when the disk is full.
+ * @hint remembers the position in a plain chain between successive calls.
+ * Mapped files only exist on volumes whose clusters are single blocks.
+ */
+static uint32_t fs_bmap(uint32_t entry, uint32_t lclu, int alloc,
+                        struct bmap_hint *hint, int *fresh)
 {
-  uint16_t block = firstblock + superblock.data_blk_start_index;
-  while(offset >= BLOCK_SIZE)
-  {
-    uint16_t newblock = fat[block];
-    if (newblock == 0 || newblock == FAT_EOC) {
-      newblock = fs_findfirstblock();
-      if (newblock == FAT_EOC)
+  struct RootDir *file = &rootdir[entry];
+  uint32_t block;
+
+  if (fresh)
+    *fresh = 0;
+
+  if (file->flags & RDIR_MAPPED) {
+    block = fs_map_get(entry, lclu) & MAP_BLOCK_MASK;
+    if (block != 0 || !alloc)
+      return block;
+    block = fs_findfirstblock();
+    if (block == FAT_EOC)
+      return FAT_EOC;
+    if (fs_map_set(entry, lclu, block) < 0) {
+      fat[block] = 0;
+      return FAT_EOC;
+    }
+    if (fresh)
+      *fresh = 1;
+    return block;
+  }
+
+  uint32_t pos = 0;
+  block = file->index_first_datablk;
+  if (hint && hint->block != FAT_EOC && hint->lclu <= lclu) {
+    pos = hint->lclu;
+    block = hint->block;
+  }
+
+  /* when file is an empty file and needs to extend the size */
+  if (block == FAT_EOC) {
+    if (!alloc)
+      return FAT_EOC;
+    block = file->index_first_datablk = fs_findfirstblock();
+    if (block == FAT_EOC)
+      return FAT_EOC;
+    if (fresh && lclu == 0)
+      *fresh = 1;
+  }
+
+  while (pos < lclu) {
+    uint32_t next = fat[block];
+    if (next == FAT_EOC) {
+      if (!alloc)
+        return FAT_EOC;
+      next = fs_findfirstblock();
+      if (next == FAT_EOC)
         return FAT_EOC;
-      newblock += superblock.data_blk_start_index;
-      fat[block] = newblock;
+      fat[block] = next;
+      if (fresh && pos + 1 == lclu)
+        *fresh = 1;
     }
-    block = newblock;
-    offset -= BLOCK_SIZE;
+    block = next;
+    pos++;
+  }
+
+  if (hint) {
+    hint->lclu = pos;
+    hint->block = block;
   }
   return block;
 }
 
-
-
-int fs_write(int fd, void *buf, size_t count)
+static void fs_iter_init(struct fs_iter *it, const struct iovec *iov,
+                         int iovcnt)
 {
-  if (!mounted) {
-    return -1;
+  it->iov = iov;
+  it->iovcnt = iovcnt;
+  it->skip = 0;
+  while (it->iovcnt > 0 && it->iov->iov_len == 0) {
+    it->iov++;
+    it->iovcnt--;
   }
+}
 
-  if(fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
-    return -1;
+static void fs_iter_advance(struct fs_iter *it, size_t len)
+{
+  while (len > 0) {
+    size_t n = it->iov->iov_len - it->skip;
+    if (n > len)
+      n = len;
+    it->skip += n;
+    len -= n;
+    if (it->skip == it->iov->iov_len) {
+      it->iov++;
+      it->iovcnt--;
+      it->skip = 0;
+    }
   }
-
-  if(FD[fd].ifopened == 0) {
-    return -1;
+  while (it->iovcnt > 0 && it->iov->iov_len == 0) {
+    it->iov++;
+    it->iovcnt--;
   }
+}
+
+/* Return the rest of the current buffer, its length in @avail */
+static uint8_t *fs_iter_peek(const struct fs_iter *it, size_t *avail)
+{
+  *avail = it->iov->iov_len - it->skip;
+  return (uint8_t *)it->iov->iov_base + it->skip;
+}
 
-  /* get the starting index of block in root entries */
-  uint16_t entry = FD[fd].indexinroot;
-  uint16_t firstblock = rootdir[entry].index_first_datablk;
+/*
+ * Return the rest of the current buffer, at most @len bytes of it in @n, and
+ * move past it
+ */
+static uint8_t *fs_iter_next(struct fs_iter *it, size_t len, size_t *n)
+{
+  uint8_t *p = (uint8_t *)it->iov->iov_base + it->skip;
 
+  *n = it->iov->iov_len - it->skip;
+  if (*n > len)
+    *n = len;
+  fs_iter_advance(it, *n);
+  return p;
+}
 
-  /* when file is an empty file and needs to extend the size */
-  if (firstblock == FAT_EOC && count > 0)
-  {
-    firstblock = rootdir[entry].index_first_datablk = fs_findfirstblock();
-    if (firstblock == FAT_EOC)
-      return 0;
+/* Copy the next @len bytes out of the buffers to @dst */
+static void fs_iter_gather(struct fs_iter *it, uint8_t *dst, size_t len)
+{
+  while (len > 0) {
+    size_t n;
+    const uint8_t *src = fs_iter_next(it, len, &n);
+    memcpy(dst, src, n);
+    dst += n;
+    len -= n;
   }
+}
 
-  int byteswritten = 0;
-  uint16_t offset = FD[fd].fdoffset;
+/* Copy @len bytes from @src into the next bytes of the buffers */
+static void fs_iter_scatter(struct fs_iter *it, const uint8_t *src, size_t len)
+{
+  while (len > 0) {
+    size_t n;
+    uint8_t *dst = fs_iter_next(it, len, &n);
+    memcpy(dst, src, n);
+    src += n;
+    len -= n;
+  }
+}
+
+/*
+ * Transfer @count whole blocks from disk block @block, directly or through
+ * @io when it is given
+ */
+static int fs_io_range(const struct fs_io *io, int write, size_t block,
+                       size_t count, void *buf)
+{
+  if (io)
+    return io->transfer(io->ctx, write, block, count, buf);
+  return write ? block_write_range(block, count, buf)
+               : block_read_range(block, count, buf);
+}
 
-  /* 1. check the position of offset in block. and set the bytesleft
-   * 2. convert offset position into the corresponding data block
-   * 3. copy the content of block out to tempbuf
-   * 4. copy the rest of the block content from @buf
-   * 5. overwritten the whole block with tempbuf */
+/*
+ * Write the next @count bytes of @it at @offset of plain or mapped file
+ * @entry, whose size was @old_size, a cluster at a time. Whole blocks are
+ * written straight from the user buffer, all those of a cluster in one
+ * transfer, unless they straddle several buffers. Return the number of bytes
+ * written.
+ */
+static uint32_t fs_write_clusters(uint32_t entry, uint32_t offset,
+                                  struct fs_iter *it, uint32_t count,
+                                  uint32_t old_size, struct bmap_hint *hint,
+                                  const struct fs_io *io)
+{
+  uint32_t csize = fs_cluster_size();
   uint8_t tmpbuffer[BLOCK_SIZE];
-  while(count > 0)
-  {
-    uint16_t bytesleft = BLOCK_SIZE - (offset % BLOCK_SIZE);
+  uint32_t written = 0;
+
+  /* 1. convert offset position into the corresponding cluster
+   * 2. write the whole blocks that follow in the cluster at once
+   * 3. otherwise copy the content of the block out to tempbuf, unless the
+   *    cluster is new, copy the rest of the block content from @buf and
+   *    overwrite the whole block with tempbuf */
+  while (count > 0) {
+    uint32_t incluster = offset % csize;
+    uint32_t inblock = incluster % BLOCK_SIZE;
+    uint32_t bytesleft = csize - incluster;
     if (bytesleft > count)
       bytesleft = count;
 
-    uint16_t block = fs_get_block_from_offset(firstblock, offset);
-    if (block == FAT_EOC || block_read(block, tmpbuffer) < 0)
-      break;
-
-    memcpy(tmpbuffer + (offset % BLOCK_SIZE), buf + byteswritten, bytesleft);
-    if (block_write(block, tmpbuffer) < 0)
+    int fresh;
+    uint32_t cluster = fs_bmap(entry, offset / csize, 1, hint, &fresh);
+    if (cluster == FAT_EOC)
       break;
+    size_t block = fs_cluster_block(cluster) + incluster / BLOCK_SIZE;
+
+    if (inblock == 0 && bytesleft >= BLOCK_SIZE) {
+      size_t avail;
+      uint8_t *src = fs_iter_peek(it, &avail);
+      if (avail >= BLOCK_SIZE) {
+        if (bytesleft > avail)
+          bytesleft = avail;
+        bytesleft -= bytesleft % BLOCK_SIZE;
+        if (fs_io_range(io, 1, block, bytesleft / BLOCK_SIZE, src) < 0)
+          break;
+        fs_iter_advance(it, bytesleft);
+      } else {
+        /* the block straddles user buffers, assemble it */
+        bytesleft = BLOCK_SIZE;
+        fs_iter_gather(it, tmpbuffer, BLOCK_SIZE);
+        if (block_write(block, tmpbuffer) < 0)
+          break;
+      }
+    } else {
+      uint32_t blockstart = offset - inblock;
+      if (bytesleft > BLOCK_SIZE - inblock)
+        bytesleft = BLOCK_SIZE - inblock;
+      if (fresh) {
+        memset(tmpbuffer, 0, BLOCK_SIZE);
+      } else {
+        if (block_read(block, tmpbuffer) < 0)
+          break;
+        /* whatever lies past the end of the file reads as zeros */
+        if (old_size < (uint64_t)blockstart + BLOCK_SIZE) {
+          uint32_t keep = old_size > blockstart ? old_size - blockstart : 0;
+          memset(tmpbuffer + keep, 0, BLOCK_SIZE - keep);
+        }
+      }
+      fs_iter_gather(it, tmpbuffer + inblock, bytesleft);
+      if (block_write(block, tmpbuffer) < 0)
+        break;
+    }
 
     count -= bytesleft;
-    byteswritten += bytesleft;
+    written += bytesleft;
     offset += bytesleft;
   }
 
-  if (rootdir[entry].size_of_file < offset)
-    rootdir[entry].size_of_file = offset;
+  return written;
+}
+
+/*
+ * Write the next @count bytes of @it at @offset of file @entry. Return the
+ * number of bytes written.
+ */
+static int fs_write_iter(uint32_t entry, uint32_t offset, struct fs_iter *it,
+                         size_t count, const struct fs_io *io)
+{
+  struct RootDir *file = &rootdir[entry];
+  uint32_t old_size = file->size_of_file;
+
+  /* file size is stored on 32 bits */
+  if (count > UINT32_MAX - offset)
+    count = UINT32_MAX - offset;
+
+  /* on volumes with packing, small files share packed blocks until they
+   * outgrow PACK_MAX_SIZE */
+  int pack = count > 0 && (uint64_t)offset + count <= PACK_MAX_SIZE &&
+             superblock.pack && !superblock.cluster_shift &&
+             ((file->flags & RDIR_PACKED) ||
+              (file->flags == 0 && file->index_first_datablk == FAT_EOC));
+  if (count > 0 && !pack && (file->flags & RDIR_PACKED) &&
+      fs_unpack(entry) < 0)
+    return 0;
+
+  int byteswritten = 0;
+  struct bmap_hint hint = { 0, FAT_EOC };
+
+  /* writing further than right after the last block leaves a hole, which
+   * only a block map can represent; clustered volumes have no block maps,
+   * the gap is written as zeros there */
+  if (count > 0 && !(file->flags & RDIR_MAPPED) &&
+      offset / BLOCK_SIZE > fs_size_blocks(old_size)) {
+    if (!superblock.cluster_shift && fs_make_mapped(entry) < 0)
+      return 0;
+    for (uint32_t pos = old_size; superblock.cluster_shift && pos < offset;) {
+      uint32_t n = BLOCK_SIZE - pos % BLOCK_SIZE;
+      if (n > offset - pos)
+        n = offset - pos;
+      struct iovec zeros = { (void *)zero_block, n };
+      struct fs_iter zit;
+      fs_iter_init(&zit, &zeros, 1);
+      if (fs_write_clusters(entry, pos, &zit, n, old_size, &hint, NULL) != n)
+        return 0;
+      pos += n;
+      file->size_of_file = pos;
+    }
+  }
+
+  /* packed files are rewritten as a whole, compressed files chunk by
+   * chunk, deduplicated files share their blocks; they take one user buffer
+   * at a time */
+  while (count > 0 &&
+         (pack || (file->flags & (RDIR_COMPRESSED | RDIR_DEDUP)))) {
+    size_t len;
+    const uint8_t *buf = fs_iter_next(it, count, &len);
+    int n;
+    if (pack)
+      n = fs_pack_write(entry, offset, buf, len);
+    else if (file->flags & RDIR_COMPRESSED)
+      n = fs_compress_write(entry, offset, buf, len);
+    else
+      n = fs_dedup_write(entry, offset, buf, len);
+    /* nothing written, e.g. on a full disk: the size stays */
+    if (n <= 0) {
+      count = 0;
+      break;
+    }
+    byteswritten += n;
+    offset += n;
+    count = (size_t)n < len ? 0 : count - len;
+    /* the next buffer may depend on the size, as packed files do */
+    if (file->size_of_file < offset)
+      file->size_of_file = offset;
+  }
+
+  if (count > 0) {
+    uint32_t n = fs_write_clusters(entry, offset, it, count, old_size, &hint,
+                                   io);
+    byteswritten += n;
+    offset += n;
+  }
+
+  /* an empty write past the end of the file leaves it as it is */
+  if (byteswritten > 0 && file->size_of_file < offset)
+    file->size_of_file = offset;
 
-  FD[fd].fdoffset = offset;
   return byteswritten;
+}
+
+int fs_write_at(uint32_t entry, uint32_t offset, const uint8_t *buf,
+                size_t count, const struct fs_io *io)
+{
+  struct iovec iov = { (void *)buf, count };
+  struct fs_iter it;
 
+  fs_iter_init(&it, &iov, 1);
+  return fs_write_iter(entry, offset, &it, count, io);
 }
 
-int fs_read(int fd, void *buf, size_t count)
+/*
+ * Total length of the @iovcnt buffers of @iov, -1 if it does not fit in the
+ * int returned by the vectored functions
+ */
+static ssize_t fs_iov_length(const struct iovec *iov, int iovcnt)
 {
-  if (!mounted) {
+  size_t total = 0;
+
+  if (iovcnt < 0 || (iovcnt > 0 && !iov))
     return -1;
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > (size_t)INT_MAX - total)
+      return -1;
+    total += iov[i].iov_len;
   }
+  return total;
+}
 
-  if(fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
+int fs_write(int fd, void *buf, size_t count)
+{
+  if (!mounted || readonly) {
     return -1;
   }
 
-  if(FD[fd].ifopened == 0) {
+  if(!fs_fd_valid(fd)) {
     return -1;
   }
 
-  uint16_t targetblock = rootdir[FD[fd].indexinroot].index_first_datablk;
+  int written = fs_write_at(FD[fd].indexinroot, FD[fd].fdoffset, buf, count,
+                            NULL);
+  FD[fd].fdoffset += written;
+  return written;
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+  if (!mounted || readonly || !fs_fd_valid(fd))
+    return -1;
+
+  ssize_t count = fs_iov_length(iov, iovcnt);
+  if (count < 0)
+    return -1;
+
+  struct fs_iter it;
+  fs_iter_init(&it, iov, iovcnt);
+  int written = fs_write_iter(FD[fd].indexinroot, FD[fd].fdoffset, &it, count,
+                              NULL);
+  FD[fd].fdoffset += written;
+  return written;
+}
+
+/*
+ * Read @count bytes at @offset of file @entry into the next bytes of @it.
+ * Return the number of bytes read, or -1 on error.
+ */
+static int fs_read_iter(uint32_t entry, uint32_t offset, struct fs_iter *it,
+                        size_t count, const struct fs_io *io)
+{
   uint8_t tmp[BLOCK_SIZE];
-  uint16_t byte_readed = 0;
-  uint32_t size_of_current_file = rootdir[FD[fd].indexinroot].size_of_file;
+  int byte_readed = 0;
+  uint32_t size_of_current_file = rootdir[entry].size_of_file;
+  struct bmap_hint hint = { 0, FAT_EOC };
 
-  if (FD[fd].fdoffset + count > size_of_current_file) {
-    count = size_of_current_file - FD[fd].fdoffset;
+  if (offset >= size_of_current_file) {
+    return 0;
+  }
+  if (count > size_of_current_file - offset) {
+    count = size_of_current_file - offset;
   }
 
-
-  /* To get the bytes after the offset within the block */
-  uint16_t bytestoread = (uint16_t )BLOCK_SIZE - (FD[fd].fdoffset % (uint16_t )BLOCK_SIZE);
-  if (bytestoread > count) {
-    bytestoread = (uint16_t )count;
+  /* compressed and packed files are read one user buffer at a time */
+  if (rootdir[entry].flags & (RDIR_COMPRESSED | RDIR_PACKED)) {
+    while (count > 0) {
+      size_t len;
+      uint8_t *buf = fs_iter_next(it, count, &len);
+      int n;
+      if (rootdir[entry].flags & RDIR_COMPRESSED) {
+        n = fs_compress_read(entry, offset, buf, len);
+      } else {
+        n = fs_pack_read(entry, offset, buf, len) < 0 ? -1 : (int)len;
+      }
+      if (n < 0) {
+        return byte_readed ? byte_readed : -1;
+      }
+      byte_readed += n;
+      offset += n;
+      if ((size_t)n < len) {
+        break;
+      }
+      count -= len;
+    }
+    return byte_readed;
   }
 
+  uint32_t csize = fs_cluster_size();
   while(count > 0) {
-    uint16_t block = fs_get_block_from_offset(targetblock, FD[fd].fdoffset);
-    if(block_read(block, tmp) == -1){
-      return -1;
+    /* To get the bytes after the offset within the cluster and the block */
+    uint32_t incluster = offset % csize;
+    uint32_t inblock = incluster % BLOCK_SIZE;
+    uint32_t bytestoread = csize - incluster;
+    if (bytestoread > count) {
+      bytestoread = count;
     }
-    if(block == FAT_EOC) {
+
+    uint32_t cluster = fs_bmap(entry, offset / csize, 0, &hint, NULL);
+    if(cluster == FAT_EOC) {
       break;
     }
-    memcpy(buf + byte_readed, tmp + (FD[fd].fdoffset % BLOCK_SIZE), bytestoread);
+    size_t block = fs_cluster_block(cluster) + incluster / BLOCK_SIZE;
+
+    size_t avail;
+    uint8_t *dst = fs_iter_peek(it, &avail);
+
+    if(cluster == 0) {
+      /* holes read as zeros, without any disk access */
+      if (bytestoread > BLOCK_SIZE - inblock) {
+        bytestoread = BLOCK_SIZE - inblock;
+      }
+      fs_iter_scatter(it, zero_block, bytestoread);
+    } else if(inblock == 0 && bytestoread >= BLOCK_SIZE &&
+              avail >= BLOCK_SIZE) {
+      /* whole blocks go straight to the user buffer, those of a cluster in
+       * one transfer */
+      if (bytestoread > avail) {
+        bytestoread = avail;
+      }
+      bytestoread -= bytestoread % BLOCK_SIZE;
+      if(fs_io_range(io, 0, block, bytestoread / BLOCK_SIZE, dst) == -1){
+        return -1;
+      }
+      fs_iter_advance(it, bytestoread);
+    } else {
+      /* partial blocks, and blocks straddling user buffers */
+      if (bytestoread > BLOCK_SIZE - inblock) {
+        bytestoread = BLOCK_SIZE - inblock;
+      }
+      if(block_read(block, tmp) == -1){
+        return -1;
+      }
+      fs_iter_scatter(it, tmp + inblock, bytestoread);
+    }
 
     byte_readed = byte_readed + bytestoread;
     count = count - bytestoread;
-    FD[fd].fdoffset = FD[fd].fdoffset + bytestoread;
-    bytestoread = (uint16_t )BLOCK_SIZE - (FD[fd].fdoffset % (uint16_t )BLOCK_SIZE);
+    offset = offset + bytestoread;
   }
 
   return byte_readed;
-}
\ No newline at end of file
+}
+
+int fs_read_at(uint32_t entry, uint32_t offset, uint8_t *buf, size_t count,
+               const struct fs_io *io)
+{
+  struct iovec iov = { buf, count };
+  struct fs_iter it;
+
+  fs_iter_init(&it, &iov, 1);
+  return fs_read_iter(entry, offset, &it, count, io);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+  if (!mounted) {
+    return -1;
+  }
+
+  if(!fs_fd_valid(fd)) {
+    return -1;
+  }
+
+  int readed = fs_read_at(FD[fd].indexinroot, FD[fd].fdoffset, buf, count,
+                          NULL);
+  if (readed > 0) {
+    FD[fd].fdoffset += readed;
+  }
+  return readed;
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+  if (!mounted || !fs_fd_valid(fd))
+    return -1;
+
+  ssize_t count = fs_iov_length(iov, iovcnt);
+  if (count < 0)
+    return -1;
+
+  struct fs_iter it;
+  fs_iter_init(&it, iov, iovcnt);
+  int readed = fs_read_iter(FD[fd].indexinroot, FD[fd].fdoffset, &it, count,
+                            NULL);
+  if (readed > 0)
+    FD[fd].fdoffset += readed;
+  return readed;
+}
+
+/*
+ * Share the whole blocks of deduplicated file @in from @off_in on with
+ * deduplicated file @out from @off_out on, both block aligned, for at most
+ * @len bytes. Return the number of bytes shared.
+ */
+static size_t fs_copy_share(uint32_t in, uint32_t off_in, uint32_t out,
+                            uint32_t off_out, size_t len)
+{
+  struct RootDir *dst = &rootdir[out];
+  size_t shared = 0;
+
+  /* asynchronous writes must land before the blocks get shared */
+  fs_async_drain();
+
+  while (len - shared >= BLOCK_SIZE) {
+    int n = fs_dedup_share(out, (off_out + shared) / BLOCK_SIZE, in,
+                           (off_in + shared) / BLOCK_SIZE,
+                           (len - shared) / BLOCK_SIZE);
+    if (n <= 0)
+      break;
+    shared += (size_t)n * BLOCK_SIZE;
+    if (dst->size_of_file < off_out + shared)
+      dst->size_of_file = off_out + shared;
+  }
+
+  return shared;
+}
+
+int fs_copy_range(int fd_in, size_t off_in, int fd_out, size_t off_out,
+                  size_t len)
+{
+  if (!mounted || readonly || !fs_fd_valid(fd_in) || !fs_fd_valid(fd_out)) {
+    return -1;
+  }
+  if (off_in > UINT32_MAX || off_out > UINT32_MAX) {
+    return -1;
+  }
+
+  uint32_t in = FD[fd_in].indexinroot;
+  uint32_t out = FD[fd_out].indexinroot;
+  uint32_t size = rootdir[in].size_of_file;
+
+  /* nothing is copied past the end of the source */
+  if (off_in >= size) {
+    return 0;
+  }
+  if (len > size - off_in) {
+    len = size - off_in;
+  }
+  if (len > INT_MAX) {
+    len = INT_MAX;
+  }
+  if (in == out && off_in < off_out + len && off_out < off_in + len) {
+    return -1;
+  }
+
+  /* deduplicated files share the blocks whose offsets line up, the rest
+   * goes through a bounce buffer of a few blocks */
+  int share = (rootdir[in].flags & rootdir[out].flags & RDIR_DEDUP) &&
+              off_in % BLOCK_SIZE == off_out % BLOCK_SIZE;
+  uint8_t *buf = NULL;
+  size_t copied = 0;
+  int failed = 0;
+
+  while (copied < len) {
+    uint32_t pos_in = off_in + copied;
+    size_t n = len - copied;
+
+    if (share && pos_in % BLOCK_SIZE == 0 && n >= BLOCK_SIZE) {
+      size_t shared = fs_copy_share(in, pos_in, out, off_out + copied, n);
+      copied += shared;
+      if (shared > 0) {
+        continue;
+      }
+      /* copy one block before trying again */
+      n = BLOCK_SIZE;
+    } else if (share && pos_in % BLOCK_SIZE != 0) {
+      /* up to the next block boundary */
+      if (n > BLOCK_SIZE - pos_in % BLOCK_SIZE) {
+        n = BLOCK_SIZE - pos_in % BLOCK_SIZE;
+      }
+    }
+
+    if (n > COPY_CHUNK_BLOCKS * BLOCK_SIZE) {
+      n = COPY_CHUNK_BLOCKS * BLOCK_SIZE;
+    }
+    if (!buf) {
+      buf = malloc(COPY_CHUNK_BLOCKS * BLOCK_SIZE);
+      if (!buf) {
+        failed = 1;
+        break;
+      }
+    }
+
+    int readed = fs_read_at(in, pos_in, buf, n, NULL);
+    if (readed <= 0) {
+      failed = readed < 0;
+      break;
+    }
+    int written = fs_write_at(out, off_out + copied, buf, readed, NULL);
+    copied += written;
+    if (written < readed) {
+      break;
+    }
+  }
+
+  free(buf);
+  if (copied == 0 && failed) {
+    return -1;
+  }
+  return copied;
+}
+
+int fs_truncate(int fd, size_t length) {
+  if(!mounted || readonly || !fs_fd_valid(fd)) {
+    return -1;
+  }
+  if(length > UINT32_MAX) {
+    return -1;
+  }
+
+  uint32_t entry = FD[fd].indexinroot;
+  struct RootDir *file = &rootdir[entry];
+  uint32_t size = file->size_of_file;
+
+  if(length == size) {
+    return 0;
+  }
+
+  /* transfers to the blocks about to be freed must be done */
+  fs_async_drain();
+
+  /* growing the file is writing its last byte, which leaves a hole, or
+   * zeros on volumes with clusters */
+  if(length > size) {
+    if(fs_write_at(entry, length - 1, zero_block, 1, NULL) == 1) {
+      return 0;
+    }
+    /* the zeros written on the way before it failed are given back */
+    if(file->size_of_file > size) {
+      fs_truncate(fd, size);
+    }
+    file->size_of_file = size;
+    return -1;
+  }
+
+  /* packed files only keep their first bytes */
+  if(file->flags & RDIR_PACKED) {
+    if(length == 0) {
+      fs_pack_free(entry);
+      file->index_first_datablk = FAT_EOC;
+      file->pack_offset = 0;
+      file->flags &= ~RDIR_PACKED;
+    }
+    file->size_of_file = length;
+    return 0;
+  }
+
+  /* whatever lies past the end of the file must read as zeros once it grows
+   * again: the rest of the last block is cleared, and of the last chunk of a
+   * compressed file */
+  uint32_t keep = fs_size_blocks(length);
+  if(file->flags & RDIR_COMPRESSED) {
+    if(fs_compress_truncate(entry, length) < 0) {
+      return -1;
+    }
+    keep = ((uint64_t)length + COMPRESS_CHUNK_SIZE - 1) / COMPRESS_CHUNK_SIZE *
+           COMPRESS_CHUNK_BLOCKS;
+  } else if(length % BLOCK_SIZE &&
+            (!(file->flags & RDIR_MAPPED) ||
+             (fs_map_get(entry, length / BLOCK_SIZE) & MAP_BLOCK_MASK))) {
+    uint32_t end = (uint64_t)keep * BLOCK_SIZE < size ? keep * BLOCK_SIZE
+                                                       : size;
+    if(fs_write_at(entry, length, zero_block, end - length, NULL) !=
+       (int)(end - length)) {
+      return -1;
+    }
+  }
+
+  if(file->flags & RDIR_MAPPED) {
+    if(fs_map_truncate(entry, keep) < 0) {
+      return -1;
+    }
+    fs_compress_forget(entry);
+  } else {
+    /* the chain is cut after the last cluster kept */
+    uint32_t csize = fs_cluster_size();
+    uint32_t clusters = ((uint64_t)length + csize - 1) / csize;
+    if(clusters == 0) {
+      fs_reclaim_chain(file->index_first_datablk);
+      file->index_first_datablk = FAT_EOC;
+    } else {
+      uint32_t last = fs_bmap(entry, clusters - 1, 0, NULL, NULL);
+      if(last != FAT_EOC && last != 0) {
+        uint32_t rest = fat[last];
+        fat[last] = FAT_EOC;
+        fs_reclaim_chain(rest);
+      }
+    }
+  }
+
+  file->size_of_file = length;
+  return 0;
+}
@@ -2,29 +2,123 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
 
-/** Maximum number of files in the root directory */
+/**
+ * Number of files held by one block of the root directory, which grows by
+ * whole blocks as files are created
+ */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Initial size of the file descriptor table, grown as files are opened */
 #define FS_OPEN_MAX_COUNT 32
 
+/** fs_seek() modes */
+#define FS_SEEK_DATA 0
+#define FS_SEEK_HOLE 1
+
+/**
+ * Completion callback of an asynchronous request @req, whose result is
+ * @result, see fs_read_async() and fs_write_async()
+ */
+typedef void (*fs_async_cb)(int req, int result, void *data);
+
+/** Block usage of a file, see fs_compression_stats() */
+struct fs_compression_stats {
+  size_t data_blocks;   /* blocks of file data, holes excluded */
+  size_t stored_blocks; /* data blocks actually used on disk */
+};
+
+/** Description of a file, see fs_readdir() and fs_stat_name() */
+struct fs_dirent {
+  char name[FS_FILENAME_LEN];
+  size_t size;        /* size of the file in bytes */
+  size_t first_block; /* first data block, or root map block, 0 if none */
+  /* Set by fs_stat_name() only, which walks the data of the file (0 when
+   * listed by fs_readdir()) */
+  size_t blocks;      /* data blocks actually used on disk */
+  size_t runs;        /* runs of consecutive data blocks (fragments) */
+};
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
  *
  * Open the virtual disk file @diskname and mount the file system that it
  * contains. A file system needs to be mounted before files can be read from it
- * with fs_read() or written to it with fs_write().
+ * with fs_read() or written to it with fs_write(). Both the original format
+ * with 16-bit block indices and version 2 with 32-bit block indices, for
+ * volumes of more than 65535 blocks, are supported. On version 2 volumes made
+ * with block checksums, a block whose content does not match its checksum
+ * cannot be read, and the functions reading it fail.
  *
- * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * Return: -1 if virtual disk file @diskname cannot be opened, if it is one of
+ * the files of a striped file system (see fs_mount_striped()), or if no valid
  * file system can be located. 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_striped - Mount a file system striped over several files
+ * @disknames: Names of the virtual disk files
+ * @count: Number of virtual disk files
+ * @stripe: Stripe unit in bytes, a multiple of 4096, or 0 for the one recorded
+ *
+ * Mount the file system of the disk made of the @count virtual disk files of
+ * @disknames, striped by units of @stripe bytes like fs_make makes them with
+ * its -S option (see block_disk_open_striped()). The blocks of large transfers
+ * are read from and written to all the files in parallel. The image records
+ * its number of files and stripe unit, which must match @count and @stripe,
+ * and the files must be given in the order they were made in.
+ *
+ * Return: -1 if any of the virtual disk files cannot be opened, if @count or
+ * @stripe is not what the file system was made with, or if no valid file
+ * system can be located. 0 otherwise.
+ */
+int fs_mount_striped(const char *const *disknames, int count, size_t stripe);
+
+/**
+ * fs_mount_readonly - Mount a file system for reading only
+ * @diskname: Name of the virtual disk file
+ *
+ * Mount the file system of virtual disk file @diskname like fs_mount(), but
+ * without ever writing to it, so that any number of processes can mount it
+ * read-only at the same time (though none read-write). The FAT of version 2
+ * volumes and the block checksums are mapped from the disk rather than copied,
+ * the processes share their pages. The functions that would change the file
+ * system fail: fs_create(), fs_delete(), fs_write(), fs_writev(),
+ * fs_write_async(), fs_truncate(), fs_copy_range(), fs_set_compression(),
+ * fs_set_dedup(), fs_clone(), fs_snapshot(), fs_snapshot_restore(),
+ * fs_defrag() and fs_check() when repairing. Unmounting writes nothing back.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. 0 otherwise.
+ */
+int fs_mount_readonly(const char *diskname);
+
+/**
+ * fs_mount_memory - Mount a file system held in memory
+ * @diskname: Name of the virtual disk file
+ *
+ * Mount the file system of virtual disk file @diskname like fs_mount(), but
+ * with the disk held in memory (see block_disk_open_memory()): once a block
+ * has been accessed, the operations on it run at memory speed, without any
+ * disk I/O. The disk file is only updated by fs_sync() and fs_umount(), so
+ * that the changes made since are lost if the process dies, which suits test
+ * runs and scratch file systems.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened or mapped in
+ * memory, or if no valid file system can be located. 0 otherwise.
+ */
+int fs_mount_memory(const char *diskname);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -32,10 +126,25 @@ int fs_mount(const char *diskname);
  * disk file.
  *
  * Return: -1 if no underlying virtual disk was opened, or if the virtual disk
- * cannot be closed, or if there are still open file descriptors. 0 otherwise.
+ * cannot be closed, or if there are still open file descriptors or
+ * asynchronous requests that are not reaped. 0 otherwise.
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Persist the file system
+ *
+ * Wait for the outstanding asynchronous writes, write the metadata of the
+ * currently mounted file system back to the disk, as fs_umount() does, then
+ * have the disk persist everything written to it. On a file system mounted with
+ * fs_mount_memory(), that is when the disk file gets updated. Nothing is done
+ * on a file system mounted read-only.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if the file system
+ * cannot be written back. 0 otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -55,8 +164,8 @@ int fs_info(void);
  * character).
  *
  * Return: -1 if @filename is invalid, if a file named @filename already exists,
- * or if string @filename is too long, or if the root directory already contains
- * %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * or if string @filename is too long, or if the root directory is full and the
+ * disk has no free block to extend it. 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -81,6 +190,38 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_readdir - Read directory entries
+ * @pos: Position in the root directory, 0 to start from the beginning
+ * @ents: Array filled with the entries
+ * @count: Number of entries of @ents
+ *
+ * Fill @ents with the description of up to @count files of the root
+ * directory, starting at position @pos, and advance @pos past them, so that
+ * successive calls list all the files in batches. Snapshots are not listed.
+ * Files created or deleted between calls may or may not be listed. Only the
+ * fields kept in the directory are filled, the others are 0: listing takes no
+ * disk access.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if the arguments are
+ * invalid. Otherwise return the number of entries filled, 0 once every file
+ * has been listed.
+ */
+int fs_readdir(size_t *pos, struct fs_dirent *ents, int count);
+
+/**
+ * fs_stat_name - Get the description of a file
+ * @filename: File name
+ * @ent: Filled with the description of the file
+ *
+ * Describe file @filename, as fs_readdir() would, without opening it, also
+ * counting the blocks used by its data and how fragmented they are.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @filename is
+ * invalid, or if there is no file named @filename. 0 otherwise.
+ */
+int fs_stat_name(const char *filename, struct fs_dirent *ent);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -90,12 +231,13 @@ int fs_ls(void);
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * descriptors. The descriptor table grows as needed, starting with
+ * %FS_OPEN_MAX_COUNT descriptors; the lowest free descriptor is not
+ * necessarily the one returned.
  *
  * Return: -1 if @filename is invalid, there is no file named @filename to open,
- * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
- * return the file descriptor.
+ * or if the descriptor table cannot grow. Otherwise, return the file
+ * descriptor.
  */
 int fs_open(const char *filename);
 
@@ -130,12 +272,195 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * The offset can be set past the end of the file. If data is later written at
+ * this offset, the gap between the previous end of the file and the written
+ * data becomes a hole, which reads as zeros and does not consume data blocks.
+ *
  * Return: -1 if file descriptor @fd is invalid (i.e., out of bounds, or not
- * currently open), or if @offset is larger than the current file size. 0
- * otherwise.
+ * currently open), or if @offset cannot be represented as a 32-bit file size.
+ * 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
+/**
+ * fs_seek - Move file offset to the next data or hole
+ * @fd: File descriptor
+ * @offset: File offset to start searching from
+ * @whence: %FS_SEEK_DATA or %FS_SEEK_HOLE
+ *
+ * Set the file offset associated with file descriptor @fd to the first offset
+ * greater than or equal to @offset that contains data (%FS_SEEK_DATA) or that
+ * lies in a hole (%FS_SEEK_HOLE). Holes are tracked with a granularity of one
+ * block, and the end of the file always counts as a hole.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @whence is invalid, if @offset is not smaller than the file size,
+ * or if there is no data past @offset (%FS_SEEK_DATA). Otherwise return the new
+ * file offset.
+ */
+int fs_seek(int fd, size_t offset, int whence);
+
+/**
+ * fs_truncate - Set the size of a file
+ * @fd: File descriptor
+ * @length: New size of the file
+ *
+ * Shrink or extend the file referenced by file descriptor @fd to @length
+ * bytes. The blocks past the new end of a shrunk file are freed, or queued
+ * for reclamation (see fs_set_deferred_free()). An extended file reads as
+ * zeros past its former end, which is a hole when the file can have holes.
+ * The file offsets of the descriptors of the file are not changed.
+ *
+ * Return: -1 if file descriptor @fd is invalid, if @length cannot be
+ * represented as a 32-bit file size, or if the file cannot be resized for lack
+ * of space or because of an I/O error. 0 otherwise.
+ */
+int fs_truncate(int fd, size_t length);
+
+/**
+ * fs_defrag - Defragment the file system incrementally
+ * @budget: Number of blocks (or clusters) to move at most, 0 for no limit
+ *
+ * Move the data blocks of the files so that each of them lies in consecutive
+ * blocks (see the runs of struct fs_dirent), the files one after the other
+ * from the start of the disk, which gathers the free space at its end. Up to
+ * about @budget blocks are moved by a call, a few hundreds at a time, so that
+ * defragmenting can be interleaved with other accesses; the next call resumes
+ * where this one stopped. Files are consistent at all times. The blocks of
+ * deduplicated and packed files, and of snapshots, are not moved.
+ *
+ * Return: -1 if no underlying virtual disk was opened or on error, 1 if the
+ * budget ran out before the end, 0 once there is nothing left to move.
+ */
+int fs_defrag(size_t budget);
+
+/**
+ * fs_set_deferred_free - Defer the freeing of blocks
+ * @enable: Whether the blocks of deleted and truncated files should be freed
+ * later
+ *
+ * When enabled, fs_delete() and fs_truncate() detach the chains and block maps
+ * they free and queue them, instead of walking them, so that their cost no
+ * longer depends on the size of the file. Queued blocks are reclaimed by
+ * fs_reclaim(), and all at once when no free block is left to allocate, by
+ * fs_info() and fs_check(), and when unmounting. Disabling it reclaims the
+ * queued blocks. It is disabled when mounting.
+ *
+ * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+ */
+int fs_set_deferred_free(int enable);
+
+/**
+ * fs_reclaim - Reclaim queued blocks
+ * @budget: Approximate number of blocks to reclaim at most, 0 for all of them
+ *
+ * Free blocks queued by fs_delete() and fs_truncate() while freeing is
+ * deferred, by batches of about @budget blocks, for instance when the
+ * application is idle.
+ *
+ * Return: -1 if no underlying virtual disk was opened, 1 if blocks remain
+ * queued, 0 otherwise.
+ */
+int fs_reclaim(size_t budget);
+
+/**
+ * fs_set_compression - Enable or disable compression of a file
+ * @filename: File name
+ * @enable: Whether the file should be compressed
+ *
+ * Make the data of file @filename transparently compressed by fs_write() and
+ * decompressed by fs_read(). Data is compressed by chunks of a few blocks with
+ * a fast LZ codec, chunks that do not shrink by at least one block being
+ * stored as is. Random accesses only decompress the chunks they touch. A file
+ * cannot be both compressed and deduplicated.
+ *
+ * Return: -1 if @filename is invalid, if there is no file named @filename, if
+ * the file is not empty and its compression mode would change, or if
+ * compression is enabled on a volume with clusters of several blocks. 0
+ * otherwise.
+ */
+int fs_set_compression(const char *filename, int enable);
+
+/**
+ * fs_set_dedup - Enable or disable block deduplication of a file
+ * @filename: File name
+ * @enable: Whether the blocks of the file should be deduplicated
+ *
+ * Make fs_write() share the data blocks of file @filename with those of the
+ * other deduplicated files holding the same content, instead of allocating new
+ * ones. Shared blocks are reference counted: modifying one copies it first,
+ * and deleting a file only frees the blocks that no other file references.
+ * Blocks full of zeros are not stored at all. A file cannot be both
+ * deduplicated and compressed.
+ *
+ * Return: -1 if @filename is invalid, if there is no file named @filename, if
+ * the file is not empty and its deduplication mode would change, or if
+ * deduplication is enabled on a volume with clusters of several blocks. 0
+ * otherwise.
+ */
+int fs_set_dedup(const char *filename, int enable);
+
+/**
+ * fs_compression_stats - Get the block usage of a file
+ * @fd: File descriptor
+ * @stats: Filled with the block usage of the file
+ *
+ * The compression ratio of the file is @stats->data_blocks divided by
+ * @stats->stored_blocks. Both are equal for files that are not compressed.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). 0 otherwise.
+ */
+int fs_compression_stats(int fd, struct fs_compression_stats *stats);
+
+/**
+ * fs_clone - Clone a file
+ * @src: Name of the file to clone
+ * @dst: Name of the new file
+ *
+ * Create file @dst with the same content as file @src, without copying the
+ * data: both files share their data blocks until either of them is modified,
+ * only the modified blocks being copied then. File @src becomes a
+ * deduplicated file (see fs_set_dedup()) if it was not already one.
+ * Compressed files cannot be cloned.
+ *
+ * Return: -1 if @src or @dst is invalid, if there is no file named @src or it
+ * is compressed, if a file named @dst already exists, if the volume has
+ * clusters of several blocks, or if there is not enough space on the disk. 0
+ * otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/**
+ * fs_snapshot - Take a snapshot of the file system
+ * @name: Name of the snapshot
+ *
+ * Save the current state of every file into snapshot @name, which takes an
+ * entry of the root directory and appears in fs_ls(). As with fs_clone(), the
+ * files are not copied: they become deduplicated files sharing their data
+ * blocks with the snapshot, and later writes only copy the blocks they modify.
+ * Snapshots cannot be opened. They are deleted with fs_delete().
+ *
+ * Return: -1 if @name is invalid or already exists, if the root directory is
+ * full, if there is a compressed file, if the volume has clusters of several
+ * blocks, or if there is not enough space on the disk. 0 otherwise.
+ */
+int fs_snapshot(const char *name);
+
+/**
+ * fs_snapshot_restore - Roll the file system back to a snapshot
+ * @name: Name of the snapshot
+ *
+ * Replace every file by the files saved in snapshot @name. The snapshots
+ * themselves are left untouched, including snapshot @name.
+ *
+ * Return: -1 if there is no snapshot named @name, if a file is currently open,
+ * if a saved file has the name of a snapshot, or if there is not enough space
+ * in the root directory or on the disk, the files being left untouched then. 0
+ * otherwise.
+ */
+int fs_snapshot_restore(const char *name);
+
 /**
  * fs_write - Write to a file
  * @fd: File descriptor
@@ -147,10 +472,16 @@ int fs_lseek(int fd, size_t offset);
  * least @count bytes.
  *
  * When the function attempts to write past the end of the file, the file is
- * automatically extended to hold the additional bytes. If the underlying disk
- * runs out of space while performing a write operation, fs_write() should write
- * as many bytes as possible. The number of written bytes can therefore be
- * smaller than @count (it can even be 0 if there is no more space on disk).
+ * automatically extended to hold the additional bytes. Blocks that are entirely
+ * skipped by a write past the end of the file are left as holes. If the
+ * underlying disk runs out of space while performing a write operation,
+ * fs_write() should write as many bytes as possible. The number of written
+ * bytes can therefore be smaller than @count (it can even be 0 if there is no
+ * more space on disk).
+ *
+ * On volumes made with packing (fs_make -P), files of up to a quarter of a
+ * block share their data block with other small files, and get a block of
+ * their own once they grow larger.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually written.
@@ -170,11 +501,200 @@ int fs_write(int fd, void *buf, size_t count);
  * The number of bytes read can be smaller than @count if there are less than
  * @count bytes until the end of the file (it can even be 0 if the file offset
  * is at the end of the file). The file offset of the file descriptor is
- * implicitly incremented by the number of bytes that were actually read.
+ * implicitly incremented by the number of bytes that were actually read. Holes
+ * read as zeros, without accessing the disk.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Buffers holding the data to be written, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Write the content of the @iovcnt buffers of @iov, one after the other, into
+ * the file referenced by file descriptor @fd, as a single fs_write() of their
+ * concatenation would. The blocks are walked once for the whole vector, and a
+ * block made of the end of one buffer and the start of the next is written
+ * only once.
+ *
+ * Return: -1 if file descriptor @fd is invalid, if @iovcnt is negative, or if
+ * the total length of the buffers does not fit in an int. Otherwise return the
+ * number of bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to be filled with data, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Read from the file referenced by file descriptor @fd into the @iovcnt
+ * buffers of @iov, filling each one before moving on to the next, as a single
+ * fs_read() of their total length would. Each block is read only once, even
+ * when it is split across buffers.
+ *
+ * Return: -1 if file descriptor @fd is invalid, if @iovcnt is negative, or if
+ * the total length of the buffers does not fit in an int. Otherwise return the
+ * number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_copy_range - Copy data between files
+ * @fd_in: File descriptor of the source file
+ * @off_in: Offset to copy from in the source file
+ * @fd_out: File descriptor of the destination file
+ * @off_out: Offset to copy to in the destination file
+ * @len: Number of bytes to copy
+ *
+ * Copy @len bytes at @off_in of the file referenced by @fd_in to @off_out of
+ * the file referenced by @fd_out, as fs_read() and fs_write() at those offsets
+ * would, without going through a user buffer. The file offsets of the
+ * descriptors are neither used nor changed. Fewer bytes are copied when the
+ * end of the source file is reached, or when the disk gets full.
+ *
+ * When both files are deduplicated (see fs_set_dedup()) and @off_in and
+ * @off_out lie at the same offset within a block, whole blocks are not copied
+ * but shared between the files, until either of them modifies them. Other data
+ * is copied many blocks at a time.
+ *
+ * Return: -1 if either file descriptor is invalid, if an offset cannot be
+ * represented as a 32-bit file size, if the source and destination ranges
+ * overlap in the same file, or if nothing could be copied because of an error.
+ * Otherwise return the number of bytes copied.
+ */
+int fs_copy_range(int fd_in, size_t off_in, int fd_out, size_t off_out,
+                  size_t len);
+
+/**
+ * fs_read_async - Read from a file asynchronously
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ * @cb: Completion callback, or NULL
+ * @data: Argument of @cb
+ *
+ * Start reading @count bytes at @offset of the file referenced by file
+ * descriptor @fd into @buf, as fs_read() would do at that offset. The file
+ * offset of the descriptor is neither used nor changed, so that any number of
+ * requests can be outstanding on the same descriptor. @buf must remain valid
+ * until the request completes.
+ *
+ * The requests are planned in the calling thread, metadata and partial blocks
+ * included, and the transfers of whole blocks of data are done by a pool of
+ * worker threads, several at a time. Requests beyond the first 64 not reaped
+ * yet wait in a queue. Completed requests are reported by fs_async_reap(),
+ * which calls @cb with the number of bytes read, or -1 if the read failed.
+ *
+ * A request that transfers part of a block itself when planned waits for the
+ * transfers queued before it. The transfers of whole blocks are not ordered:
+ * requests that overlap, or that overlap synchronous writes, must not be
+ * outstanding at the same time. The file cannot be deleted until its requests
+ * are reaped, but its descriptor can be closed. As the rest of the library,
+ * the asynchronous functions must be called by a single thread.
+ *
+ * Return: -1 if file descriptor @fd is invalid, if @offset cannot be
+ * represented as a 32-bit file size, or if the request cannot be queued.
+ * Otherwise return the identifier of the request, a non-negative integer that
+ * can be reused once the request is reaped.
+ */
+int fs_read_async(int fd, void *buf, size_t count, size_t offset,
+                  fs_async_cb cb, void *data);
+
+/**
+ * fs_write_async - Write to a file asynchronously
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ * @cb: Completion callback, or NULL
+ * @data: Argument of @cb
+ *
+ * Start writing @count bytes of @buf at @offset of the file referenced by file
+ * descriptor @fd, as fs_write() would do at that offset, see fs_read_async().
+ * The blocks are allocated and the file size is updated when the request is
+ * planned. @cb gets the number of bytes written, or -1 if the transfer of
+ * some of them failed.
+ *
+ * Return: -1 if file descriptor @fd is invalid, if @offset cannot be
+ * represented as a 32-bit file size, or if the request cannot be queued.
+ * Otherwise return the identifier of the request.
+ */
+int fs_write_async(int fd, const void *buf, size_t count, size_t offset,
+                   fs_async_cb cb, void *data);
+
+/**
+ * fs_async_cancel - Cancel an asynchronous request
+ * @req: Request identifier
+ *
+ * Cancel request @req if it is still waiting in the queue, in which case it
+ * has had no effect and is not reported by fs_async_reap().
+ *
+ * Return: -1 if @req is not a queued request (already planned, or reaped).
+ * 0 otherwise.
+ */
+int fs_async_cancel(int req);
+
+/**
+ * fs_async_reap - Report completed asynchronous requests
+ * @wait: Whether to wait for a completion
+ *
+ * Call the callback of every request completed since the last call, possibly
+ * plan more of the queued requests, and return. If @wait is non-zero and
+ * requests are outstanding, first wait for at least one of them to complete.
+ * Callbacks may submit new requests.
+ *
+ * Return: the number of completed requests.
+ */
+int fs_async_reap(int wait);
+
+/**
+ * fs_async_fd - Get a file descriptor signalling completions
+ *
+ * The returned host file descriptor becomes readable when completed requests
+ * are waiting to be reaped, so that fs_async_reap() can be called from an
+ * event loop, for instance with poll(). It must not be read nor closed.
+ *
+ * Return: -1 if the worker threads cannot be started. Otherwise return the
+ * file descriptor.
+ */
+int fs_async_fd(void);
+
+/**
+ * fs_check - Check the consistency of the file system
+ * @repair: Whether the problems that are found should be fixed
+ *
+ * Validate the superblock of the currently mounted file system, then walk the
+ * data block chain (or the block map, for files with holes) of every file in
+ * the root directory in a single pass, looking for invalid links, loops,
+ * cross-linked chains, file sizes that do not match the length of their chain,
+ * and leaked blocks (allocated in the FAT but not reachable from any file).
+ * Only deduplicated files may share data blocks, with each other and with the
+ * files saved in snapshots. On volumes with checksums, every block they cover
+ * is verified against its checksum. Each problem is reported on stdout. On
+ * large disks, the chains are verified by several threads.
+ *
+ * If @repair is non-zero, broken chains are terminated at their last valid
+ * block, file sizes are clamped to their chain, blocks past the end of a file
+ * and leaked blocks are freed, and damaged files are dropped from snapshots.
+ * Packed small files whose data overlaps or exceeds their block are emptied.
+ * Blocks that do not match their checksum are written back as they are, so
+ * that their checksum is recomputed. Other changes reach the disk when it is
+ * unmounted.
+ *
+ * Return: -1 if no underlying virtual disk was opened. Otherwise return the
+ * number of problems found.
+ */
+int fs_check(int repair);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* _FS_H */
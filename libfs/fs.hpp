@@ -0,0 +1,455 @@
+#ifndef _FS_HPP
+#define _FS_HPP
+
+/*
+ * Header-only C++ layer over fs.h: a mounted file system and open files that
+ * release themselves, a stream buffer that turns iostream traffic into
+ * transfers of whole blocks, and read and write overloads taking spans.
+ * Requires C++20.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "disk.h"
+#include "fs.h"
+
+namespace libfs {
+
+/**
+ * error - Failure of a constructor below
+ *
+ * The constructors cannot return -1 like the functions of fs.h, they throw
+ * this instead. The other member functions return what the functions of fs.h
+ * return.
+ */
+class error : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+/** How a mount mounts its file system */
+enum class mount_mode {
+  read_write, /* fs_mount() */
+  read_only,  /* fs_mount_readonly() */
+  memory,     /* fs_mount_memory() */
+};
+
+/**
+ * mount - Mounted file system
+ *
+ * The file system is mounted for the lifetime of the object, and unmounted by
+ * its destructor, which fails if files are still open: the files must be
+ * destroyed first, e.g. declared after the mount. Only one file system can be
+ * mounted at a time.
+ */
+class mount {
+public:
+  explicit mount(const char *diskname,
+                 mount_mode mode = mount_mode::read_write)
+  {
+    int ret;
+
+    switch (mode) {
+    case mount_mode::read_only:
+      ret = fs_mount_readonly(diskname);
+      break;
+    case mount_mode::memory:
+      ret = fs_mount_memory(diskname);
+      break;
+    default:
+      ret = fs_mount(diskname);
+      break;
+    }
+    if (ret == -1)
+      throw error(std::string("cannot mount ") + diskname);
+  }
+
+  ~mount()
+  {
+    fs_umount();
+  }
+
+  mount(const mount &) = delete;
+  mount &operator=(const mount &) = delete;
+
+  /** See fs_sync() */
+  int sync()
+  {
+    return fs_sync();
+  }
+};
+
+/**
+ * file - Open file
+ *
+ * Owns a file descriptor, closed by the destructor. A file can be moved, not
+ * copied. The functions taking an offset seek to it first; the others carry
+ * on from the current offset, like fs_read() and fs_write().
+ */
+class file {
+public:
+  file() = default;
+
+  /* Open @filename, after creating it if it does not exist and @create */
+  explicit file(const char *filename, bool create = false)
+  {
+    fd_ = fs_open(filename);
+    if (fd_ < 0 && create && fs_create(filename) == 0)
+      fd_ = fs_open(filename);
+    if (fd_ < 0)
+      throw error(std::string("cannot open ") + filename);
+  }
+
+  file(file &&other) noexcept : fd_(std::exchange(other.fd_, -1)) {}
+
+  file &operator=(file &&other) noexcept
+  {
+    if (this != &other) {
+      close();
+      fd_ = std::exchange(other.fd_, -1);
+    }
+    return *this;
+  }
+
+  ~file()
+  {
+    close();
+  }
+
+  int close()
+  {
+    int ret = fd_ >= 0 ? fs_close(fd_) : 0;
+
+    fd_ = -1;
+    return ret;
+  }
+
+  bool is_open() const
+  {
+    return fd_ >= 0;
+  }
+
+  int fd() const
+  {
+    return fd_;
+  }
+
+  /** See fs_stat() */
+  int size() const
+  {
+    return fs_stat(fd_);
+  }
+
+  /** See fs_lseek() */
+  int seek(std::size_t offset)
+  {
+    return fs_lseek(fd_, offset);
+  }
+
+  /** See fs_truncate() */
+  int truncate(std::size_t length)
+  {
+    return fs_truncate(fd_, length);
+  }
+
+  /** See fs_read(), straight into @buf */
+  int read(std::span<std::byte> buf)
+  {
+    return fs_read(fd_, buf.data(), buf.size());
+  }
+
+  /** See fs_write(), straight from @buf */
+  int write(std::span<const std::byte> buf)
+  {
+    /* fs_write() does not modify @buf */
+    return fs_write(fd_, const_cast<std::byte *>(buf.data()), buf.size());
+  }
+
+  /** See fs_readv() */
+  int read(std::span<const struct iovec> iov)
+  {
+    return fs_readv(fd_, iov.data(), static_cast<int>(iov.size()));
+  }
+
+  /** See fs_writev() */
+  int write(std::span<const struct iovec> iov)
+  {
+    return fs_writev(fd_, iov.data(), static_cast<int>(iov.size()));
+  }
+
+  /* Spans of any trivially copyable type, as their bytes */
+  template <class T, std::size_t N>
+    requires std::is_trivially_copyable_v<T> && (!std::is_const_v<T>)
+  int read(std::span<T, N> buf)
+  {
+    return read(std::span<std::byte>(std::as_writable_bytes(buf)));
+  }
+
+  template <class T, std::size_t N>
+    requires std::is_trivially_copyable_v<T>
+  int write(std::span<T, N> buf)
+  {
+    return write(std::span<const std::byte>(std::as_bytes(buf)));
+  }
+
+  template <class T>
+  int read(std::size_t offset, T &&buf)
+  {
+    return seek(offset) == -1 ? -1 : read(std::forward<T>(buf));
+  }
+
+  template <class T>
+  int write(std::size_t offset, T &&buf)
+  {
+    return seek(offset) == -1 ? -1 : write(std::forward<T>(buf));
+  }
+
+private:
+  int fd_ = -1;
+};
+
+/**
+ * filebuf - Stream buffer of a file, by whole blocks
+ *
+ * A std::streambuf over a file whose buffer is aligned on %BLOCK_SIZE and
+ * holds a whole number of blocks, so that the small reads and writes of an
+ * iostream reach libfs as transfers of whole blocks: the buffer is filled
+ * from, and written back up to, block boundaries, and only the first write
+ * after a seek can start within a block. Transfers at least as large as the
+ * buffer bypass it. As with std::filebuf, the buffer serves either reading or
+ * writing at a time, and the buffered data is written back by sync(), by a
+ * seek, when switching to reading, and by the destructor.
+ */
+class filebuf : public std::streambuf {
+public:
+  static constexpr std::size_t default_blocks = 16;
+
+  explicit filebuf(file f, std::size_t blocks = default_blocks)
+    : file_(std::move(f)),
+      size_(std::max<std::size_t>(blocks, 1) * BLOCK_SIZE),
+      buf_(static_cast<char *>(::operator new(size_,
+                                              std::align_val_t(BLOCK_SIZE))))
+  {
+  }
+
+  ~filebuf() override
+  {
+    settle();
+    ::operator delete(buf_, std::align_val_t(BLOCK_SIZE));
+  }
+
+  filebuf(const filebuf &) = delete;
+  filebuf &operator=(const filebuf &) = delete;
+
+  file &handle()
+  {
+    return file_;
+  }
+
+protected:
+  int_type underflow() override
+  {
+    int n;
+
+    if (gptr() < egptr())
+      return traits_type::to_int_type(*gptr());
+    if (settle() == -1)
+      return traits_type::eof();
+
+    /* Fill the buffer from the start of the block */
+    base_ = pos_ - pos_ % BLOCK_SIZE;
+    n = file_.read(base_, std::as_writable_bytes(std::span(buf_, size_)));
+    if (n <= static_cast<int>(pos_ - base_))
+      return traits_type::eof();
+    setg(buf_, buf_ + (pos_ - base_), buf_ + n);
+    return traits_type::to_int_type(*gptr());
+  }
+
+  int_type overflow(int_type c) override
+  {
+    if (!pptr() || pptr() == epptr()) {
+      if (settle() == -1)
+        return traits_type::eof();
+      /* The buffer ends on a block boundary, so does what is written */
+      base_ = pos_ - pos_ % BLOCK_SIZE;
+      setp(buf_ + (pos_ - base_), buf_ + size_);
+    }
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  int sync() override
+  {
+    return settle();
+  }
+
+  std::streamsize xsgetn(char *s, std::streamsize n) override
+  {
+    std::streamsize done = 0;
+    int ret;
+
+    if (gptr() < egptr()) {
+      done = std::min<std::streamsize>(n, egptr() - gptr());
+      std::memcpy(s, gptr(), done);
+      gbump(static_cast<int>(done));
+    }
+    if (n - done < static_cast<std::streamsize>(size_))
+      return done + std::streambuf::xsgetn(s + done, n - done);
+
+    if (settle() == -1)
+      return done;
+    ret = file_.read(pos_, std::as_writable_bytes(std::span(s + done,
+                                                            n - done)));
+    if (ret > 0) {
+      pos_ += ret;
+      done += ret;
+    }
+    return done;
+  }
+
+  std::streamsize xsputn(const char *s, std::streamsize n) override
+  {
+    struct iovec iov[2];
+    std::size_t start = tell(), held = 0;
+    int ret;
+
+    if (n < static_cast<std::streamsize>(size_))
+      return std::streambuf::xsputn(s, n);
+
+    /* What is buffered and @s in a single call */
+    if (pptr() && pptr() > pbase()) {
+      start = base_ + (pbase() - buf_);
+      held = pptr() - pbase();
+    }
+    iov[0] = { pbase(), held };
+    iov[1] = { const_cast<char *>(s), static_cast<std::size_t>(n) };
+    setg(nullptr, nullptr, nullptr);
+    setp(nullptr, nullptr);
+    pos_ = start;
+
+    ret = file_.write(start, std::span<const struct iovec>(iov + !held,
+                                                           iov + 2));
+    if (ret < 0)
+      return 0;
+    pos_ += ret;
+    return ret > static_cast<int>(held) ? ret - held : 0;
+  }
+
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override
+  {
+    off_type from;
+
+    switch (dir) {
+    case std::ios_base::beg:
+      from = 0;
+      break;
+    case std::ios_base::cur:
+      /* tellg() and tellp() keep the buffer */
+      if (off == 0)
+        return pos_type(tell());
+      from = tell();
+      break;
+    case std::ios_base::end:
+      if (settle() == -1 || (from = file_.size()) < 0)
+        return pos_type(off_type(-1));
+      break;
+    default:
+      return pos_type(off_type(-1));
+    }
+    return seekpos(pos_type(from + off), which);
+  }
+
+  pos_type seekpos(pos_type pos, std::ios_base::openmode) override
+  {
+    if (off_type(pos) < 0 || settle() == -1)
+      return pos_type(off_type(-1));
+    pos_ = off_type(pos);
+    return pos;
+  }
+
+private:
+  /* File offset of the next character */
+  std::size_t tell() const
+  {
+    if (gptr())
+      return base_ + (gptr() - eback());
+    if (pptr())
+      return base_ + (pptr() - buf_);
+    return pos_;
+  }
+
+  /* Write back what is buffered, and leave the buffer unused */
+  int settle()
+  {
+    std::size_t pos = tell();
+    int ret = 0;
+
+    if (pptr() && pptr() > pbase()) {
+      std::size_t held = pptr() - pbase();
+
+      if (file_.write(base_ + (pbase() - buf_),
+                      std::as_bytes(std::span(pbase(), held))) !=
+          static_cast<int>(held))
+        ret = -1;
+    }
+    setg(nullptr, nullptr, nullptr);
+    setp(nullptr, nullptr);
+    pos_ = pos;
+    return ret;
+  }
+
+  file file_;
+  std::size_t size_;
+  char *buf_;
+  /* File offset of the start of the buffer */
+  std::size_t base_ = 0;
+  /* File offset of the next character, when the buffer is unused */
+  std::size_t pos_ = 0;
+};
+
+/**
+ * stream - iostream over a file, through a filebuf
+ */
+class stream : public std::iostream {
+public:
+  explicit stream(file f, std::size_t blocks = filebuf::default_blocks)
+    : std::iostream(nullptr), buf_(std::move(f), blocks)
+  {
+    rdbuf(&buf_);
+  }
+
+  explicit stream(const char *filename, bool create = false,
+                  std::size_t blocks = filebuf::default_blocks)
+    : stream(file(filename, create), blocks)
+  {
+  }
+
+  filebuf *rdbuf()
+  {
+    return &buf_;
+  }
+
+  /* std::ios::rdbuf(std::streambuf *) too */
+  using std::iostream::rdbuf;
+
+private:
+  filebuf buf_;
+};
+
+} /* namespace libfs */
+
+#endif /* _FS_HPP */
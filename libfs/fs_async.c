@@ -0,0 +1,480 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Asynchronous reads and writes. Requests are planned by the thread that uses
+ * the library, as fs_read() and fs_write() would do them, except that the
+ * transfers of whole blocks of data are queued instead of being done: all the
+ * metadata, which the library does not protect against concurrent accesses, is
+ * only touched by that thread. A pool of workers does the queued transfers,
+ * several at a time, and the completions are reaped by fs_async_reap(), in the
+ * thread of the library again.
+ *
+ * At most ASYNC_DEPTH requests are planned and not reaped at once. The others
+ * wait in a queue, from which they can still be cancelled.
+ */
+
+#define ASYNC_THREADS 4
+#define ASYNC_DEPTH 64
+/* Largest transfer handed to a worker, so that large requests are spread */
+#define ASYNC_FRAG_BLOCKS 256
+
+enum async_state {
+  ASYNC_FREE,
+  ASYNC_QUEUED,   /* waiting to be planned */
+  ASYNC_INFLIGHT, /* planned, transfers in flight or done */
+};
+
+struct async_req;
+
+/* Transfer of consecutive blocks, done by a worker */
+struct async_frag {
+  struct async_req *req;
+  struct async_frag *next;
+  int write;
+  size_t block;
+  size_t count;
+  void *buf;
+};
+
+struct async_req {
+  int id;
+  enum async_state state;
+  int write;
+  uint32_t entry;
+  uint8_t *buf;
+  uint32_t offset;
+  size_t count;
+  fs_async_cb cb;
+  void *data;
+  /* Number of bytes planned, -1 on failure */
+  int result;
+  /* Transfers being planned */
+  struct async_frag *frags;
+  struct async_frag *frags_tail;
+  /* Next request of the submission queue, or of the completion list */
+  struct async_req *next;
+  /* Next free request, when free */
+  int nextfree;
+  /* Shared with the workers, under async_lock */
+  uint32_t pending;
+  int failed;
+};
+
+/* Request table, grown as needed, with a stack of the free requests */
+static struct async_req **reqs;
+static int reqs_capacity;
+static int reqs_free = -1;
+/* Requests not reaped yet, and those of them that are planned */
+static int reqs_outstanding;
+static int reqs_planned;
+/* Requests waiting to be planned */
+static struct async_req *sub_head, *sub_tail;
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+/* Under async_lock: queued transfers, transfers not done, completed requests */
+static struct async_frag *work_head, *work_tail;
+static size_t frags_inflight;
+static struct async_req *done_head, *done_tail;
+static int async_quit;
+
+static pthread_t workers[ASYNC_THREADS];
+static int nworkers;
+/* Readable when completions are waiting to be reaped */
+static int notify_fds[2] = { -1, -1 };
+
+/* Queue completed request @req, under async_lock */
+static void async_done(struct async_req *req)
+{
+  char c = 0;
+
+  req->next = NULL;
+  if (done_tail)
+    done_tail->next = req;
+  else
+    done_head = req;
+  done_tail = req;
+
+  pthread_cond_broadcast(&done_cond);
+  /* A full pipe is as readable as a pipe holding one byte */
+  if (write(notify_fds[1], &c, 1) < 0 && errno != EAGAIN)
+    return;
+}
+
+static void *async_worker(void *arg)
+{
+  (void)arg;
+
+  pthread_mutex_lock(&async_lock);
+  for (;;) {
+    struct async_frag *frag;
+    int ret;
+
+    while (!work_head && !async_quit)
+      pthread_cond_wait(&work_cond, &async_lock);
+    if (!work_head)
+      break;
+
+    frag = work_head;
+    work_head = frag->next;
+    if (!work_head)
+      work_tail = NULL;
+    pthread_mutex_unlock(&async_lock);
+
+    if (frag->write)
+      ret = block_write_range(frag->block, frag->count, frag->buf);
+    else
+      ret = block_read_range(frag->block, frag->count, frag->buf);
+
+    pthread_mutex_lock(&async_lock);
+    if (ret < 0)
+      frag->req->failed = 1;
+    if (--frag->req->pending == 0)
+      async_done(frag->req);
+    if (--frags_inflight == 0)
+      pthread_cond_broadcast(&drain_cond);
+    free(frag);
+  }
+  pthread_mutex_unlock(&async_lock);
+  return NULL;
+}
+
+/* Start the workers, on the first request */
+static int async_start(void)
+{
+  if (nworkers)
+    return 0;
+
+  if (pipe(notify_fds) < 0)
+    return -1;
+  for (int i = 0; i < 2; i++) {
+    fcntl(notify_fds[i], F_SETFL, O_NONBLOCK);
+    fcntl(notify_fds[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  async_quit = 0;
+  while (nworkers < ASYNC_THREADS) {
+    if (pthread_create(&workers[nworkers], NULL, async_worker, NULL))
+      break;
+    nworkers++;
+  }
+  if (nworkers)
+    return 0;
+
+  close(notify_fds[0]);
+  close(notify_fds[1]);
+  notify_fds[0] = notify_fds[1] = -1;
+  return -1;
+}
+
+void fs_async_stop(void)
+{
+  if (!nworkers)
+    return;
+
+  pthread_mutex_lock(&async_lock);
+  async_quit = 1;
+  pthread_cond_broadcast(&work_cond);
+  pthread_mutex_unlock(&async_lock);
+  while (nworkers > 0)
+    pthread_join(workers[--nworkers], NULL);
+
+  close(notify_fds[0]);
+  close(notify_fds[1]);
+  notify_fds[0] = notify_fds[1] = -1;
+}
+
+int fs_async_busy(void)
+{
+  return reqs_outstanding > 0;
+}
+
+void fs_async_drain(void)
+{
+  pthread_mutex_lock(&async_lock);
+  while (frags_inflight > 0)
+    pthread_cond_wait(&drain_cond, &async_lock);
+  pthread_mutex_unlock(&async_lock);
+}
+
+/* Queue a transfer of request @ctx, merging it with the previous one */
+static int async_transfer(void *ctx, int write, size_t block, size_t count,
+                          void *buf)
+{
+  struct async_req *req = ctx;
+  struct async_frag *last = req->frags_tail;
+  struct async_frag *frag;
+
+  if (last && last->write == write && last->block + last->count == block &&
+      (uint8_t *)last->buf + last->count * BLOCK_SIZE == buf &&
+      last->count + count <= ASYNC_FRAG_BLOCKS) {
+    last->count += count;
+    return 0;
+  }
+
+  frag = malloc(sizeof(*frag));
+  if (!frag)
+    return -1;
+  frag->req = req;
+  frag->next = NULL;
+  frag->write = write;
+  frag->block = block;
+  frag->count = count;
+  frag->buf = buf;
+  if (last)
+    last->next = frag;
+  else
+    req->frags = frag;
+  req->frags_tail = frag;
+  req->pending++;
+  return 0;
+}
+
+/*
+ * Whether request @req transfers data itself when planned: partial blocks,
+ * gaps filled with zeros, and the files whose blocks are rewritten as a whole
+ */
+static int async_plan_sync(const struct async_req *req)
+{
+  const struct RootDir *file = &rootdir[req->entry];
+
+  return req->offset % BLOCK_SIZE || req->count % BLOCK_SIZE ||
+         req->offset > file->size_of_file ||
+         (file->flags & (RDIR_PACKED | RDIR_COMPRESSED | RDIR_DEDUP));
+}
+
+/* Plan request @req, and hand its transfers to the workers */
+static void async_plan(struct async_req *req)
+{
+  struct fs_io io = { async_transfer, req };
+  struct async_frag *frag;
+  size_t n = 0;
+
+  /* The blocks it reads or rewrites may be those of transfers still queued */
+  if (req->count > 0 && async_plan_sync(req))
+    fs_async_drain();
+
+  req->frags = req->frags_tail = NULL;
+  req->pending = 0;
+  req->failed = 0;
+  if (req->write)
+    req->result = fs_write_at(req->entry, req->offset, req->buf, req->count,
+                              &io);
+  else
+    req->result = fs_read_at(req->entry, req->offset, req->buf, req->count,
+                             &io);
+
+  /* A failed read has no effect, its planned transfers are dropped */
+  if (req->result < 0) {
+    while ((frag = req->frags)) {
+      req->frags = frag->next;
+      free(frag);
+    }
+    req->pending = 0;
+  }
+
+  req->state = ASYNC_INFLIGHT;
+  reqs_planned++;
+
+  pthread_mutex_lock(&async_lock);
+  if (!req->frags) {
+    async_done(req);
+  } else {
+    if (work_tail)
+      work_tail->next = req->frags;
+    else
+      work_head = req->frags;
+    work_tail = req->frags_tail;
+    for (frag = req->frags; frag; frag = frag->next)
+      n++;
+    frags_inflight += n;
+    pthread_cond_broadcast(&work_cond);
+  }
+  pthread_mutex_unlock(&async_lock);
+}
+
+/* Plan the queued requests, as long as there is room */
+static void async_plan_queued(void)
+{
+  while (sub_head && reqs_planned < ASYNC_DEPTH) {
+    struct async_req *req = sub_head;
+
+    sub_head = req->next;
+    if (!sub_head)
+      sub_tail = NULL;
+    async_plan(req);
+  }
+}
+
+static void async_free(int id)
+{
+  reqs[id]->state = ASYNC_FREE;
+  reqs[id]->nextfree = reqs_free;
+  reqs_free = id;
+  reqs_outstanding--;
+}
+
+/* Take a free request, growing the table if there is none */
+static int async_alloc(void)
+{
+  int id;
+
+  if (reqs_free < 0) {
+    int capacity = reqs_capacity ? 2 * reqs_capacity : ASYNC_DEPTH;
+    struct async_req **table = realloc(reqs, capacity * sizeof(*table));
+
+    if (!table)
+      return -1;
+    reqs = table;
+    for (int i = reqs_capacity; i < capacity; i++) {
+      reqs[i] = calloc(1, sizeof(*reqs[i]));
+      if (!reqs[i]) {
+        capacity = i;
+        break;
+      }
+      reqs[i]->id = i;
+    }
+    /* Lowest requests on top of the stack */
+    for (int i = capacity; i-- > reqs_capacity;) {
+      reqs[i]->nextfree = reqs_free;
+      reqs_free = i;
+    }
+    reqs_capacity = capacity;
+    if (reqs_free < 0)
+      return -1;
+  }
+
+  id = reqs_free;
+  reqs_free = reqs[id]->nextfree;
+  reqs_outstanding++;
+  return id;
+}
+
+static int async_submit(int write, int fd, void *buf, size_t count,
+                        size_t offset, fs_async_cb cb, void *data)
+{
+  uint32_t entry = fs_fd_entry(fd);
+  struct async_req *req;
+  int id;
+
+  if (!mounted || entry == DIR_NONE || !buf || offset > UINT32_MAX ||
+      (write && readonly))
+    return -1;
+  if (async_start() < 0)
+    return -1;
+  id = async_alloc();
+  if (id < 0)
+    return -1;
+
+  req = reqs[id];
+  req->state = ASYNC_QUEUED;
+  req->write = write;
+  req->entry = entry;
+  req->buf = buf;
+  req->offset = offset;
+  req->count = count;
+  req->cb = cb;
+  req->data = data;
+  req->next = NULL;
+  /* The file cannot be deleted until the request is reaped */
+  rootdir_opens[entry]++;
+
+  if (sub_tail)
+    sub_tail->next = req;
+  else
+    sub_head = req;
+  sub_tail = req;
+
+  async_plan_queued();
+  return id;
+}
+
+int fs_read_async(int fd, void *buf, size_t count, size_t offset,
+                  fs_async_cb cb, void *data)
+{
+  return async_submit(0, fd, buf, count, offset, cb, data);
+}
+
+int fs_write_async(int fd, const void *buf, size_t count, size_t offset,
+                   fs_async_cb cb, void *data)
+{
+  return async_submit(1, fd, (void *)buf, count, offset, cb, data);
+}
+
+int fs_async_cancel(int id)
+{
+  struct async_req **link = &sub_head, *prev = NULL;
+
+  if (id < 0 || id >= reqs_capacity || reqs[id]->state != ASYNC_QUEUED)
+    return -1;
+
+  while (*link != reqs[id]) {
+    prev = *link;
+    link = &(*link)->next;
+  }
+  *link = reqs[id]->next;
+  if (sub_tail == reqs[id])
+    sub_tail = prev;
+
+  rootdir_opens[reqs[id]->entry]--;
+  async_free(id);
+  return 0;
+}
+
+int fs_async_fd(void)
+{
+  if (async_start() < 0)
+    return -1;
+  return notify_fds[0];
+}
+
+int fs_async_reap(int wait)
+{
+  struct async_req *done;
+  char buf[64];
+  int n = 0;
+
+  if (!nworkers)
+    return 0;
+
+  /* Completions are reaped all at once, the pipe can be emptied first */
+  while (read(notify_fds[0], buf, sizeof(buf)) > 0)
+    ;
+
+  pthread_mutex_lock(&async_lock);
+  while (wait && !done_head && reqs_planned > 0)
+    pthread_cond_wait(&done_cond, &async_lock);
+  done = done_head;
+  done_head = done_tail = NULL;
+  pthread_mutex_unlock(&async_lock);
+
+  while (done) {
+    struct async_req *req = done;
+    int result = req->failed ? -1 : req->result;
+    fs_async_cb cb = req->cb;
+    void *data = req->data;
+
+    done = req->next;
+    rootdir_opens[req->entry]--;
+    reqs_planned--;
+    /* The callback may submit requests, which can reuse this one */
+    async_free(req->id);
+    n++;
+    if (cb)
+      cb(req->id, result, data);
+  }
+
+  async_plan_queued();
+  return n;
+}
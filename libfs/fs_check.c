@@ -0,0 +1,956 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/* Below this amount of data blocks, chains are verified by the caller only */
+#define CHECK_PARALLEL_MIN_BLOCKS 16384
+#define CHECK_MAX_THREADS 8
+/* Blocks read at once when verifying their checksums */
+#define CHECK_CSUM_BLOCKS 64
+
+/* Owner flag of the data blocks of deduplicated files, which can be shared */
+#define OWNER_SHARED 0x80000000u
+/* Owner flag of packed blocks, shared by the packed files */
+#define OWNER_PACKED 0x40000000u
+/* Owner of the blocks extending the root directory */
+#define OWNER_DIR 0x20000000u
+#define OWNER_FLAGS (OWNER_SHARED | OWNER_PACKED | OWNER_DIR)
+
+#define check_report(fmt, ...) \
+  printf("fsck: "fmt"\n", ##__VA_ARGS__)
+
+/* How the walk of a chain ended */
+enum chain_end {
+  CHAIN_EOC,        /* properly terminated by FAT_EOC */
+  CHAIN_BAD_LINK,   /* link to an index outside of the data blocks */
+  CHAIN_FREE_LINK,  /* link to a block marked as free in the FAT */
+  CHAIN_LOOP,       /* link back to a block of the same chain */
+  CHAIN_CROSS_LINK, /* link to a block already owned by another file */
+  CHAIN_MAP_LINK,   /* root map block linked to another block */
+  CHAIN_PACK_LINK,  /* packed block linked to another block */
+};
+
+/* Problems found in the block map of a mapped file */
+enum map_problem {
+  MAP_BAD_ENTRY,    /* index outside of the data blocks */
+  MAP_CROSS_LINK,   /* block already owned by another file, or mapped twice */
+  MAP_PAST_EOF,     /* block mapped past the end of the file */
+  MAP_UNTERMINATED, /* mapped block that is not a single-block chain */
+  MAP_NR_PROBLEMS,
+};
+
+/* Deferred repair of one block map entry */
+struct map_fix {
+  uint32_t lblk;
+  int leaf;         /* fix the root entry pointing to the leaf of @lblk */
+  enum map_problem problem;
+};
+
+/* Result of the walk of one root directory entry */
+struct chain_info {
+  enum chain_end end;
+  uint32_t length;   /* number of valid blocks in the chain */
+  uint32_t last;     /* last valid block, FAT_EOC if none */
+  uint32_t culprit;  /* offending link when the chain is broken */
+  uint32_t other;    /* owner of the culprit block on a cross-link */
+  /* Block map entries to be fixed, for mapped files */
+  struct map_fix *fixes;
+  uint32_t nfixes;
+  uint32_t capfixes;
+  uint32_t count[MAP_NR_PROBLEMS];
+  /* Bitmap of the files saved in a snapshot whose block map is damaged, for
+   * snapshots with such files */
+  uint32_t *damaged;
+  /* Packed file whose data overlaps the data of this one, + 1 */
+  uint32_t overlap;
+};
+
+/* State shared by the threads verifying the chains */
+struct check_ctx {
+  /* Owner of each data block: 0 when unreached, root entry + 1 otherwise */
+  uint32_t *owner;
+  /* Number of references to each shared block */
+  uint32_t *refs;
+  /* One per root directory entry */
+  struct chain_info *info;
+  /* Next root entry to be verified */
+  uint32_t next;
+};
+
+static void check_map_problem(struct chain_info *info, uint32_t lblk,
+                              int leaf, enum map_problem problem)
+{
+  info->count[problem]++;
+
+  if (info->nfixes == info->capfixes) {
+    uint32_t cap = info->capfixes ? info->capfixes * 2 : 16;
+    struct map_fix *fixes = realloc(info->fixes, cap * sizeof(*fixes));
+    if (!fixes)
+      return;
+    info->fixes = fixes;
+    info->capfixes = cap;
+  }
+  info->fixes[info->nfixes].lblk = lblk;
+  info->fixes[info->nfixes].leaf = leaf;
+  info->fixes[info->nfixes].problem = problem;
+  info->nfixes++;
+}
+
+/*
+ * Claim @block for @entry, or record why it cannot be in @info. @shared blocks
+ * can be claimed by any number of entries, as long as they all share it.
+ */
+static int check_map_claim(struct check_ctx *ctx, uint32_t entry,
+                           struct chain_info *info, uint64_t block,
+                           uint32_t lblk, int leaf, int shared)
+{
+  uint32_t me = shared ? (entry + 1) | OWNER_SHARED : entry + 1;
+  uint32_t expected = 0;
+
+  if (block >= superblock.num_data_blks) {
+    check_map_problem(info, lblk, leaf, MAP_BAD_ENTRY);
+    return -1;
+  }
+  if (!__atomic_compare_exchange_n(&ctx->owner[block], &expected, me, 0,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED) &&
+      !(shared && (expected & OWNER_SHARED))) {
+    check_map_problem(info, lblk, leaf, MAP_CROSS_LINK);
+    return -1;
+  }
+  if (shared)
+    __atomic_fetch_add(&ctx->refs[block], 1, __ATOMIC_RELAXED);
+  if (fat[block] != FAT_EOC)
+    check_map_problem(info, lblk, leaf, MAP_UNTERMINATED);
+  return 0;
+}
+
+/*
+ * Claim the root map block of mapped file @file for @entry, then every leaf
+ * map block and data block it references, the result going to @info. The
+ * fixes of a leaf are recorded after those of its entries, so that a leaf is
+ * released last.
+ */
+static void check_map(struct check_ctx *ctx, uint32_t entry,
+                      const struct RootDir *file, struct chain_info *info)
+{
+  uint32_t needed = (file->size_of_file + (uint64_t)BLOCK_SIZE - 1)
+                    / BLOCK_SIZE;
+  uint32_t root[MAP_ENTRIES_PER_BLOCK];
+  uint64_t leaf[MAP_ENTRIES_PER_BLOCK];
+  uint32_t rootblk = file->index_first_datablk;
+  uint32_t per_leaf = fs_map_leaf_entries();
+  /* Entries of compressed files also hold the length of their chunk */
+  uint64_t mask = file->flags & (RDIR_COMPRESSED | RDIR_DEDUP)
+                  ? MAP_BLOCK_MASK : UINT64_MAX;
+  int shared = file->flags & RDIR_DEDUP;
+  uint32_t expected = 0;
+
+  info->end = CHAIN_EOC;
+  info->length = 0;
+  info->last = FAT_EOC;
+
+  if (rootblk == 0 || rootblk >= superblock.num_data_blks) {
+    info->end = CHAIN_BAD_LINK;
+    info->culprit = rootblk;
+    return;
+  }
+  if (!__atomic_compare_exchange_n(&ctx->owner[rootblk], &expected, entry + 1,
+                                   0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    info->end = CHAIN_CROSS_LINK;
+    info->culprit = rootblk;
+    info->other = (expected & ~OWNER_FLAGS) - 1;
+    return;
+  }
+  info->length = 1;
+  info->last = rootblk;
+  if (fat[rootblk] != FAT_EOC) {
+    info->end = CHAIN_MAP_LINK;
+    info->culprit = fat[rootblk];
+  }
+
+  if (block_read(fs_cluster_block(rootblk), root) < 0)
+    return;
+
+  for (uint32_t slot = 0; slot < MAP_ENTRIES_PER_BLOCK; slot++) {
+    uint32_t first = slot * per_leaf;
+
+    if (root[slot] == 0)
+      continue;
+    if (check_map_claim(ctx, entry, info, root[slot], first, 1, 0) < 0 ||
+        fs_map_read_leaf(root[slot], leaf) < 0)
+      continue;
+
+    for (uint32_t i = 0; i < per_leaf; i++) {
+      if ((leaf[i] & mask) == 0)
+        continue;
+      if (check_map_claim(ctx, entry, info, leaf[i] & mask, first + i, 0,
+                          shared) == 0 &&
+          first + i >= needed)
+        check_map_problem(info, first + i, 0, MAP_PAST_EOF);
+    }
+
+    if (first >= needed)
+      check_map_problem(info, first, 1, MAP_PAST_EOF);
+  }
+}
+
+/*
+ * Walk the chain of root entry @entry, claiming each block in the owner map.
+ * Every block is visited at most once over all the chains, so verifying the
+ * whole directory is linear in the number of data blocks.
+ */
+static void check_chain(struct check_ctx *ctx, uint32_t entry)
+{
+  struct chain_info *info = &ctx->info[entry];
+  uint32_t me = entry + 1;
+  uint32_t block = rootdir[entry].index_first_datablk;
+
+  info->end = CHAIN_EOC;
+  info->length = 0;
+  info->last = FAT_EOC;
+
+  while (block != FAT_EOC) {
+    uint32_t expected = 0;
+
+    if (block == 0 || block >= superblock.num_data_blks) {
+      info->end = CHAIN_BAD_LINK;
+      info->culprit = block;
+      return;
+    }
+
+    if (!__atomic_compare_exchange_n(&ctx->owner[block], &expected, me, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      info->end = expected == me ? CHAIN_LOOP : CHAIN_CROSS_LINK;
+      info->culprit = block;
+      info->other = (expected & ~OWNER_FLAGS) - 1;
+      return;
+    }
+
+    info->length++;
+    info->last = block;
+
+    block = fat[block];
+    if (block == 0) {
+      info->end = CHAIN_FREE_LINK;
+      info->culprit = info->last;
+      return;
+    }
+  }
+}
+
+/* Claim the block of packed file @entry, shared with the other packed files */
+static void check_pack(struct check_ctx *ctx, uint32_t entry)
+{
+  struct chain_info *info = &ctx->info[entry];
+  uint32_t block = rootdir[entry].index_first_datablk;
+  uint32_t expected = 0;
+
+  info->end = CHAIN_EOC;
+  info->length = 0;
+  info->last = FAT_EOC;
+
+  if (block == 0 || block >= superblock.num_data_blks) {
+    info->end = CHAIN_BAD_LINK;
+    info->culprit = block;
+    return;
+  }
+  if (!__atomic_compare_exchange_n(&ctx->owner[block], &expected,
+                                   (entry + 1) | OWNER_PACKED, 0,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED) &&
+      !(expected & OWNER_PACKED)) {
+    info->end = CHAIN_CROSS_LINK;
+    info->culprit = block;
+    info->other = (expected & ~OWNER_FLAGS) - 1;
+    return;
+  }
+  info->length = 1;
+  info->last = block;
+  if (fat[block] != FAT_EOC) {
+    info->end = CHAIN_PACK_LINK;
+    info->culprit = fat[block];
+  }
+}
+
+/*
+ * Read the files saved in the valid blocks of the chain of snapshot @entry,
+ * setting @count to their number.
+ */
+static struct RootDir *check_snapshot_load(struct check_ctx *ctx,
+                                           uint32_t entry, uint32_t *count)
+{
+  struct RootDir snap = rootdir[entry];
+
+  if (snap.size_of_file / BLOCK_SIZE > ctx->info[entry].length)
+    snap.size_of_file = ctx->info[entry].length * BLOCK_SIZE;
+  return fs_snapshot_load(&snap, count);
+}
+
+/*
+ * Claim the block maps of the files saved in snapshot @entry, after its own
+ * blocks. Damaged files are only recorded, they are dropped from the snapshot
+ * by the repair.
+ */
+static void check_snapshot(struct check_ctx *ctx, uint32_t entry)
+{
+  uint32_t count;
+  struct RootDir *saved = check_snapshot_load(ctx, entry, &count);
+
+  if (!saved)
+    return;
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t **damaged = &ctx->info[entry].damaged;
+    struct chain_info info;
+    int problems = 0;
+
+    if (*saved[i].filename == 0)
+      continue;
+    memset(&info, 0, sizeof(info));
+    check_map(ctx, entry, &saved[i], &info);
+    for (int p = 0; p < MAP_NR_PROBLEMS; p++)
+      problems |= info.count[p] != 0;
+    if (info.end != CHAIN_EOC || info.length == 0 || problems) {
+      if (!*damaged)
+        *damaged = calloc((count + 31) / 32, sizeof(**damaged));
+      if (*damaged)
+        (*damaged)[i / 32] |= 1u << (i % 32);
+    }
+    free(info.fixes);
+  }
+  free(saved);
+}
+
+static void *check_worker(void *arg)
+{
+  struct check_ctx *ctx = arg;
+  uint32_t entry;
+
+  while ((entry = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED))
+         < rootdir_count) {
+    if (*rootdir[entry].filename == 0)
+      continue;
+    if (rootdir[entry].flags & RDIR_MAPPED) {
+      check_map(ctx, entry, &rootdir[entry], &ctx->info[entry]);
+    } else if (rootdir[entry].flags & RDIR_PACKED) {
+      check_pack(ctx, entry);
+    } else {
+      check_chain(ctx, entry);
+      if (rootdir[entry].flags & RDIR_SNAPSHOT)
+        check_snapshot(ctx, entry);
+    }
+  }
+
+  return NULL;
+}
+
+/* Verify all the chains, spreading the entries across threads on big disks */
+static void check_all_chains(struct check_ctx *ctx)
+{
+  pthread_t threads[CHECK_MAX_THREADS];
+  long nthreads = 1;
+  long started = 0;
+
+  if (superblock.num_data_blks >= CHECK_PARALLEL_MIN_BLOCKS) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > CHECK_MAX_THREADS)
+      nthreads = CHECK_MAX_THREADS;
+  }
+
+  /* The calling thread always takes part in the verification */
+  for (long i = 1; i < nthreads; i++) {
+    if (pthread_create(&threads[started], NULL, check_worker, ctx))
+      break;
+    started++;
+  }
+  check_worker(ctx);
+
+  for (long i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+}
+
+static int check_superblock(int repair)
+{
+  int problems = 0;
+  size_t fat_blocks = ((size_t)superblock.num_data_blks +
+                       fs_fat_entries_per_block() - 1)
+                      / fs_fat_entries_per_block();
+
+  if (superblock.num_blk_FAT != fat_blocks) {
+    check_report("superblock: %u FAT blocks for %u data blocks",
+                 superblock.num_blk_FAT, superblock.num_data_blks);
+    problems++;
+  }
+  /* The checksum region, if any, lies in between (checked when mounting) */
+  if (superblock.root_dir_blk_index !=
+      superblock.num_blk_FAT + 1 + superblock.num_blk_csum) {
+    check_report("superblock: root directory at block %u",
+                 superblock.root_dir_blk_index);
+    problems++;
+  }
+  if (superblock.data_blk_start_index != superblock.root_dir_blk_index + 1) {
+    check_report("superblock: data blocks start at block %u",
+                 superblock.data_blk_start_index);
+    problems++;
+  }
+  if (superblock.total_blocks != superblock.data_blk_start_index +
+      ((uint64_t)superblock.num_data_blks << superblock.cluster_shift)) {
+    check_report("superblock: %u blocks in total, expected %llu",
+                 superblock.total_blocks,
+                 superblock.data_blk_start_index +
+                 ((unsigned long long)superblock.num_data_blks
+                  << superblock.cluster_shift));
+    problems++;
+  }
+
+  if (fat[0] != FAT_EOC) {
+    check_report("FAT entry #0 is %u instead of FAT_EOC", fat[0]);
+    problems++;
+    if (repair)
+      fat[0] = FAT_EOC;
+  }
+
+  return problems;
+}
+
+/*
+ * Verify every block covered by a checksum, before the chains whose blocks are
+ * read. Those written when the disk was not closed cleanly may not match: the
+ * repair writes them back as they are, which recomputes their checksum.
+ */
+static int check_csums(int repair)
+{
+  uint32_t first = superblock.root_dir_blk_index;
+  uint32_t mismatched = 0;
+  char *buf;
+
+  if (superblock.csum_blk_index == 0) {
+    return 0;
+  }
+
+  buf = malloc((size_t)CHECK_CSUM_BLOCKS * BLOCK_SIZE);
+  if (!buf) {
+    check_report("checksums: out of memory, not verified");
+    return 1;
+  }
+
+  for (uint32_t block = first; block < superblock.total_blocks;
+       block += CHECK_CSUM_BLOCKS) {
+    uint32_t count = superblock.total_blocks - block;
+
+    if (count > CHECK_CSUM_BLOCKS)
+      count = CHECK_CSUM_BLOCKS;
+    if (block_read_range(block, count, buf) == 0)
+      continue;
+    /* Find out which of them do not match */
+    for (uint32_t i = 0; i < count; i++) {
+      if (block_read(block + i, buf) == 0)
+        continue;
+      check_report("block %u does not match its checksum", block + i);
+      mismatched++;
+      if (repair)
+        block_write(block + i, buf);
+    }
+  }
+
+  free(buf);
+  return mismatched ? 1 : 0;
+}
+
+/*
+ * Claim the blocks extending the root directory, before any file. They are the
+ * blocks read when mounting, which stops at the first invalid link, so only
+ * the termination of the chain remains to be verified.
+ */
+static int check_dir(struct check_ctx *ctx, int repair)
+{
+  const uint32_t *blocks;
+  uint32_t n = fs_dir_ext_blocks(&blocks);
+  int problems = 0;
+
+  if (n == 0) {
+    if (superblock.dir_blk_ext != 0) {
+      check_report("superblock: invalid root directory extension %u",
+                   superblock.dir_blk_ext);
+      problems++;
+      if (repair)
+        superblock.dir_blk_ext = 0;
+    }
+    return problems;
+  }
+
+  for (uint32_t i = 0; i < n; i++)
+    ctx->owner[blocks[i]] = OWNER_DIR;
+
+  if (fat[blocks[n - 1]] != FAT_EOC) {
+    check_report("root directory: block %u is linked to block %u",
+                 blocks[n - 1], fat[blocks[n - 1]]);
+    problems++;
+    if (repair)
+      fat[blocks[n - 1]] = FAT_EOC;
+  }
+  return problems;
+}
+
+/* Release the blocks of the chain starting at @block */
+static void check_free_chain(struct check_ctx *ctx, uint32_t block)
+{
+  while (block != FAT_EOC) {
+    uint32_t next = fat[block];
+    fat[block] = 0;
+    ctx->owner[block] = 0;
+    block = next;
+  }
+}
+
+/* Apply fix @fix to map entry @slot */
+static void check_repair_slot(struct check_ctx *ctx, struct map_fix *fix,
+                              uint64_t *slot)
+{
+  uint32_t block = *slot & MAP_BLOCK_MASK;
+
+  switch (fix->problem) {
+  case MAP_PAST_EOF:
+    /* Shared blocks are only freed with their last reference */
+    if (ctx->refs[block] == 0 || --ctx->refs[block] == 0) {
+      fat[block] = 0;
+      ctx->owner[block] = 0;
+    }
+    *slot = 0;
+    break;
+  case MAP_BAD_ENTRY:
+  case MAP_CROSS_LINK:
+    *slot = 0;
+    break;
+  case MAP_UNTERMINATED:
+    fat[block] = FAT_EOC;
+    break;
+  default:
+    break;
+  }
+}
+
+/* Apply the deferred fixes to the block map of mapped file @entry */
+static void check_repair_map(struct check_ctx *ctx, uint32_t entry)
+{
+  struct chain_info *info = &ctx->info[entry];
+  uint32_t root[MAP_ENTRIES_PER_BLOCK];
+  uint64_t leaf[MAP_ENTRIES_PER_BLOCK];
+  uint32_t rootblk = rootdir[entry].index_first_datablk;
+  uint32_t per_leaf = fs_map_leaf_entries();
+  uint32_t loaded = UINT32_MAX;
+
+  if (block_read(fs_cluster_block(rootblk), root) < 0)
+    return;
+
+  /* Fixes are sorted by logical block, each leaf is rewritten once */
+  for (uint32_t i = 0; i < info->nfixes; i++) {
+    struct map_fix *fix = &info->fixes[i];
+    uint32_t index = fix->lblk / per_leaf;
+
+    if (fix->leaf) {
+      uint64_t slot = root[index];
+
+      if (loaded == index) {
+        fs_map_write_leaf(root[index], leaf);
+        loaded = UINT32_MAX;
+      }
+      check_repair_slot(ctx, fix, &slot);
+      root[index] = slot;
+      continue;
+    }
+
+    if (index != loaded) {
+      if (loaded != UINT32_MAX)
+        fs_map_write_leaf(root[loaded], leaf);
+      loaded = UINT32_MAX;
+      if (fs_map_read_leaf(root[index], leaf) < 0)
+        continue;
+      loaded = index;
+    }
+    check_repair_slot(ctx, fix, &leaf[fix->lblk % per_leaf]);
+  }
+
+  if (loaded != UINT32_MAX)
+    fs_map_write_leaf(root[loaded], leaf);
+  block_write(fs_cluster_block(rootblk), root);
+}
+
+static int check_mapped_file(struct check_ctx *ctx, uint32_t entry, int repair)
+{
+  static const char *const descr[MAP_NR_PROBLEMS] = {
+    [MAP_BAD_ENTRY] = "invalid block map entries",
+    [MAP_CROSS_LINK] = "mapped blocks owned by another file or mapped twice",
+    [MAP_PAST_EOF] = "mapped blocks past the end of the file",
+    [MAP_UNTERMINATED] = "mapped blocks not terminated by FAT_EOC",
+  };
+  struct chain_info *info = &ctx->info[entry];
+  int problems = 0;
+
+  for (int i = 0; i < MAP_NR_PROBLEMS; i++) {
+    if (info->count[i]) {
+      check_report("'%s': %u %s", rootdir[entry].filename, info->count[i],
+                   descr[i]);
+      problems++;
+    }
+  }
+
+  if (problems && repair)
+    check_repair_map(ctx, entry);
+
+  return problems;
+}
+
+/*
+ * Release the blocks claimed for @file, saved in snapshot @entry, which is
+ * being dropped. The blocks no longer referenced are freed as leaked blocks.
+ */
+static void check_release_map(struct check_ctx *ctx, uint32_t entry,
+                              const struct RootDir *file)
+{
+  uint32_t root[MAP_ENTRIES_PER_BLOCK];
+  uint64_t leaf[MAP_ENTRIES_PER_BLOCK];
+  uint32_t rootblk = file->index_first_datablk;
+
+  if (rootblk == 0 || rootblk >= superblock.num_data_blks ||
+      ctx->owner[rootblk] != entry + 1)
+    return;
+  ctx->owner[rootblk] = 0;
+  if (block_read(fs_cluster_block(rootblk), root) < 0)
+    return;
+
+  for (uint32_t slot = 0; slot < MAP_ENTRIES_PER_BLOCK; slot++) {
+    if (root[slot] == 0 || root[slot] >= superblock.num_data_blks ||
+        ctx->owner[root[slot]] != entry + 1)
+      continue;
+    ctx->owner[root[slot]] = 0;
+    if (fs_map_read_leaf(root[slot], leaf) < 0)
+      continue;
+
+    for (uint32_t i = 0; i < fs_map_leaf_entries(); i++) {
+      uint32_t block = leaf[i] & MAP_BLOCK_MASK;
+
+      if (block == 0 || block >= superblock.num_data_blks ||
+          !(ctx->owner[block] & OWNER_SHARED) || ctx->refs[block] == 0)
+        continue;
+      if (--ctx->refs[block] == 0)
+        ctx->owner[block] = 0;
+    }
+  }
+}
+
+/* Report the damaged files saved in snapshot @entry, and drop them */
+static int check_snapshot_files(struct check_ctx *ctx, uint32_t entry,
+                                int repair)
+{
+  struct chain_info *info = &ctx->info[entry];
+  uint32_t block = rootdir[entry].index_first_datablk;
+  struct RootDir *saved;
+  uint32_t count;
+  int problems = 0;
+
+  if (!info->damaged || !(saved = check_snapshot_load(ctx, entry, &count)))
+    return 0;
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (!(info->damaged[i / 32] & 1u << (i % 32)))
+      continue;
+    check_report("'%s': saved file '%s' is damaged", rootdir[entry].filename,
+                 saved[i].filename);
+    problems++;
+    if (repair) {
+      check_release_map(ctx, entry, &saved[i]);
+      memset(&saved[i], 0, sizeof(saved[i]));
+    }
+  }
+
+  for (uint32_t i = 0; repair && i < count / DIR_ENTRIES_PER_BLOCK; i++) {
+    fs_dir_write(fs_cluster_block(block), saved + i * DIR_ENTRIES_PER_BLOCK);
+    block = fat[block];
+  }
+  free(saved);
+  return problems;
+}
+
+static int check_pack_cmp(const void *a, const void *b)
+{
+  const struct RootDir *x = &rootdir[*(const uint32_t *)a];
+  const struct RootDir *y = &rootdir[*(const uint32_t *)b];
+
+  if (x->index_first_datablk != y->index_first_datablk)
+    return x->index_first_datablk < y->index_first_datablk ? -1 : 1;
+  if (x->pack_offset != y->pack_offset)
+    return x->pack_offset < y->pack_offset ? -1 : 1;
+  return *(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1;
+}
+
+/*
+ * Find the packed files whose data overlaps the data of another packed file
+ * of their block. The files are sorted by block and offset, so that each one
+ * only has to be compared with the previous file kept in its block.
+ */
+static void check_pack_overlaps(struct check_ctx *ctx)
+{
+  uint32_t *files = malloc(rootdir_count * sizeof(*files));
+  uint32_t n = 0, prev = DIR_NONE;
+
+  if (!files)
+    return;
+
+  for (uint32_t i = 0; i < rootdir_count; i++) {
+    const struct RootDir *file = &rootdir[i];
+
+    if (*file->filename != 0 && (file->flags & RDIR_PACKED) &&
+        ctx->info[i].length != 0 && file->size_of_file != 0 &&
+        file->pack_offset + file->size_of_file <= BLOCK_SIZE)
+      files[n++] = i;
+  }
+  qsort(files, n, sizeof(*files), check_pack_cmp);
+
+  for (uint32_t i = 0; i < n; i++) {
+    const struct RootDir *file = &rootdir[files[i]];
+
+    if (prev != DIR_NONE &&
+        rootdir[prev].index_first_datablk == file->index_first_datablk &&
+        file->pack_offset <
+        rootdir[prev].pack_offset + rootdir[prev].size_of_file) {
+      ctx->info[files[i]].overlap = prev + 1;
+      continue;
+    }
+    prev = files[i];
+  }
+  free(files);
+}
+
+/*
+ * Verify that the data of packed file @entry lies within its block, and that
+ * it does not overlap the data of another packed file (see
+ * check_pack_overlaps()). The file is emptied if it does.
+ */
+static int check_packed_file(struct check_ctx *ctx, uint32_t entry,
+                             int repair)
+{
+  struct RootDir *file = &rootdir[entry];
+  int problems = 0;
+
+  if (file->pack_offset + file->size_of_file > BLOCK_SIZE) {
+    check_report("'%s': packed data ends past its block", file->filename);
+    problems++;
+  } else if (ctx->info[entry].overlap) {
+    check_report("'%s': packed data overlaps '%s'", file->filename,
+                 rootdir[ctx->info[entry].overlap - 1].filename);
+    problems++;
+  }
+
+  if (problems && repair) {
+    uint32_t block = file->index_first_datablk;
+
+    fs_pack_free(entry);
+    if (fat[block] == 0)
+      ctx->owner[block] = 0;
+    file->index_first_datablk = FAT_EOC;
+    file->size_of_file = 0;
+    file->pack_offset = 0;
+    file->flags &= ~RDIR_PACKED;
+  }
+  return problems;
+}
+
+static int check_file(struct check_ctx *ctx, uint32_t entry, int repair)
+{
+  struct chain_info *info = &ctx->info[entry];
+  struct RootDir *file = &rootdir[entry];
+  const char *name = (const char *)file->filename;
+  /* Chains are made of clusters, block maps of blocks (see fs_bmap()) */
+  uint32_t needed = (file->size_of_file + (uint64_t)fs_cluster_size() - 1)
+                    / fs_cluster_size();
+  int problems = 0;
+
+  switch (info->end) {
+  case CHAIN_EOC:
+    break;
+  case CHAIN_BAD_LINK:
+    check_report("'%s': invalid link to block %u", name, info->culprit);
+    break;
+  case CHAIN_FREE_LINK:
+    check_report("'%s': block %u is linked to a free block", name,
+                 info->culprit);
+    break;
+  case CHAIN_LOOP:
+    check_report("'%s': chain loops back to block %u", name, info->culprit);
+    break;
+  case CHAIN_CROSS_LINK:
+    if (info->other >= rootdir_count)
+      check_report("'%s': cross-linked with the root directory at block %u",
+                   name, info->culprit);
+    else
+      check_report("'%s': cross-linked with '%s' at block %u", name,
+                   rootdir[info->other].filename, info->culprit);
+    break;
+  case CHAIN_MAP_LINK:
+    check_report("'%s': block map is linked to block %u", name,
+                 info->culprit);
+    break;
+  case CHAIN_PACK_LINK:
+    check_report("'%s': packed block is linked to block %u", name,
+                 info->culprit);
+    break;
+  }
+
+  if (info->end != CHAIN_EOC) {
+    problems++;
+    if (repair) {
+      /* Terminate the chain at its last valid block */
+      if (info->last == FAT_EOC)
+        file->index_first_datablk = FAT_EOC;
+      else
+        fat[info->last] = FAT_EOC;
+    }
+  }
+
+  if (file->flags & RDIR_MAPPED) {
+    /* Without its root map block, nothing is left of the file */
+    if (info->length == 0) {
+      if (repair) {
+        file->size_of_file = 0;
+        file->flags &= ~RDIR_MAPPED;
+      }
+      return problems;
+    }
+    return problems + check_mapped_file(ctx, entry, repair);
+  }
+
+  if (file->flags & RDIR_PACKED) {
+    /* Without its block, nothing is left of the file */
+    if (info->length == 0) {
+      if (repair) {
+        file->size_of_file = 0;
+        file->pack_offset = 0;
+        file->flags &= ~RDIR_PACKED;
+      }
+      return problems;
+    }
+    return problems + check_packed_file(ctx, entry, repair);
+  }
+
+  if (file->flags & RDIR_SNAPSHOT) {
+    /* Without its block, nothing is left of the snapshot */
+    if (info->length == 0) {
+      if (repair)
+        fs_dir_free(entry);
+      return problems;
+    }
+    problems += check_snapshot_files(ctx, entry, repair);
+  }
+
+  if (info->length < needed) {
+    check_report("'%s': size %u needs %u blocks but chain has %u", name,
+                 file->size_of_file, needed, info->length);
+    problems++;
+    if (repair)
+      file->size_of_file = info->length * fs_cluster_size();
+  } else if (info->length > needed) {
+    check_report("'%s': %u extra blocks past the end of the file", name,
+                 info->length - needed);
+    problems++;
+    if (repair) {
+      uint32_t block;
+
+      if (needed == 0) {
+        block = file->index_first_datablk;
+        file->index_first_datablk = FAT_EOC;
+      } else {
+        uint32_t last = file->index_first_datablk;
+        for (uint32_t i = 1; i < needed; i++)
+          last = fat[last];
+        block = fat[last];
+        fat[last] = FAT_EOC;
+      }
+      check_free_chain(ctx, block);
+    }
+  }
+
+  return problems;
+}
+
+int fs_check(int repair) {
+  struct check_ctx *ctx;
+  int problems = 0;
+  uint32_t leaked = 0;
+
+  if (!mounted || (repair && readonly)) {
+    return -1;
+  }
+
+  /* Repairs may free blocks, the transfers to them must be done */
+  fs_async_drain();
+  /* Queued blocks are referenced by no file */
+  fs_reclaim_all();
+
+  ctx = calloc(1, sizeof(*ctx));
+  if (!ctx) {
+    return -1;
+  }
+  ctx->owner = calloc(superblock.num_data_blks, sizeof(*ctx->owner));
+  ctx->refs = calloc(superblock.num_data_blks, sizeof(*ctx->refs));
+  ctx->info = calloc(rootdir_count, sizeof(*ctx->info));
+  if (!ctx->owner || !ctx->refs || !ctx->info) {
+    free(ctx->owner);
+    free(ctx->refs);
+    free(ctx->info);
+    free(ctx);
+    return -1;
+  }
+
+  printf("FS Check:\n");
+
+  problems += check_superblock(repair);
+  problems += check_csums(repair);
+  problems += check_dir(ctx, repair);
+
+  check_all_chains(ctx);
+  check_pack_overlaps(ctx);
+
+  for (uint32_t i = 0; i < rootdir_count; i++) {
+    if (*rootdir[i].filename != 0) {
+      problems += check_file(ctx, i, repair);
+    }
+  }
+
+  /* Allocated blocks that no file reached are leaked */
+  for (uint32_t i = 1; i < superblock.num_data_blks; i++) {
+    if (fat[i] != 0 && ctx->owner[i] == 0) {
+      leaked++;
+      if (repair)
+        fat[i] = 0;
+    }
+  }
+  if (leaked) {
+    check_report("%u leaked blocks", leaked);
+    problems++;
+  }
+
+  printf("problems=%d%s\n", problems, problems && repair ? " (repaired)" : "");
+
+  /* Repairs may have changed which blocks are shared */
+  if (problems && repair) {
+    fs_pack_load();
+    fs_dedup_load();
+  }
+
+  for (uint32_t i = 0; i < rootdir_count; i++) {
+    free(ctx->info[i].fixes);
+    free(ctx->info[i].damaged);
+  }
+  free(ctx->info);
+  free(ctx->owner);
+  free(ctx->refs);
+  free(ctx);
+  return problems;
+}
@@ -0,0 +1,270 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fs_internal.h"
+#include "fs_lz.h"
+
+/*
+ * Compressed files (see RDIR_COMPRESSED). Reads and writes go through a
+ * decompressed copy of one chunk, so that random reads decompress a single
+ * chunk and small sequential accesses decompress each chunk once.
+ */
+
+static struct {
+  int valid;
+  uint32_t entry;
+  uint32_t chunk;
+  uint8_t data[COMPRESS_CHUNK_SIZE];
+} chunk_cache;
+
+/* Compressed stream of the chunk being loaded or stored */
+static uint8_t chunk_packed[COMPRESS_CHUNK_SIZE];
+
+void fs_compress_forget(uint32_t entry)
+{
+  if (chunk_cache.entry == entry)
+    chunk_cache.valid = 0;
+}
+
+void fs_compress_reset(void)
+{
+  chunk_cache.valid = 0;
+}
+
+/* Decompress chunk @chunk of @entry into the chunk cache */
+static int chunk_load(uint32_t entry, uint32_t chunk)
+{
+  uint64_t map[COMPRESS_CHUNK_BLOCKS];
+  uint32_t clen, nblocks;
+  uint8_t *dst;
+
+  if (chunk_cache.valid && chunk_cache.entry == entry &&
+      chunk_cache.chunk == chunk)
+    return 0;
+  chunk_cache.valid = 0;
+
+  fs_map_get_range(entry, chunk * COMPRESS_CHUNK_BLOCKS, map,
+                   COMPRESS_CHUNK_BLOCKS);
+  clen = map[0] >> MAP_CLEN_SHIFT;
+  dst = clen ? chunk_packed : chunk_cache.data;
+  nblocks = clen ? (clen + BLOCK_SIZE - 1) / BLOCK_SIZE
+                 : COMPRESS_CHUNK_BLOCKS;
+
+  for (uint32_t i = 0; i < nblocks; i++) {
+    uint32_t block = map[i] & MAP_BLOCK_MASK;
+
+    if (block == 0) {
+      /* A compressed stream cannot have holes */
+      if (clen)
+        return -1;
+      memset(dst + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+      continue;
+    }
+    if (block_read(fs_cluster_block(block), dst + i * BLOCK_SIZE) < 0)
+      return -1;
+  }
+
+  if (clen) {
+    long n = lz_decompress(chunk_packed, clen, chunk_cache.data,
+                           COMPRESS_CHUNK_SIZE);
+    if (n < 0)
+      return -1;
+    memset(chunk_cache.data + n, 0, COMPRESS_CHUNK_SIZE - n);
+  }
+
+  chunk_cache.entry = entry;
+  chunk_cache.chunk = chunk;
+  chunk_cache.valid = 1;
+  return 0;
+}
+
+/*
+ * Write the first @len bytes of the cached chunk back to the disk, compressed
+ * if that saves at least one block. The blocks of the previous version of the
+ * chunk are reused.
+ */
+static int chunk_store(uint32_t len)
+{
+  uint32_t entry = chunk_cache.entry;
+  uint32_t lblk = chunk_cache.chunk * COMPRESS_CHUNK_BLOCKS;
+  uint64_t map[COMPRESS_CHUNK_BLOCKS];
+  uint32_t blocks[COMPRESS_CHUNK_BLOCKS];
+  uint32_t nblocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  uint32_t nold = 0, nused = nblocks, n;
+  const uint8_t *src = chunk_cache.data;
+  size_t clen = 0;
+
+  if (nblocks > 1)
+    clen = lz_compress(chunk_cache.data, len, chunk_packed,
+                       (nblocks - 1) * BLOCK_SIZE);
+  if (clen) {
+    nused = (clen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    memset(chunk_packed + clen, 0, nused * BLOCK_SIZE - clen);
+    src = chunk_packed;
+  }
+
+  fs_map_get_range(entry, lblk, map, COMPRESS_CHUNK_BLOCKS);
+  for (uint32_t i = 0; i < COMPRESS_CHUNK_BLOCKS; i++) {
+    if (map[i] & MAP_BLOCK_MASK)
+      blocks[nold++] = map[i] & MAP_BLOCK_MASK;
+  }
+
+  /* Allocate the missing blocks first, a full disk leaves the chunk intact */
+  for (n = nold; n < nused; n++) {
+    blocks[n] = fs_findfirstblock();
+    if (blocks[n] == FAT_EOC)
+      goto fail;
+  }
+
+  for (uint32_t i = 0; i < nused; i++) {
+    if (block_write(fs_cluster_block(blocks[i]), src + i * BLOCK_SIZE) < 0)
+      goto fail;
+  }
+
+  memset(map, 0, sizeof(map));
+  for (uint32_t i = 0; i < nused; i++)
+    map[i] = blocks[i];
+  map[0] |= (uint64_t)clen << MAP_CLEN_SHIFT;
+  if (fs_map_set_range(entry, lblk, map, COMPRESS_CHUNK_BLOCKS) < 0)
+    goto fail;
+
+  for (uint32_t i = nused; i < nold; i++)
+    fat[blocks[i]] = 0;
+  return 0;
+
+fail:
+  while (n-- > nold)
+    fat[blocks[n]] = 0;
+  return -1;
+}
+
+int fs_compress_read(uint32_t entry, uint32_t offset, uint8_t *buf,
+                     uint32_t count)
+{
+  uint32_t done = 0;
+
+  while (count > 0) {
+    uint32_t chunk = offset / COMPRESS_CHUNK_SIZE;
+    uint32_t inchunk = offset % COMPRESS_CHUNK_SIZE;
+    uint32_t n = COMPRESS_CHUNK_SIZE - inchunk;
+
+    if (n > count)
+      n = count;
+    if (chunk_load(entry, chunk) < 0)
+      return done ? (int)done : -1;
+
+    memcpy(buf + done, chunk_cache.data + inchunk, n);
+    done += n;
+    offset += n;
+    count -= n;
+  }
+
+  return done;
+}
+
+int fs_compress_write(uint32_t entry, uint32_t offset, const uint8_t *buf,
+                      uint32_t count)
+{
+  uint32_t size = rootdir[entry].size_of_file;
+  uint32_t done = 0;
+
+  while (count > 0) {
+    uint32_t chunk = offset / COMPRESS_CHUNK_SIZE;
+    uint32_t start = chunk * COMPRESS_CHUNK_SIZE;
+    uint32_t inchunk = offset - start;
+    uint32_t n = COMPRESS_CHUNK_SIZE - inchunk;
+    uint32_t len;
+
+    if (n > count)
+      n = count;
+
+    /* Number of bytes of the chunk lying in the file after the write */
+    len = inchunk + n;
+    if (size > start && size - start > len)
+      len = size - start < COMPRESS_CHUNK_SIZE ? size - start
+                                               : COMPRESS_CHUNK_SIZE;
+
+    if (start >= size || n == COMPRESS_CHUNK_SIZE) {
+      /* Nothing to preserve in this chunk */
+      chunk_cache.valid = 0;
+      if (n < COMPRESS_CHUNK_SIZE)
+        memset(chunk_cache.data, 0, COMPRESS_CHUNK_SIZE);
+      chunk_cache.entry = entry;
+      chunk_cache.chunk = chunk;
+      chunk_cache.valid = 1;
+    } else {
+      if (chunk_load(entry, chunk) < 0)
+        break;
+      /* whatever lies past the end of the file reads as zeros */
+      if (size - start < COMPRESS_CHUNK_SIZE)
+        memset(chunk_cache.data + (size - start), 0,
+               COMPRESS_CHUNK_SIZE - (size - start));
+    }
+
+    memcpy(chunk_cache.data + inchunk, buf + done, n);
+    if (chunk_store(len) < 0) {
+      chunk_cache.valid = 0;
+      break;
+    }
+
+    done += n;
+    offset += n;
+    count -= n;
+    if (size < offset)
+      size = offset;
+  }
+
+  return done;
+}
+
+int fs_compress_truncate(uint32_t entry, uint32_t size)
+{
+  uint32_t chunk = size / COMPRESS_CHUNK_SIZE;
+  uint32_t len = size % COMPRESS_CHUNK_SIZE;
+  uint32_t lblk = chunk * COMPRESS_CHUNK_BLOCKS;
+
+  /* Nothing to cut within a chunk, or a chunk that is a hole */
+  if (len == 0 ||
+      fs_map_next(entry, lblk, lblk + COMPRESS_CHUNK_BLOCKS, 1) ==
+      lblk + COMPRESS_CHUNK_BLOCKS)
+    return 0;
+
+  if (chunk_load(entry, chunk) < 0)
+    return -1;
+  memset(chunk_cache.data + len, 0, COMPRESS_CHUNK_SIZE - len);
+  if (chunk_store(len) < 0) {
+    chunk_cache.valid = 0;
+    return -1;
+  }
+  return 0;
+}
+
+void fs_compress_usage(uint32_t entry, size_t *data, size_t *stored)
+{
+  uint32_t nblocks = ((uint64_t)rootdir[entry].size_of_file + BLOCK_SIZE - 1)
+                     / BLOCK_SIZE;
+  uint64_t map[COMPRESS_CHUNK_BLOCKS];
+  uint32_t lblk = 0;
+
+  *data = 0;
+  *stored = 0;
+
+  /* Holes are skipped, the chunks holding data are counted as a whole */
+  while ((lblk = fs_map_next(entry, lblk, nblocks, 1)) < nblocks) {
+    uint32_t used = 0;
+
+    lblk -= lblk % COMPRESS_CHUNK_BLOCKS;
+    fs_map_get_range(entry, lblk, map, COMPRESS_CHUNK_BLOCKS);
+    for (uint32_t i = 0; i < COMPRESS_CHUNK_BLOCKS; i++)
+      used += map[i] != 0;
+
+    if (map[0] >> MAP_CLEN_SHIFT)
+      *data += nblocks - lblk < COMPRESS_CHUNK_BLOCKS
+               ? nblocks - lblk : COMPRESS_CHUNK_BLOCKS;
+    else
+      *data += used;
+    *stored += used;
+    lblk += COMPRESS_CHUNK_BLOCKS;
+  }
+}
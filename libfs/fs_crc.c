@@ -0,0 +1,186 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fs_crc.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC_X86 1
+#endif
+
+/* Reflected Castagnoli polynomial */
+#define CRC_POLY 0x82f63b78u
+
+/*
+ * Length of each of the three streams of the SSE4.2 implementation, so that a
+ * 4 KiB block is three streams and a 16-byte tail
+ */
+#define CRC_STRIDE 1360
+
+/* Slicing-by-8 tables */
+static uint32_t crc_table[8][256];
+
+/*
+ * Tables appending CRC_STRIDE and 2 * CRC_STRIDE zero bytes to a CRC register,
+ * one per byte of the register, to combine the three streams
+ */
+static uint32_t crc_shift1[4][256];
+static uint32_t crc_shift2[4][256];
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/* Register @crc (not inverted) after @n more zero bytes */
+static uint32_t crc_zeros(uint32_t crc, size_t n)
+{
+  while (n--)
+    crc = crc_table[0][crc & 0xff] ^ crc >> 8;
+  return crc;
+}
+
+/* The CRC register is linear: build the tables from its 32 basis vectors */
+static void crc_shift_init(uint32_t table[4][256], size_t n)
+{
+  uint32_t basis[32];
+
+  for (int bit = 0; bit < 32; bit++)
+    basis[bit] = crc_zeros(1u << bit, n);
+
+  for (int byte = 0; byte < 4; byte++) {
+    for (uint32_t v = 0; v < 256; v++) {
+      uint32_t crc = 0;
+      for (int bit = 0; bit < 8; bit++) {
+        if (v & 1u << bit)
+          crc ^= basis[8 * byte + bit];
+      }
+      table[byte][v] = crc;
+    }
+  }
+}
+
+static void crc_init(void)
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++)
+      crc = crc & 1 ? crc >> 1 ^ CRC_POLY : crc >> 1;
+    crc_table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+    for (int k = 1; k < 8; k++)
+      crc_table[k][i] = crc_table[k - 1][i] >> 8 ^
+                        crc_table[0][crc_table[k - 1][i] & 0xff];
+  }
+
+  crc_shift_init(crc_shift1, CRC_STRIDE);
+  crc_shift_init(crc_shift2, 2 * CRC_STRIDE);
+}
+
+static inline uint64_t crc_load64(const uint8_t *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/* Scalar implementation */
+
+static uint32_t scalar_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+
+  crc = ~crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t v = crc_load64(p) ^ crc;
+    crc = crc_table[7][v & 0xff] ^ crc_table[6][v >> 8 & 0xff] ^
+          crc_table[5][v >> 16 & 0xff] ^ crc_table[4][v >> 24 & 0xff] ^
+          crc_table[3][v >> 32 & 0xff] ^ crc_table[2][v >> 40 & 0xff] ^
+          crc_table[1][v >> 48 & 0xff] ^ crc_table[0][v >> 56];
+  }
+  for (; len > 0; p++, len--)
+    crc = crc_table[0][(crc ^ *p) & 0xff] ^ crc >> 8;
+  return ~crc;
+}
+
+static const struct crc_ops scalar_ops = {
+  .name = "scalar",
+  .crc32c = scalar_crc32c,
+};
+
+#ifdef CRC_X86
+
+/* SSE4.2 implementation */
+
+static inline uint32_t crc_shift(const uint32_t table[4][256], uint32_t crc)
+{
+  return table[0][crc & 0xff] ^ table[1][crc >> 8 & 0xff] ^
+         table[2][crc >> 16 & 0xff] ^ table[3][crc >> 24];
+}
+
+/*
+ * The crc32 instruction has a latency of three cycles but a throughput of one
+ * per cycle: three independent streams keep it busy, and are then combined.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t sse42_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+  uint64_t c0 = ~crc;
+
+  for (; len >= 3 * CRC_STRIDE; p += 3 * CRC_STRIDE, len -= 3 * CRC_STRIDE) {
+    uint64_t c1 = 0, c2 = 0;
+
+    for (size_t i = 0; i < CRC_STRIDE; i += 8) {
+      c0 = _mm_crc32_u64(c0, crc_load64(p + i));
+      c1 = _mm_crc32_u64(c1, crc_load64(p + CRC_STRIDE + i));
+      c2 = _mm_crc32_u64(c2, crc_load64(p + 2 * CRC_STRIDE + i));
+    }
+    c0 = crc_shift(crc_shift2, c0) ^ crc_shift(crc_shift1, c1) ^ c2;
+  }
+  for (; len >= 8; p += 8, len -= 8)
+    c0 = _mm_crc32_u64(c0, crc_load64(p));
+  for (; len > 0; p++, len--)
+    c0 = _mm_crc32_u8(c0, *p);
+  return ~(uint32_t)c0;
+}
+
+static const struct crc_ops sse42_ops = {
+  .name = "sse4.2",
+  .crc32c = sse42_crc32c,
+};
+
+#endif /* CRC_X86 */
+
+const struct crc_ops *crc_ops_level(enum crc_level level)
+{
+  pthread_once(&crc_once, crc_init);
+
+  switch (level) {
+  case CRC_SCALAR:
+    return &scalar_ops;
+#ifdef CRC_X86
+  case CRC_SSE42:
+    if (__builtin_cpu_supports("sse4.2"))
+      return &sse42_ops;
+    break;
+#endif
+  default:
+    break;
+  }
+  return NULL;
+}
+
+const struct crc_ops *crc_ops(void)
+{
+  static const struct crc_ops *best;
+
+  if (!best) {
+    const struct crc_ops *ops = NULL;
+    for (int level = CRC_NR_LEVELS - 1; !ops; level--) {
+      ops = crc_ops_level(level);
+    }
+    best = ops;
+  }
+  return best;
+}
@@ -0,0 +1,42 @@
+#ifndef _FS_CRC_H
+#define _FS_CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli polynomial), used for the block checksums. There is a
+ * table-driven implementation and one using the SSE4.2 crc32 instruction on
+ * three interleaved streams; the best one supported by the CPU is selected at
+ * runtime.
+ */
+
+enum crc_level {
+  CRC_SCALAR,
+  CRC_SSE42,
+  CRC_NR_LEVELS,
+};
+
+struct crc_ops {
+  const char *name;
+  /*
+   * CRC32C of the @len bytes at @buf, continuing the CRC32C @crc of the
+   * preceding bytes (0 to start)
+   */
+  uint32_t (*crc32c)(uint32_t crc, const void *buf, size_t len);
+};
+
+/**
+ * crc_ops - Get the best implementation supported by the CPU
+ */
+const struct crc_ops *crc_ops(void);
+
+/**
+ * crc_ops_level - Get a given implementation
+ * @level: Implementation level
+ *
+ * Return: NULL if @level is not supported by the CPU.
+ */
+const struct crc_ops *crc_ops_level(enum crc_level level);
+
+#endif /* _FS_CRC_H */
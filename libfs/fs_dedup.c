@@ -0,0 +1,318 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fs_internal.h"
+
+/*
+ * Deduplicated files (see RDIR_DEDUP). Data blocks can be shared between the
+ * block maps of all the deduplicated files, each map entry holding the 16-bit
+ * tag of the fingerprint of its block. Reference counts and the fingerprint
+ * index are only kept in memory, and rebuilt from the maps when mounting.
+ * Blocks with the same tag are only shared after comparing their content.
+ */
+
+#define DEDUP_BUCKETS (1 << 16)
+
+/* Number of map entries referencing each data block */
+static uint16_t *dedup_refs;
+/* Fingerprint of each indexed data block, 0 when not computed yet */
+static uint64_t *dedup_hash;
+/* Index: first block of each tag, then chained through dedup_next */
+static uint32_t *dedup_bucket;
+static uint32_t *dedup_next;
+static uint16_t *dedup_tags;
+
+static uint64_t dedup_fingerprint(const uint8_t *data)
+{
+  uint64_t h = 0x9e3779b97f4a7c15ull;
+
+  for (size_t i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t)) {
+    uint64_t v;
+    memcpy(&v, data + i, sizeof(v));
+    h = (h ^ v) * 0xff51afd7ed558ccdull;
+    h ^= h >> 29;
+  }
+  /* 0 stands for an unknown fingerprint */
+  return h ? h : 1;
+}
+
+static inline uint16_t dedup_tag(uint64_t hash)
+{
+  /* Tag 0 is for blocks that are not indexed */
+  return hash >> 48 ? hash >> 48 : 1;
+}
+
+static void dedup_index(uint32_t block, uint16_t tag)
+{
+  dedup_tags[block] = tag;
+  dedup_next[block] = dedup_bucket[tag];
+  dedup_bucket[tag] = block;
+}
+
+static void dedup_unindex(uint32_t block)
+{
+  uint32_t *link = &dedup_bucket[dedup_tags[block]];
+
+  while (*link && *link != block)
+    link = &dedup_next[*link];
+  if (*link)
+    *link = dedup_next[block];
+  dedup_hash[block] = 0;
+}
+
+void fs_dedup_ref(const struct RootDir *file)
+{
+  uint32_t root[MAP_ENTRIES_PER_BLOCK];
+  uint64_t leaf[MAP_ENTRIES_PER_BLOCK];
+  uint32_t rootblk = file->index_first_datablk;
+
+  if (rootblk == 0 || rootblk >= superblock.num_data_blks ||
+      block_read(fs_cluster_block(rootblk), root) < 0)
+    return;
+
+  for (uint32_t slot = 0; slot < MAP_ENTRIES_PER_BLOCK; slot++) {
+    if (root[slot] == 0 || root[slot] >= superblock.num_data_blks ||
+        fs_map_read_leaf(root[slot], leaf) < 0)
+      continue;
+
+    for (uint32_t i = 0; i < fs_map_leaf_entries(); i++) {
+      uint32_t block = leaf[i] & MAP_BLOCK_MASK;
+
+      if (block == 0 || block >= superblock.num_data_blks ||
+          dedup_refs[block] == UINT16_MAX)
+        continue;
+      if (dedup_refs[block]++ == 0 && leaf[i] >> MAP_TAG_SHIFT)
+        dedup_index(block, leaf[i] >> MAP_TAG_SHIFT);
+    }
+  }
+}
+
+int fs_dedup_load(void)
+{
+  fs_dedup_unload();
+
+  dedup_refs = calloc(superblock.num_data_blks, sizeof(*dedup_refs));
+  dedup_hash = calloc(superblock.num_data_blks, sizeof(*dedup_hash));
+  dedup_next = calloc(superblock.num_data_blks, sizeof(*dedup_next));
+  dedup_tags = calloc(superblock.num_data_blks, sizeof(*dedup_tags));
+  dedup_bucket = calloc(DEDUP_BUCKETS, sizeof(*dedup_bucket));
+  if (!dedup_refs || !dedup_hash || !dedup_next || !dedup_tags ||
+      !dedup_bucket) {
+    fs_dedup_unload();
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < rootdir_count; i++) {
+    struct RootDir *saved;
+    uint32_t count;
+
+    if (*rootdir[i].filename == 0)
+      continue;
+    if (rootdir[i].flags & RDIR_DEDUP)
+      fs_dedup_ref(&rootdir[i]);
+
+    /* The files of snapshots share blocks with the live files */
+    if (!(rootdir[i].flags & RDIR_SNAPSHOT) ||
+        !(saved = fs_snapshot_load(&rootdir[i], &count)))
+      continue;
+    for (uint32_t j = 0; j < count; j++) {
+      if (*saved[j].filename != 0 && (saved[j].flags & RDIR_DEDUP))
+        fs_dedup_ref(&saved[j]);
+    }
+    free(saved);
+  }
+  return 0;
+}
+
+void fs_dedup_unload(void)
+{
+  free(dedup_refs);
+  free(dedup_hash);
+  free(dedup_next);
+  free(dedup_tags);
+  free(dedup_bucket);
+  dedup_refs = NULL;
+  dedup_hash = NULL;
+  dedup_next = NULL;
+  dedup_tags = NULL;
+  dedup_bucket = NULL;
+}
+
+void fs_dedup_put(uint32_t block)
+{
+  if (dedup_refs[block] == 0 || --dedup_refs[block] > 0)
+    return;
+
+  dedup_unindex(block);
+  fat[block] = 0;
+}
+
+/*
+ * Find a block holding the same data as @data, whose fingerprint is @hash.
+ * Return 0 if there is none.
+ */
+static uint32_t dedup_find(const uint8_t *data, uint64_t hash)
+{
+  uint8_t tmp[BLOCK_SIZE];
+
+  for (uint32_t b = dedup_bucket[dedup_tag(hash)]; b; b = dedup_next[b]) {
+    if (dedup_refs[b] == UINT16_MAX)
+      continue;
+    if (dedup_hash[b] && dedup_hash[b] != hash)
+      continue;
+    if (block_read(fs_cluster_block(b), tmp) < 0)
+      continue;
+    /* Remember the fingerprints of blocks indexed when mounting */
+    dedup_hash[b] = dedup_fingerprint(tmp);
+    if (dedup_hash[b] == hash && memcmp(tmp, data, BLOCK_SIZE) == 0)
+      return b;
+  }
+  return 0;
+}
+
+/*
+ * Map logical block @lblk of @entry, currently mapped to @old, to a block
+ * holding @data: an identical block if there is one, the old block rewritten
+ * in place if nothing else references it, or a new block (copy-on-write).
+ */
+static int dedup_store(uint32_t entry, uint32_t lblk, uint64_t old,
+                       const uint8_t *data)
+{
+  uint32_t oldblk = old & MAP_BLOCK_MASK;
+  uint32_t block = 0;
+  uint64_t value = 0;
+
+  /* Blocks of zeros become holes */
+  if (memcmp(data, zero_block, BLOCK_SIZE) != 0) {
+    uint64_t hash = dedup_fingerprint(data);
+
+    block = dedup_find(data, hash);
+    if (block != 0 && block == oldblk)
+      return 0;
+
+    if (block != 0) {
+      dedup_refs[block]++;
+    } else {
+      if (oldblk != 0 && dedup_refs[oldblk] == 1) {
+        block = oldblk;
+        dedup_unindex(block);
+      } else {
+        block = fs_findfirstblock();
+        if (block == FAT_EOC)
+          return -1;
+        dedup_refs[block] = 1;
+      }
+      if (block_write(fs_cluster_block(block), data) < 0) {
+        if (block != oldblk)
+          fs_dedup_put(block);
+        return -1;
+      }
+      dedup_hash[block] = hash;
+      dedup_index(block, dedup_tag(hash));
+    }
+    value = block | (uint64_t)dedup_tag(hash) << MAP_TAG_SHIFT;
+  }
+
+  if (value != old && fs_map_set(entry, lblk, value) < 0) {
+    if (block != 0 && block != oldblk)
+      fs_dedup_put(block);
+    return -1;
+  }
+  if (oldblk != 0 && oldblk != block)
+    fs_dedup_put(oldblk);
+  return 0;
+}
+
+int fs_dedup_write(uint32_t entry, uint32_t offset, const uint8_t *buf,
+                   uint32_t count)
+{
+  uint32_t size = rootdir[entry].size_of_file;
+  uint8_t tmp[BLOCK_SIZE];
+  uint32_t done = 0;
+
+  while (count > 0) {
+    uint32_t lblk = offset / BLOCK_SIZE;
+    uint32_t inblock = offset % BLOCK_SIZE;
+    uint32_t blockstart = offset - inblock;
+    uint32_t n = BLOCK_SIZE - inblock;
+    uint64_t old = fs_map_get(entry, lblk);
+    const uint8_t *data = buf + done;
+
+    if (n > count)
+      n = count;
+
+    if (n < BLOCK_SIZE) {
+      uint32_t oldblk = old & MAP_BLOCK_MASK;
+
+      if (oldblk == 0)
+        memset(tmp, 0, BLOCK_SIZE);
+      else if (block_read(fs_cluster_block(oldblk), tmp) < 0)
+        break;
+      /* whatever lies past the end of the file reads as zeros */
+      if (size < (uint64_t)blockstart + BLOCK_SIZE) {
+        uint32_t keep = size > blockstart ? size - blockstart : 0;
+        memset(tmp + keep, 0, BLOCK_SIZE - keep);
+      }
+      memcpy(tmp + inblock, buf + done, n);
+      data = tmp;
+    }
+
+    if (dedup_store(entry, lblk, old, data) < 0)
+      break;
+
+    done += n;
+    offset += n;
+    count -= n;
+    if (size < offset)
+      size = offset;
+  }
+
+  return done;
+}
+
+int fs_dedup_share(uint32_t dst, uint32_t dst_lblk, uint32_t src,
+                   uint32_t src_lblk, uint32_t count)
+{
+  uint64_t values[MAP_ENTRIES_PER_BLOCK];
+  uint64_t old[MAP_ENTRIES_PER_BLOCK];
+  uint32_t per_leaf = fs_map_leaf_entries();
+
+  /* Neither range can span two leaf map blocks */
+  if (count > per_leaf - src_lblk % per_leaf)
+    count = per_leaf - src_lblk % per_leaf;
+  if (count > per_leaf - dst_lblk % per_leaf)
+    count = per_leaf - dst_lblk % per_leaf;
+
+  fs_map_get_range(src, src_lblk, values, count);
+  /* Stop before a block that cannot take one more reference */
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t block = values[i] & MAP_BLOCK_MASK;
+    if (block != 0 && dedup_refs[block] == UINT16_MAX) {
+      count = i;
+      break;
+    }
+  }
+  if (count == 0)
+    return 0;
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t block = values[i] & MAP_BLOCK_MASK;
+    if (block != 0)
+      dedup_refs[block]++;
+  }
+  fs_map_get_range(dst, dst_lblk, old, count);
+  if (fs_map_set_range(dst, dst_lblk, values, count) < 0) {
+    for (uint32_t i = 0; i < count; i++) {
+      if (values[i] & MAP_BLOCK_MASK)
+        fs_dedup_put(values[i] & MAP_BLOCK_MASK);
+    }
+    return -1;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    if (old[i] & MAP_BLOCK_MASK)
+      fs_dedup_put(old[i] & MAP_BLOCK_MASK);
+  }
+  return count;
+}
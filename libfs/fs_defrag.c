@@ -0,0 +1,381 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Online defragmentation. The data clusters of a file, in logical order (holes
+ * skipped), form runs of consecutive FAT indices. The defragmenter compacts
+ * the files one after the other, in directory order, from the start of the
+ * data region: each cluster is moved to the next position, after the cluster
+ * in that position, if any, was moved out of the way to the highest free
+ * cluster. The block map of a mapped file goes right before its data. Files
+ * end up in a single run each, and the free space at the end of the region,
+ * but for the gaps left before clusters that cannot move when the next file
+ * does not fit in them.
+ *
+ * Nothing is remembered between calls: the next position to fill is found
+ * again by walking the files, which lets the files be modified in between.
+ * Every move leaves the files consistent: the clusters are copied first, then
+ * relinked into the chain or the block map, and their former places freed.
+ *
+ * Deduplicated files are left in place, as the index of shared blocks is keyed
+ * by their position, and so are packed files, whose block is shared, and
+ * snapshots. Their clusters are skipped over like those of the directory.
+ */
+
+/* Blocks copied at most by one move */
+#define DEFRAG_STEP_BLOCKS 256
+
+/*
+ * Clusters of a file in compaction order: for a mapped file, the root then the
+ * leaf map blocks (@nmeta of them) before the data. @lclus holds the logical
+ * cluster of the data, and the slot in the root of the leaf map blocks.
+ */
+struct defrag_list {
+  uint32_t *clusters;
+  uint32_t *lclus;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t nmeta;
+};
+
+/* State of one fs_defrag() call */
+struct defrag_ctx {
+  struct defrag_list *lists;
+  /* File and index in its list of each cluster, DIR_NONE if not movable */
+  uint32_t *owner;
+  uint32_t *owner_idx;
+  /* No free cluster above this one */
+  uint32_t high;
+  uint8_t *buf;
+};
+
+static void defrag_list_free(struct defrag_list *list)
+{
+  free(list->clusters);
+  free(list->lclus);
+}
+
+static int defrag_list_add(struct defrag_list *list, uint32_t cluster,
+                           uint32_t lclu)
+{
+  if (list->count == list->capacity) {
+    uint32_t n = list->capacity ? 2 * list->capacity : 64;
+    uint32_t *clusters = realloc(list->clusters, n * sizeof(*clusters));
+    uint32_t *lclus;
+
+    if (!clusters)
+      return -1;
+    list->clusters = clusters;
+    lclus = realloc(list->lclus, n * sizeof(*lclus));
+    if (!lclus)
+      return -1;
+    list->lclus = lclus;
+    list->capacity = n;
+  }
+  list->clusters[list->count] = cluster;
+  list->lclus[list->count] = lclu;
+  list->count++;
+  return 0;
+}
+
+/* List the clusters of @entry */
+static int defrag_list(uint32_t entry, struct defrag_list *list)
+{
+  const struct RootDir *file = &rootdir[entry];
+
+  memset(list, 0, sizeof(*list));
+
+  if (file->flags & RDIR_PACKED) {
+    if (file->size_of_file > 0 &&
+        defrag_list_add(list, file->index_first_datablk, 0) < 0)
+      goto fail;
+    return 0;
+  }
+
+  if (file->flags & RDIR_MAPPED) {
+    uint32_t end = ((uint64_t)file->size_of_file + BLOCK_SIZE - 1) /
+                   BLOCK_SIZE;
+    uint32_t slots = (end + fs_map_leaf_entries() - 1) /
+                     fs_map_leaf_entries();
+    uint32_t lblk = 0;
+
+    if (defrag_list_add(list, file->index_first_datablk, 0) < 0)
+      goto fail;
+    for (uint32_t slot = 0; slot < slots && slot < MAP_ENTRIES_PER_BLOCK;
+         slot++) {
+      uint32_t leaf = fs_map_leaf(entry, slot);
+      if (leaf != 0 && defrag_list_add(list, leaf, slot) < 0)
+        goto fail;
+    }
+    list->nmeta = list->count;
+
+    while ((lblk = fs_map_next(entry, lblk, end, 1)) < end) {
+      uint32_t block = fs_map_get(entry, lblk) & MAP_BLOCK_MASK;
+      if (defrag_list_add(list, block, lblk) < 0)
+        goto fail;
+      lblk++;
+    }
+    return 0;
+  }
+
+  /* A damaged chain may loop, it cannot be longer than the FAT */
+  uint32_t block = file->index_first_datablk;
+  for (uint32_t i = 0; block != FAT_EOC && block != 0 &&
+       block < superblock.num_data_blks && i < superblock.num_data_blks;
+       i++) {
+    if (defrag_list_add(list, block, i) < 0)
+      goto fail;
+    block = fat[block];
+  }
+  return 0;
+
+fail:
+  defrag_list_free(list);
+  return -1;
+}
+
+uint32_t fs_defrag_runs(uint32_t entry)
+{
+  struct defrag_list list;
+  uint32_t runs;
+
+  if (defrag_list(entry, &list) < 0)
+    return 0;
+  runs = list.count > list.nmeta;
+  for (uint32_t i = list.nmeta + 1; i < list.count; i++)
+    runs += list.clusters[i] != list.clusters[i - 1] + 1;
+  defrag_list_free(&list);
+  return runs;
+}
+
+/*
+ * Move the clusters of file @entry from index @first of its list on, @count of
+ * them, to the free clusters from @target on. Return -1 on error.
+ */
+static int defrag_move(struct defrag_ctx *ctx, uint32_t entry, uint32_t first,
+                       uint32_t count, uint32_t target)
+{
+  struct RootDir *file = &rootdir[entry];
+  struct defrag_list *list = &ctx->lists[entry];
+  size_t cblocks = fs_cluster_size() / BLOCK_SIZE;
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (block_read_range(fs_cluster_block(list->clusters[first + i]),
+                         cblocks,
+                         ctx->buf + (size_t)i * cblocks * BLOCK_SIZE) < 0)
+      return -1;
+    fs_map_forget(target + i);
+  }
+  if (block_write_range(fs_cluster_block(target), count * cblocks,
+                        ctx->buf) < 0)
+    return -1;
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t idx = first + i;
+    uint32_t old = list->clusters[idx];
+    uint32_t new = target + i;
+
+    if (idx < list->nmeta) {
+      /* Map block: the root in the entry, a leaf in the root */
+      if (idx == 0)
+        file->index_first_datablk = new;
+      else if (fs_map_set_leaf(entry, list->lclus[idx], new) < 0)
+        return -1;
+      fat[new] = FAT_EOC;
+      fs_map_forget(old);
+    } else if (file->flags & RDIR_MAPPED) {
+      uint64_t value = fs_map_get(entry, list->lclus[idx]);
+      if (fs_map_set(entry, list->lclus[idx],
+                     (value & ~(uint64_t)MAP_BLOCK_MASK) | new) < 0)
+        return -1;
+      fat[new] = FAT_EOC;
+    } else {
+      fat[new] = fat[old];
+      if (idx == 0)
+        file->index_first_datablk = new;
+      else
+        fat[list->clusters[idx - 1]] = new;
+    }
+    fat[old] = 0;
+    list->clusters[idx] = new;
+    ctx->owner[old] = DIR_NONE;
+    ctx->owner[new] = entry;
+    ctx->owner_idx[new] = idx;
+  }
+  return 0;
+}
+
+/*
+ * Move the cluster in position @pos out of the way, to the highest free
+ * cluster. Return 1 if there is none above @pos, -1 on error.
+ */
+static int defrag_evict(struct defrag_ctx *ctx, uint32_t pos)
+{
+  while (ctx->high > pos && fat[ctx->high] != 0)
+    ctx->high--;
+  if (ctx->high <= pos)
+    return 1;
+  return defrag_move(ctx, ctx->owner[pos], ctx->owner_idx[pos], 1,
+                     ctx->high);
+}
+
+/*
+ * Return the first position from @pos on with @count clusters in a row that
+ * can all be moved, @pos itself if there is none
+ */
+static uint32_t defrag_fit(struct defrag_ctx *ctx, uint32_t pos, uint32_t count)
+{
+  uint32_t n = superblock.num_data_blks;
+  uint32_t start = pos;
+
+  while (count <= n - start) {
+    uint32_t i = 0;
+
+    while (i < count && (fat[start + i] == 0 ||
+                         ctx->owner[start + i] != DIR_NONE))
+      i++;
+    if (i == count)
+      return start;
+    start += i + 1;
+  }
+  return pos;
+}
+
+/* List the movable files and the owner of their clusters */
+static int defrag_scan(struct defrag_ctx *ctx)
+{
+  uint32_t n = superblock.num_data_blks;
+
+  ctx->lists = calloc(rootdir_count, sizeof(*ctx->lists));
+  ctx->owner = malloc(n * sizeof(*ctx->owner));
+  ctx->owner_idx = malloc(n * sizeof(*ctx->owner_idx));
+  if (!ctx->lists || !ctx->owner || !ctx->owner_idx)
+    return -1;
+  for (uint32_t i = 0; i < n; i++)
+    ctx->owner[i] = DIR_NONE;
+  ctx->high = n - 1;
+
+  for (uint32_t entry = 0; entry < rootdir_count; entry++) {
+    const struct RootDir *file = &rootdir[entry];
+    struct defrag_list *list = &ctx->lists[entry];
+
+    if (*file->filename == 0 ||
+        (file->flags & (RDIR_SNAPSHOT | RDIR_DEDUP | RDIR_PACKED)))
+      continue;
+    if (defrag_list(entry, list) < 0)
+      return -1;
+    for (uint32_t i = 0; i < list->count; i++) {
+      ctx->owner[list->clusters[i]] = entry;
+      ctx->owner_idx[list->clusters[i]] = i;
+    }
+  }
+  return 0;
+}
+
+static void defrag_release(struct defrag_ctx *ctx)
+{
+  for (uint32_t entry = 0; ctx->lists && entry < rootdir_count; entry++)
+    defrag_list_free(&ctx->lists[entry]);
+  free(ctx->lists);
+  free(ctx->owner);
+  free(ctx->owner_idx);
+  free(ctx->buf);
+}
+
+int fs_defrag(size_t budget)
+{
+  struct defrag_ctx ctx = { 0 };
+  uint32_t step = DEFRAG_STEP_BLOCKS / (fs_cluster_size() / BLOCK_SIZE);
+  uint32_t n = superblock.num_data_blks;
+  uint32_t entry = 0, idx = 0, pos = 1, placed = DIR_NONE;
+  size_t done = 0;
+  int ret = -1;
+
+  if (!mounted || readonly)
+    return -1;
+
+  /* Blocks change hands: transfers must be done, and all the free space is
+   * wanted */
+  fs_async_drain();
+  fs_reclaim_all();
+
+  if (step == 0)
+    step = 1;
+  ctx.buf = malloc((size_t)step * fs_cluster_size());
+  if (!ctx.buf || defrag_scan(&ctx) < 0)
+    goto out;
+
+  while (entry < rootdir_count && pos < n) {
+    struct defrag_list *list = &ctx.lists[entry];
+    uint32_t want, count = 0;
+
+    /* Skip what is already in place, and what cannot move. A file does not
+     * straddle clusters that cannot move if it fits further. */
+    if (idx == list->count) {
+      entry++;
+      idx = 0;
+      continue;
+    }
+    if (placed != entry) {
+      pos = defrag_fit(&ctx, pos, list->count);
+      placed = entry;
+    }
+    if (list->clusters[idx] == pos) {
+      idx++;
+      pos++;
+      continue;
+    }
+    if (fat[pos] != 0 && ctx.owner[pos] == DIR_NONE) {
+      pos++;
+      continue;
+    }
+
+    if (budget != 0 && done >= budget) {
+      ret = 1;
+      goto out;
+    }
+    want = list->count - idx;
+    if (want > step)
+      want = step;
+    if (budget != 0 && budget - done < want)
+      want = budget - done;
+
+    /* Clear the positions of the next clusters, up to the first one in place
+     * or that cannot move */
+    while (count < want && (budget == 0 || done + count < budget) &&
+           pos + count < n && list->clusters[idx + count] != pos + count) {
+      if (fat[pos + count] != 0) {
+        int evicted;
+
+        if (ctx.owner[pos + count] == DIR_NONE)
+          break;
+        evicted = defrag_evict(&ctx, pos + count);
+        if (evicted < 0)
+          goto out;
+        if (evicted > 0)
+          break;
+        done++;
+      }
+      count++;
+    }
+    /* The disk is full, nothing can move any more */
+    if (count == 0)
+      break;
+
+    if (defrag_move(&ctx, entry, idx, count, pos) < 0)
+      goto out;
+    done += count;
+    idx += count;
+    pos += count;
+  }
+  ret = 0;
+
+out:
+  defrag_release(&ctx);
+  return ret;
+}
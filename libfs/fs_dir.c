@@ -0,0 +1,361 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fs_internal.h"
+
+/*
+ * Root directory. Its first block is at superblock.root_dir_blk_index as in
+ * the original format, the following ones form a chain of data blocks
+ * starting at superblock.dir_blk_ext. The whole directory is kept in memory,
+ * with a hash index of the names and a stack of the free entries, so that
+ * lookups, creations and deletions do not depend on its size. The blocks
+ * at its end whose entries are all free are given back whenever it is stored.
+ */
+
+struct RootDir *rootdir;
+uint32_t rootdir_count;
+uint32_t *rootdir_opens;
+
+/* FAT index of each block of the directory past the first one */
+static uint32_t *dir_blocks;
+/* Open addressing hash table of the used entries, DIR_NONE when empty */
+static uint32_t *dir_index;
+static uint32_t dir_index_size;
+/* Stack of the free entries */
+static uint32_t *dir_free;
+static uint32_t dir_nfree;
+
+static inline uint32_t dir_hash(const uint8_t key[FS_FILENAME_LEN])
+{
+  uint64_t lo, hi;
+
+  memcpy(&lo, key, sizeof(lo));
+  memcpy(&hi, key + sizeof(lo), sizeof(hi));
+  lo = (lo ^ (hi * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+  return lo ^ lo >> 32;
+}
+
+static void dir_index_insert(uint32_t entry)
+{
+  uint32_t mask = dir_index_size - 1;
+  uint32_t slot = dir_hash(rootdir[entry].filename) & mask;
+
+  while (dir_index[slot] != DIR_NONE)
+    slot = (slot + 1) & mask;
+  dir_index[slot] = entry;
+}
+
+static void dir_index_remove(uint32_t entry)
+{
+  uint32_t mask = dir_index_size - 1;
+  uint32_t slot = dir_hash(rootdir[entry].filename) & mask;
+
+  while (dir_index[slot] != entry)
+    slot = (slot + 1) & mask;
+
+  /* Move back the entries of the probe sequence that follows, so that none
+   * of them becomes unreachable */
+  for (uint32_t next = (slot + 1) & mask; dir_index[next] != DIR_NONE;
+       next = (next + 1) & mask) {
+    uint32_t home = dir_hash(rootdir[dir_index[next]].filename) & mask;
+
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      dir_index[slot] = dir_index[next];
+      slot = next;
+    }
+  }
+  dir_index[slot] = DIR_NONE;
+}
+
+/* Size the hash table for the current directory and fill it */
+static int dir_index_build(void)
+{
+  uint32_t size = 2 * DIR_ENTRIES_PER_BLOCK;
+  uint32_t *index;
+
+  while (size < 2 * rootdir_count)
+    size *= 2;
+  index = malloc(size * sizeof(*index));
+  if (!index)
+    return -1;
+
+  free(dir_index);
+  dir_index = index;
+  dir_index_size = size;
+  memset(dir_index, 0xff, size * sizeof(*dir_index));
+  for (uint32_t i = 0; i < rootdir_count; i++) {
+    if (*rootdir[i].filename != 0)
+      dir_index_insert(i);
+  }
+  return 0;
+}
+
+/* Resize the in-memory directory to @nblocks blocks */
+static int dir_resize(uint32_t nblocks)
+{
+  uint32_t count = nblocks * DIR_ENTRIES_PER_BLOCK;
+  struct RootDir *entries = realloc(rootdir, count * sizeof(*entries));
+  uint32_t *blocks;
+  uint32_t *stack, *opens;
+
+  if (!entries)
+    return -1;
+  rootdir = entries;
+  opens = realloc(rootdir_opens, count * sizeof(*opens));
+  if (!opens)
+    return -1;
+  rootdir_opens = opens;
+  blocks = realloc(dir_blocks, nblocks * sizeof(*blocks));
+  if (!blocks)
+    return -1;
+  dir_blocks = blocks;
+  stack = realloc(dir_free, count * sizeof(*stack));
+  if (!stack)
+    return -1;
+  dir_free = stack;
+
+  if (count > rootdir_count) {
+    memset(rootdir + rootdir_count, 0,
+           (count - rootdir_count) * sizeof(*rootdir));
+    memset(rootdir_opens + rootdir_count, 0,
+           (count - rootdir_count) * sizeof(*rootdir_opens));
+  }
+  rootdir_count = count;
+  return 0;
+}
+
+int fs_dir_read(size_t block, struct RootDir entries[DIR_ENTRIES_PER_BLOCK])
+{
+  struct RootDirV1 raw[DIR_ENTRIES_PER_BLOCK];
+
+  if (superblock.version != 1)
+    return block_read(block, entries);
+
+  if (block_read(block, raw) < 0)
+    return -1;
+  for (uint32_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+    memset(&entries[i], 0, sizeof(entries[i]));
+    memcpy(entries[i].filename, raw[i].filename, FS_FILENAME_LEN);
+    entries[i].size_of_file = raw[i].size_of_file;
+    entries[i].index_first_datablk = raw[i].index_first_datablk == FAT_EOC_V1
+                                     ? FAT_EOC : raw[i].index_first_datablk;
+    entries[i].flags = raw[i].flags;
+    entries[i].pack_offset = raw[i].pack_offset;
+  }
+  return 0;
+}
+
+int fs_dir_write(size_t block,
+                 const struct RootDir entries[DIR_ENTRIES_PER_BLOCK])
+{
+  struct RootDirV1 raw[DIR_ENTRIES_PER_BLOCK];
+
+  if (superblock.version != 1)
+    return block_write(block, entries);
+
+  memset(raw, 0, sizeof(raw));
+  for (uint32_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+    memcpy(raw[i].filename, entries[i].filename, FS_FILENAME_LEN);
+    raw[i].size_of_file = entries[i].size_of_file;
+    raw[i].index_first_datablk = entries[i].index_first_datablk == FAT_EOC
+                                 ? FAT_EOC_V1 : entries[i].index_first_datablk;
+    raw[i].flags = entries[i].flags;
+    raw[i].pack_offset = entries[i].pack_offset;
+  }
+  return block_write(block, raw);
+}
+
+int fs_dir_load(void)
+{
+  uint32_t block = superblock.dir_blk_ext;
+  uint8_t *seen;
+  uint32_t nblocks = 1;
+
+  fs_dir_unload();
+  seen = calloc(superblock.num_data_blks, 1);
+  if (!seen || dir_resize(1) < 0)
+    goto fail;
+  if (fs_dir_read(superblock.root_dir_blk_index, rootdir) < 0)
+    goto fail;
+
+  /* A broken chain ends the directory, fs_check() terminates it there */
+  while (block != 0 && block < superblock.num_data_blks && !seen[block]) {
+    seen[block] = 1;
+    if (dir_resize(nblocks + 1) < 0 ||
+        fs_dir_read(fs_cluster_block(block),
+                    rootdir + nblocks * DIR_ENTRIES_PER_BLOCK) < 0)
+      goto fail;
+    dir_blocks[nblocks++] = block;
+    block = fat[block];
+  }
+  free(seen);
+  seen = NULL;
+
+  dir_nfree = 0;
+  for (uint32_t i = rootdir_count; i-- > 0;) {
+    /* Clear whatever follows the end of the filenames, so that they can be
+     * compared as fixed-width 16-byte keys */
+    size_t len = strnlen((char *)rootdir[i].filename, FS_FILENAME_LEN);
+    memset(rootdir[i].filename + len, 0, FS_FILENAME_LEN - len);
+    if (len == 0)
+      dir_free[dir_nfree++] = i;
+  }
+  if (dir_index_build() < 0)
+    goto fail;
+  return 0;
+
+fail:
+  free(seen);
+  fs_dir_unload();
+  return -1;
+}
+
+/* Whether the entries of block @i of the directory are all free */
+static int dir_block_unused(uint32_t i)
+{
+  for (uint32_t j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
+    if (*rootdir[i * DIR_ENTRIES_PER_BLOCK + j].filename != 0)
+      return 0;
+  }
+  return 1;
+}
+
+void fs_dir_shrink(void)
+{
+  uint32_t nblocks = rootdir_count / DIR_ENTRIES_PER_BLOCK;
+  uint32_t kept = nblocks;
+  uint32_t n = 0;
+
+  while (kept > 1 && dir_block_unused(kept - 1))
+    kept--;
+  if (kept == nblocks)
+    return;
+
+  for (uint32_t i = kept; i < nblocks; i++)
+    fat[dir_blocks[i]] = 0;
+  if (kept == 1)
+    superblock.dir_blk_ext = 0;
+  else
+    fat[dir_blocks[kept - 1]] = FAT_EOC;
+
+  /* The free entries of the blocks given back go away, in the same order */
+  for (uint32_t i = 0; i < dir_nfree; i++) {
+    if (dir_free[i] < kept * DIR_ENTRIES_PER_BLOCK)
+      dir_free[n++] = dir_free[i];
+  }
+  dir_nfree = n;
+  /* Arrays that could not be shrunk are only larger than needed */
+  if (dir_resize(kept) < 0)
+    rootdir_count = kept * DIR_ENTRIES_PER_BLOCK;
+}
+
+int fs_dir_store(void)
+{
+  if (fs_dir_write(superblock.root_dir_blk_index, rootdir) < 0)
+    return -1;
+  for (uint32_t i = 1; i < rootdir_count / DIR_ENTRIES_PER_BLOCK; i++) {
+    if (fs_dir_write(fs_cluster_block(dir_blocks[i]),
+                     rootdir + i * DIR_ENTRIES_PER_BLOCK) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+void fs_dir_unload(void)
+{
+  free(rootdir);
+  free(rootdir_opens);
+  free(dir_blocks);
+  free(dir_index);
+  free(dir_free);
+  rootdir = NULL;
+  rootdir_opens = NULL;
+  dir_blocks = NULL;
+  dir_index = NULL;
+  dir_free = NULL;
+  rootdir_count = 0;
+  dir_index_size = 0;
+  dir_nfree = 0;
+}
+
+uint32_t fs_dir_lookup(const uint8_t key[FS_FILENAME_LEN])
+{
+  uint32_t mask = dir_index_size - 1;
+
+  for (uint32_t slot = dir_hash(key) & mask; dir_index[slot] != DIR_NONE;
+       slot = (slot + 1) & mask) {
+    if (memcmp(rootdir[dir_index[slot]].filename, key, FS_FILENAME_LEN) == 0)
+      return dir_index[slot];
+  }
+  return DIR_NONE;
+}
+
+uint32_t fs_dir_nfree(void)
+{
+  return dir_nfree;
+}
+
+/* Append a block to the directory, its entries becoming free */
+static int dir_grow(void)
+{
+  uint32_t nblocks = rootdir_count / DIR_ENTRIES_PER_BLOCK;
+  uint32_t block = fs_findfirstblock();
+
+  if (block == FAT_EOC)
+    return -1;
+  if (dir_resize(nblocks + 1) < 0) {
+    fat[block] = 0;
+    return -1;
+  }
+
+  if (nblocks == 1)
+    superblock.dir_blk_ext = block;
+  else
+    fat[dir_blocks[nblocks - 1]] = block;
+  dir_blocks[nblocks] = block;
+
+  for (uint32_t i = rootdir_count; i-- > nblocks * DIR_ENTRIES_PER_BLOCK;)
+    dir_free[dir_nfree++] = i;
+  /* Keep the hash table at most half full */
+  if (2 * rootdir_count > dir_index_size)
+    return dir_index_build();
+  return 0;
+}
+
+int fs_dir_reserve(uint32_t n)
+{
+  while (dir_nfree < n) {
+    if (dir_grow() < 0)
+      return -1;
+  }
+  return 0;
+}
+
+uint32_t fs_dir_alloc(const uint8_t key[FS_FILENAME_LEN])
+{
+  uint32_t entry;
+
+  if (fs_dir_reserve(1) < 0)
+    return DIR_NONE;
+
+  entry = dir_free[--dir_nfree];
+  memset(&rootdir[entry], 0, sizeof(rootdir[entry]));
+  memcpy(rootdir[entry].filename, key, FS_FILENAME_LEN);
+  dir_index_insert(entry);
+  return entry;
+}
+
+void fs_dir_free(uint32_t entry)
+{
+  dir_index_remove(entry);
+  memset(&rootdir[entry], 0, sizeof(rootdir[entry]));
+  dir_free[dir_nfree++] = entry;
+}
+
+uint32_t fs_dir_ext_blocks(const uint32_t **blocks)
+{
+  *blocks = dir_blocks + 1;
+  return rootdir_count / DIR_ENTRIES_PER_BLOCK - 1;
+}
@@ -0,0 +1,202 @@
+#ifndef _FS_FORMAT_H
+#define _FS_FORMAT_H
+
+#include <stdint.h>
+
+#include "disk.h"
+#include "fs.h"
+
+/*
+ * On-disk layout of ECS150-FS, shared between the library and the tools in
+ * progs/ that create or inspect images directly.
+ *
+ * Two versions of the format exist. Version 1 is the original one, with
+ * 16-bit block indices. Version 2 has the same layout with 32-bit block
+ * indices, in the superblock, the FAT, the root directory entries and the
+ * leaf map blocks. In memory, the library always uses the version 2 structures
+ * and converts those of version 1 images when reading and writing them.
+ *
+ * Version 2 can also group the data blocks into clusters of 2^cluster_shift
+ * blocks, each FAT entry then describing a whole cluster, so that large files
+ * need fewer FAT entries and are transferred in larger I/Os. The root
+ * directory extension, block maps, packed blocks and snapshots only use the
+ * first block of their cluster; clustered volumes are meant for large plain
+ * files, and do not support the per-block features (see fs_set_compression(),
+ * fs_set_dedup(), fs_clone() and fs_snapshot()).
+ */
+
+#define UNUSED_SUPERBLOCK 4077
+#define UNUSED_SUPERBLOCK_V2 4048
+#define UNUSED_ROOTDIR 5
+#define UNUSED_ROOTDIR_V1 7
+#define SIGNATURE "ECS150FS"
+#define SIGNATURE_V2 "ECS150F2"
+#define SIGNATURELENGTH 8
+#define FAT_EOC 0xffffffff
+#define FAT_EOC_V1 0xffff
+
+/** Number of 16-bit FAT entries held by one FAT block of version 1 */
+#define FAT_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(uint16_t))
+/** Number of 32-bit FAT entries held by one FAT block of version 2 */
+#define FAT_ENTRIES_PER_BLOCK_V2 (BLOCK_SIZE / sizeof(uint32_t))
+
+/**
+ * Largest data block count version 1 can address: the total block count is
+ * stored on 16 bits, and FAT_EOC_V1 cannot be a valid data block index.
+ */
+#define FS_MAX_DATA_BLOCKS 65501
+
+/** Largest data block count of version 2 (1 TiB of data) */
+#define FS_MAX_DATA_BLOCKS_V2 0x0fffffff
+
+/** Largest cluster_shift, for clusters of 64 KiB */
+#define FS_MAX_CLUSTER_SHIFT 4
+
+/*
+ * Version 2 images can also hold a CRC32C checksum of every block from the
+ * root directory to the end of the disk, verified when reading a block and
+ * updated when writing it. The checksums are stored in the blocks between the
+ * FAT and the root directory, xored with the CRC32C of a block of zeros so
+ * that blocks of zeros have a zero checksum, and that the region of a new
+ * image can be left as a hole. A checksum block is written right after the
+ * blocks whose checksums it holds, so that a crash leaves at most the blocks
+ * being written without a matching checksum; fs_check() reports these and
+ * recomputes their checksum when repairing.
+ */
+
+/** Number of checksums held by one checksum block */
+#define CSUM_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+
+/* Data structure for superblock, as stored by version 1 */
+struct __attribute__((packed)) SuperblockV1 {
+  uint8_t signature[SIGNATURELENGTH];
+  uint16_t total_blocks;
+  uint16_t root_dir_blk_index;
+  uint16_t data_blk_start_index;
+  uint16_t num_data_blks;
+  uint8_t num_blk_FAT;
+  /* FAT index of the chain of blocks extending the root directory, 0 if none */
+  uint16_t dir_blk_ext;
+  uint8_t unused[UNUSED_SUPERBLOCK];
+};
+
+/* Data structure for superblock, as stored by version 2 */
+struct __attribute__((packed)) Superblock {
+  uint8_t signature[SIGNATURELENGTH];
+  uint32_t total_blocks;
+  uint32_t root_dir_blk_index;
+  uint32_t data_blk_start_index;
+  uint32_t num_data_blks;
+  uint32_t num_blk_FAT;
+  uint32_t dir_blk_ext;
+  /* Format version, 2 (set to 1 in memory for version 1 images) */
+  uint8_t version;
+  /* Blocks per cluster, as a power of two (0 for version 1 images) */
+  uint8_t cluster_shift;
+  /* First block of the checksum region, 0 if the blocks have no checksum */
+  uint32_t csum_blk_index;
+  uint32_t num_blk_csum;
+  /* Stripe unit in blocks and number of files of a striped image (see
+   * fs_mount_striped()), 0 if made of a single file */
+  uint32_t stripe_blocks;
+  uint8_t stripe_count;
+  /* Non-zero if small files are packed into shared blocks (fs_make -P) */
+  uint8_t pack;
+  uint8_t unused[UNUSED_SUPERBLOCK_V2];
+};
+
+/* Data structure for rootdir, as stored by version 1 */
+struct __attribute__((packed)) RootDirV1 {
+  uint8_t filename[FS_FILENAME_LEN];
+  uint32_t size_of_file;
+  uint16_t index_first_datablk;
+  uint8_t flags;
+  uint16_t pack_offset;
+  uint8_t unused[UNUSED_ROOTDIR_V1];
+};
+
+/* Data structure for rootdir, as stored by version 2 */
+struct __attribute__((packed)) RootDir {
+  uint8_t filename[FS_FILENAME_LEN];
+  uint32_t size_of_file;
+  uint32_t index_first_datablk;
+  uint8_t flags;
+  uint16_t pack_offset;
+  uint8_t unused[UNUSED_ROOTDIR];
+};
+
+/** Number of entries held by one root directory block */
+#define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(struct RootDir))
+
+/*
+ * Root directory entry flags, stored in the first padding byte of the entry
+ * (always zero on images made by other tools).
+ */
+
+/*
+ * The file is described by a block map instead of a plain chain: the index of
+ * the first data block is the root map block, holding the 32-bit FAT index of
+ * up to MAP_ENTRIES_PER_BLOCK leaf map blocks, which in turn hold the entries
+ * of consecutive logical blocks: MAP_ENTRIES_PER_BLOCK 32-bit entries in
+ * version 1, made of a 16-bit FAT index and 16 extra bits above it, and half
+ * as many 64-bit entries in version 2, made of a 32-bit FAT index and 32 extra
+ * bits. A zero entry is a hole, at either level. Map blocks and the data
+ * blocks they reference are all single-block chains.
+ */
+#define RDIR_MAPPED 0x01
+
+/** Number of entries held by one root map block */
+#define MAP_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+
+/** Block index and extra parts of a leaf map entry, as used in memory */
+#define MAP_BLOCK_MASK 0xffffffffull
+#define MAP_EXTRA_SHIFT 32
+
+/*
+ * The file is a mapped file whose data is compressed by chunks of
+ * COMPRESS_CHUNK_BLOCKS logical blocks. A chunk is either stored as is, each
+ * map entry of the chunk then pointing to the data of its own logical block,
+ * or as an LZ stream (see fs_lz.h) spanning the blocks referenced by the first
+ * map entries of the chunk, the others being 0. The length of the stream is
+ * stored in the extra bits of the first entry of the chunk.
+ */
+#define RDIR_COMPRESSED 0x02
+
+#define COMPRESS_CHUNK_BLOCKS 8
+#define COMPRESS_CHUNK_SIZE (COMPRESS_CHUNK_BLOCKS * BLOCK_SIZE)
+
+#define MAP_CLEN_SHIFT MAP_EXTRA_SHIFT
+
+/*
+ * The file is a mapped file whose data blocks can be shared with the other
+ * deduplicated files, several map entries then referencing the same block.
+ * The extra bits of each map entry hold a 16-bit tag of the fingerprint of
+ * the content of its block, 0 if it is unknown (cloned blocks).
+ */
+#define RDIR_DEDUP 0x04
+
+#define MAP_TAG_SHIFT MAP_EXTRA_SHIFT
+
+/*
+ * The entry is a snapshot of the file system rather than a file. Its data, a
+ * plain chain of one block per root directory block, holds a copy of the root
+ * directory at the time it was taken, in which each file is a deduplicated
+ * file with its own copy of the block map, sharing the data blocks of the live
+ * files.
+ */
+#define RDIR_SNAPSHOT 0x08
+
+/*
+ * The file is small enough to share its data block with other small files:
+ * its content is stored at byte pack_offset of the block, which is a
+ * single-block chain. Unused parts of a packed block are not recorded, they
+ * lie between the data of the packed files that reference it. Only version 2
+ * images whose superblock enables packing have packed files: readers of
+ * version 1 would take the shared block for the file's own.
+ */
+#define RDIR_PACKED 0x10
+
+/** Size above which a packed file moves to a block of its own */
+#define PACK_MAX_SIZE (BLOCK_SIZE / 4)
+
+#endif /* _FS_FORMAT_H */
@@ -0,0 +1,380 @@
+#ifndef _FS_INTERNAL_H
+#define _FS_INTERNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fs_format.h"
+
+/*
+ * In-memory state of the mounted file system, shared between the modules of
+ * the library. Not part of the public API.
+ */
+
+extern struct Superblock superblock;
+extern uint32_t *fat;
+extern struct RootDir *rootdir;
+extern uint32_t rootdir_count;
+/* Number of file descriptors open on each root directory entry */
+extern uint32_t *rootdir_opens;
+extern int mounted;
+/* Mounted with fs_mount_readonly(), nothing may be changed */
+extern int readonly;
+
+/* No root directory entry */
+#define DIR_NONE UINT32_MAX
+
+/* A block full of zeros */
+extern const uint8_t zero_block[BLOCK_SIZE];
+
+/* Number of FAT entries held by one FAT block of the mounted disk */
+static inline uint32_t fs_fat_entries_per_block(void)
+{
+  return superblock.version == 1 ? FAT_ENTRIES_PER_BLOCK
+                                 : FAT_ENTRIES_PER_BLOCK_V2;
+}
+
+/* Size in bytes of a cluster, the unit of allocation of plain files */
+static inline uint32_t fs_cluster_size(void)
+{
+  return BLOCK_SIZE << superblock.cluster_shift;
+}
+
+/* Disk block where the cluster at FAT index @index starts */
+static inline size_t fs_cluster_block(uint32_t index)
+{
+  return superblock.data_blk_start_index +
+         ((size_t)index << superblock.cluster_shift);
+}
+
+/* Number of entries held by one leaf map block of the mounted disk */
+static inline uint32_t fs_map_leaf_entries(void)
+{
+  return superblock.version == 1 ? MAP_ENTRIES_PER_BLOCK
+                                 : MAP_ENTRIES_PER_BLOCK / 2;
+}
+
+/*
+ * Allocate the first free data block (first-fit) and mark it as the end of a
+ * chain. Return its FAT index, or FAT_EOC if the disk is full.
+ */
+uint32_t fs_findfirstblock(void);
+
+/* Free every block of the chain starting at FAT index @block */
+void fs_free_chain(uint32_t block);
+
+/* Return the root directory index of @filename, DIR_NONE if none */
+uint32_t fs_lookup(const char *filename);
+
+/* Return whether root directory entry @entry is open by a file descriptor */
+int fs_entry_open(uint32_t entry);
+
+/* Return the root directory entry of open descriptor @fd, DIR_NONE if none */
+uint32_t fs_fd_entry(int fd);
+
+/*
+ * Transfer of whole blocks of file data, which the asynchronous engine queues
+ * instead of doing it right away
+ */
+struct fs_io {
+  /* Transfer @count blocks at disk block @block to @buf, or from @buf if
+   * @write */
+  int (*transfer)(void *ctx, int write, size_t block, size_t count, void *buf);
+  void *ctx;
+};
+
+/*
+ * Read or write @count bytes at @offset of file @entry, as fs_read() and
+ * fs_write() do at the offset of a descriptor. Transfers of whole blocks of
+ * plain and mapped files go through @io when it is given; everything else,
+ * metadata and partial blocks included, is done right away.
+ */
+int fs_read_at(uint32_t entry, uint32_t offset, uint8_t *buf, size_t count,
+               const struct fs_io *io);
+int fs_write_at(uint32_t entry, uint32_t offset, const uint8_t *buf,
+                size_t count, const struct fs_io *io);
+
+/*
+ * Root directory (fs_dir.c)
+ */
+
+/* Read the root directory of the mounted disk, and index it */
+int fs_dir_load(void);
+int fs_dir_store(void);
+void fs_dir_unload(void);
+
+/*
+ * Give the blocks at the end of the directory whose entries are all free back,
+ * before the FAT and the superblock are stored
+ */
+void fs_dir_shrink(void);
+
+/* Return the entry named @key (zero-padded), DIR_NONE if there is none */
+uint32_t fs_dir_lookup(const uint8_t key[FS_FILENAME_LEN]);
+
+/*
+ * Take a free entry for name @key, growing the directory by one block if there
+ * is none. Return DIR_NONE if the disk is full.
+ */
+uint32_t fs_dir_alloc(const uint8_t key[FS_FILENAME_LEN]);
+
+/* Clear entry @entry, which becomes free */
+void fs_dir_free(uint32_t entry);
+
+/* Grow the directory until at least @n entries are free */
+int fs_dir_reserve(uint32_t n);
+
+/* Return the number of free entries */
+uint32_t fs_dir_nfree(void);
+
+/*
+ * Point @blocks to the FAT indices of the blocks of the directory past the
+ * first one, and return how many there are
+ */
+uint32_t fs_dir_ext_blocks(const uint32_t **blocks);
+
+/*
+ * Read or write disk block @block as a block of directory entries, converting
+ * them between the on-disk layout of version 1 and the in-memory one
+ */
+int fs_dir_read(size_t block, struct RootDir entries[DIR_ENTRIES_PER_BLOCK]);
+int fs_dir_write(size_t block,
+                 const struct RootDir entries[DIR_ENTRIES_PER_BLOCK]);
+
+/*
+ * Block maps of mapped files (fs_map.c)
+ */
+
+/*
+ * Read the entries of leaf map block @block into @entries, or write them, in
+ * the in-memory form of the entries (see MAP_BLOCK_MASK). There are
+ * fs_map_leaf_entries() of them.
+ */
+int fs_map_read_leaf(uint32_t block, uint64_t entries[MAP_ENTRIES_PER_BLOCK]);
+int fs_map_write_leaf(uint32_t block,
+                      const uint64_t entries[MAP_ENTRIES_PER_BLOCK]);
+
+/* Return the map entry at logical block @lblk of @entry, 0 if none */
+uint64_t fs_map_get(uint32_t entry, uint32_t lblk);
+
+/* Set the map entry at logical block @lblk of @entry to @value (0: hole) */
+int fs_map_set(uint32_t entry, uint32_t lblk, uint64_t value);
+
+/*
+ * Copy the @n map entries of @entry starting at logical block @lblk into
+ * @values, or store @values there. The range cannot span two leaf map blocks.
+ */
+void fs_map_get_range(uint32_t entry, uint32_t lblk, uint64_t *values,
+                      uint32_t n);
+int fs_map_set_range(uint32_t entry, uint32_t lblk, const uint64_t *values,
+                     uint32_t n);
+
+/* Return the leaf map block at @slot of the root of @entry, 0 if none */
+uint32_t fs_map_leaf(uint32_t entry, uint32_t slot);
+
+/*
+ * Make @slot of the root of @entry point to leaf map block @leaf, which must
+ * hold a copy of the former leaf
+ */
+int fs_map_set_leaf(uint32_t entry, uint32_t slot, uint32_t leaf);
+
+/*
+ * Return the first logical block of @entry in [@lblk, @end) that holds data
+ * (@data set) or that is a hole (@data clear), @end if there is none
+ */
+uint32_t fs_map_next(uint32_t entry, uint32_t lblk, uint32_t end, int data);
+
+/*
+ * Turn the plain chain of @entry into a block map, so that holes can be
+ * represented. The data blocks are unlinked from each other, each of them
+ * becoming a single-block chain referenced by the map.
+ */
+int fs_make_mapped(uint32_t entry);
+
+/*
+ * Copy the block map whose root is at FAT index @rootblk, the copy mapping the
+ * same data blocks. Return the root of the copy, or FAT_EOC on failure.
+ */
+uint32_t fs_map_clone(uint32_t rootblk);
+
+/* Free the data blocks and the block map of mapped file @file */
+void fs_free_mapped(const struct RootDir *file);
+
+/*
+ * Free the data blocks of mapped file @entry from logical block @lblk on, and
+ * the leaf map blocks left empty. The map is updated before the blocks are
+ * freed.
+ */
+int fs_map_truncate(uint32_t entry, uint32_t lblk);
+
+/* Drop cached copies of @block, which is being reallocated */
+void fs_map_forget(uint32_t block);
+
+/* Drop every cached map block */
+void fs_map_reset(void);
+
+/*
+ * Compressed files (fs_compress.c)
+ */
+
+/*
+ * Read @count bytes at @offset of compressed file @entry, which must all lie
+ * before the end of the file. Return -1 if nothing could be read, the number
+ * of bytes read otherwise.
+ */
+int fs_compress_read(uint32_t entry, uint32_t offset, uint8_t *buf,
+                     uint32_t count);
+
+/*
+ * Write @count bytes at @offset of compressed file @entry, recompressing each
+ * chunk touched. The file size is not updated. Return the number of bytes
+ * written.
+ */
+int fs_compress_write(uint32_t entry, uint32_t offset, const uint8_t *buf,
+                      uint32_t count);
+
+/*
+ * Count the blocks of data of mapped file @entry, holes excluded, and the
+ * blocks actually used on the disk to store them
+ */
+void fs_compress_usage(uint32_t entry, size_t *data, size_t *stored);
+
+/* Drop the cached chunk of @entry, which is being deleted */
+void fs_compress_forget(uint32_t entry);
+
+/* Drop the cached chunk */
+void fs_compress_reset(void);
+
+/*
+ * Cut compressed file @entry down to @size bytes within its last chunk: the
+ * chunk holding byte @size is rewritten without the bytes that follow it. The
+ * chunks after it are left to fs_map_truncate().
+ */
+int fs_compress_truncate(uint32_t entry, uint32_t size);
+
+/*
+ * Deduplicated files (fs_dedup.c)
+ */
+
+/*
+ * Build the reference counts and the fingerprint index of the blocks shared
+ * by deduplicated files, from their block maps
+ */
+int fs_dedup_load(void);
+void fs_dedup_unload(void);
+
+/*
+ * Write @count bytes at @offset of deduplicated file @entry, sharing the
+ * blocks whose content already exists. The file size is not updated. Return
+ * the number of bytes written.
+ */
+int fs_dedup_write(uint32_t entry, uint32_t offset, const uint8_t *buf,
+                   uint32_t count);
+
+/*
+ * Map the @count logical blocks of deduplicated file @dst from @dst_lblk on to
+ * the blocks of those of deduplicated file @src from @src_lblk on, sharing
+ * them (holes included). Fewer blocks are shared when either range reaches the
+ * end of a leaf map block, or a block that cannot take one more reference.
+ * Return the number of blocks shared, or -1 if the map of @dst cannot be
+ * updated.
+ */
+int fs_dedup_share(uint32_t dst, uint32_t dst_lblk, uint32_t src,
+                   uint32_t src_lblk, uint32_t count);
+
+/* Take a reference to every block mapped by deduplicated file @file */
+void fs_dedup_ref(const struct RootDir *file);
+
+/* Drop a reference to shared @block, freeing it with the last one */
+void fs_dedup_put(uint32_t block);
+
+/*
+ * Packed files (fs_pack.c)
+ */
+
+/* List the packed files of each packed block, after fs_dir_load() */
+int fs_pack_load(void);
+void fs_pack_unload(void);
+
+/*
+ * Read @count bytes at @offset of packed file @entry, which must all lie
+ * before the end of the file. Return -1 if they cannot be read, @count
+ * otherwise.
+ */
+int fs_pack_read(uint32_t entry, uint32_t offset, uint8_t *buf,
+                 uint32_t count);
+
+/*
+ * Write @count bytes at @offset of empty plain file or packed file @entry,
+ * which must not end up larger than PACK_MAX_SIZE. The data of the file is
+ * moved to another packed block if it no longer fits in its own. The file size
+ * is not updated. Return @count, or 0 if the disk is full.
+ */
+int fs_pack_write(uint32_t entry, uint32_t offset, const uint8_t *buf,
+                  uint32_t count);
+
+/* Move the data of packed file @entry to a block of its own (a plain file) */
+int fs_unpack(uint32_t entry);
+
+/* Free the data of packed file @entry, and its block if no file remains */
+void fs_pack_free(uint32_t entry);
+
+/*
+ * Asynchronous requests (fs_async.c)
+ */
+
+/* Return whether asynchronous requests are outstanding */
+int fs_async_busy(void);
+
+/*
+ * Wait until the queued block transfers are done, before blocks can change
+ * hands (shared by clones and snapshots, converted, freed by repairs)
+ */
+void fs_async_drain(void);
+
+/* Stop the worker threads, once no request is outstanding */
+void fs_async_stop(void);
+
+/*
+ * Deferred reclamation (fs_reclaim.c)
+ */
+
+/* Free the chain starting at @block, or queue it if reclamation is deferred */
+void fs_reclaim_chain(uint32_t block);
+
+/*
+ * Free the block map and data blocks of mapped file @file, which is being
+ * deleted, or queue a copy of its entry if reclamation is deferred
+ */
+void fs_reclaim_mapped(const struct RootDir *file);
+
+/* Reclaim every queued block. Return whether any was queued. */
+int fs_reclaim_all(void);
+
+/* Drop the queue, when unmounting */
+void fs_reclaim_reset(void);
+
+/*
+ * Defragmentation (fs_defrag.c)
+ */
+
+/*
+ * Return the number of runs of consecutive clusters holding the data of file
+ * @entry, in logical order
+ */
+uint32_t fs_defrag_runs(uint32_t entry);
+
+/*
+ * Snapshots (fs_snapshot.c)
+ */
+
+/*
+ * Read the root directory saved in snapshot @snap. Return an allocated array
+ * of @count entries, or NULL if it cannot be read.
+ */
+struct RootDir *fs_snapshot_load(const struct RootDir *snap, uint32_t *count);
+
+/* Free snapshot @snap, dropping the references of the files it holds */
+void fs_snapshot_free(const struct RootDir *snap);
+
+#endif /* _FS_INTERNAL_H */
@@ -0,0 +1,242 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fs_lz.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+/* After this many misses in a row, the match search starts skipping bytes */
+#define LZ_SKIP_TRIGGER 6
+
+static inline uint32_t lz_load32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t lz_load64(const uint8_t *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/* Copy @len bytes 8 at a time, writing up to 7 bytes past @dst + @len */
+static inline void lz_wildcopy(uint8_t *dst, const uint8_t *src, size_t len)
+{
+  uint8_t *end = dst + len;
+
+  do {
+    memcpy(dst, src, 8);
+    dst += 8;
+    src += 8;
+  } while (dst < end);
+}
+
+/* Length of the common prefix of @a and @b, at most @max bytes */
+static inline size_t lz_common(const uint8_t *a, const uint8_t *b, size_t max)
+{
+  size_t len = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (len + 8 <= max) {
+    uint64_t diff = lz_load64(a + len) ^ lz_load64(b + len);
+    if (diff)
+      return len + (__builtin_ctzll(diff) >> 3);
+    len += 8;
+  }
+#endif
+  while (len < max && a[len] == b[len])
+    len++;
+  return len;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Append length @len past the 15 stored in the token, return the new @op */
+static size_t lz_put_length(uint8_t *dst, size_t op, size_t cap, size_t len)
+{
+  for (; len >= 255; len -= 255) {
+    if (op == cap)
+      return cap + 1;
+    dst[op++] = 255;
+  }
+  if (op == cap)
+    return cap + 1;
+  dst[op++] = len;
+  return op;
+}
+
+/*
+ * Emit a token with @nlit literals at @lit followed by a match of @mlen bytes
+ * at distance @offset (no match if @mlen is 0). Return the new output length,
+ * larger than @cap if it does not fit.
+ */
+static size_t lz_put_sequence(uint8_t *dst, size_t op, size_t cap,
+                              const uint8_t *lit, size_t nlit,
+                              size_t offset, size_t mlen)
+{
+  size_t mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+  uint8_t token = (nlit < 15 ? nlit : 15) << 4 | (mcode < 15 ? mcode : 15);
+
+  if (op == cap)
+    return cap + 1;
+  dst[op++] = token;
+
+  if (nlit >= 15 && (op = lz_put_length(dst, op, cap, nlit - 15)) > cap)
+    return op;
+  if (nlit > cap - op)
+    return cap + 1;
+  memcpy(dst + op, lit, nlit);
+  op += nlit;
+
+  if (!mlen)
+    return op;
+
+  if (cap - op < 2)
+    return cap + 1;
+  dst[op++] = offset & 0xff;
+  dst[op++] = offset >> 8;
+  if (mcode >= 15)
+    op = lz_put_length(dst, op, cap, mcode - 15);
+  return op;
+}
+
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+  uint32_t table[1 << LZ_HASH_BITS];
+  size_t ip = 0, anchor = 0, op = 0;
+  unsigned int misses = 0;
+
+  memset(table, 0xff, sizeof(table));
+
+  while (n >= LZ_MIN_MATCH && ip <= n - LZ_MIN_MATCH) {
+    uint32_t seq = lz_load32(src + ip);
+    uint32_t h = lz_hash(seq);
+    size_t ref = table[h];
+
+    table[h] = ip;
+    if (ref == UINT32_MAX || ip - ref > LZ_MAX_OFFSET ||
+        lz_load32(src + ref) != seq) {
+      /* Incompressible data is crossed faster and faster */
+      ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+      continue;
+    }
+
+    size_t mlen = LZ_MIN_MATCH + lz_common(src + ref + LZ_MIN_MATCH,
+                                           src + ip + LZ_MIN_MATCH,
+                                           n - ip - LZ_MIN_MATCH);
+
+    op = lz_put_sequence(dst, op, cap, src + anchor, ip - anchor, ip - ref,
+                         mlen);
+    if (op > cap)
+      return 0;
+
+    ip += mlen;
+    anchor = ip;
+    misses = 0;
+  }
+
+  op = lz_put_sequence(dst, op, cap, src + anchor, n - anchor, 0, 0);
+  return op > cap ? 0 : op;
+}
+
+/* Read a length extension at @*ip, return -1 if the stream is truncated */
+static long lz_get_length(const uint8_t *src, size_t n, size_t *ip)
+{
+  long len = 0;
+  uint8_t b;
+
+  do {
+    if (*ip == n)
+      return -1;
+    b = src[(*ip)++];
+    len += b;
+  } while (b == 255);
+
+  return len;
+}
+
+long lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+  size_t ip = 0, op = 0;
+
+  while (ip < n) {
+    uint8_t token = src[ip++];
+    size_t nlit = token >> 4;
+    size_t mlen = token & 15;
+    size_t offset;
+
+    /* Fast path for short sequences, far enough from both ends to copy in
+     * fixed-size pieces: 14 literals at most, then a match of 18 at most */
+    if (nlit < 15 && mlen < 15 && n - ip >= 32 && cap - op >= 32) {
+      memcpy(dst + op, src + ip, 16);
+      ip += nlit;
+      op += nlit;
+      offset = src[ip] | src[ip + 1] << 8;
+      if (offset >= 8 && offset <= op) {
+        ip += 2;
+        mlen += LZ_MIN_MATCH;
+        memcpy(dst + op, dst + op - offset, 8);
+        memcpy(dst + op + 8, dst + op - offset + 8, 8);
+        memcpy(dst + op + 16, dst + op - offset + 16, 2);
+        op += mlen;
+        continue;
+      }
+      /* Rewind, the generic path copes with everything else */
+      ip -= nlit;
+      op -= nlit;
+    }
+
+    if (nlit == 15) {
+      long ext = lz_get_length(src, n, &ip);
+      if (ext < 0)
+        return -1;
+      nlit += ext;
+    }
+    if (nlit > n - ip || nlit > cap - op)
+      return -1;
+    if (n - ip - nlit >= 8 && cap - op - nlit >= 8)
+      lz_wildcopy(dst + op, src + ip, nlit);
+    else
+      memcpy(dst + op, src + ip, nlit);
+    ip += nlit;
+    op += nlit;
+
+    /* The last token has no match */
+    if (ip == n)
+      break;
+
+    if (n - ip < 2)
+      return -1;
+    offset = src[ip] | src[ip + 1] << 8;
+    ip += 2;
+    if (mlen == 15) {
+      long ext = lz_get_length(src, n, &ip);
+      if (ext < 0)
+        return -1;
+      mlen += ext;
+    }
+    mlen += LZ_MIN_MATCH;
+
+    if (offset == 0 || offset > op || mlen > cap - op)
+      return -1;
+
+    /* Matches may overlap their own output (runs), copying 8 bytes at a time
+     * only reads bytes already written when they are at least 8 bytes back */
+    if (offset >= 8 && cap - op - mlen >= 8) {
+      lz_wildcopy(dst + op, dst + op - offset, mlen);
+    } else {
+      for (size_t i = 0; i < mlen; i++)
+        dst[op + i] = dst[op - offset + i];
+    }
+    op += mlen;
+  }
+
+  return op;
+}
@@ -0,0 +1,40 @@
+#ifndef _FS_LZ_H
+#define _FS_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Small LZ77 codec used by compressed files. The stream is a sequence of
+ * tokens, each made of a run of literals followed by a back-reference of at
+ * least LZ_MIN_MATCH bytes within the previous 64 KiB. The last token only
+ * holds literals. Lengths are nibbles in the token byte, extended by 255-runs.
+ */
+
+#define LZ_MIN_MATCH 4
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @n: Number of bytes of data
+ * @dst: Buffer receiving the compressed stream
+ * @cap: Size of @dst
+ *
+ * Return: the length of the compressed stream, or 0 if it does not fit in
+ * @cap bytes.
+ */
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Compressed stream
+ * @n: Length of the compressed stream
+ * @dst: Buffer receiving the data
+ * @cap: Size of @dst
+ *
+ * Return: -1 if the stream is corrupted or does not fit in @cap bytes.
+ * Otherwise return the number of bytes of data.
+ */
+long lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+#endif /* _FS_LZ_H */
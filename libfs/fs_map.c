@@ -0,0 +1,450 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fs_internal.h"
+
+/*
+ * Block maps of mapped files (see RDIR_MAPPED). The map is a two-level tree:
+ * the root map block holds the FAT index of up to MAP_ENTRIES_PER_BLOCK leaf
+ * map blocks, and each leaf holds the entries of fs_map_leaf_entries() data
+ * blocks. A zero entry is a hole, at either level, so a hole costs no block at
+ * all however large it is. One root covers the whole 32-bit file size range
+ * in version 1, and 2 GiB in version 2, whose leaf entries are twice as wide.
+ */
+
+/* Cached copy of the root map block, block 0 when empty */
+struct map_cache {
+  uint32_t block;
+  uint32_t entries[MAP_ENTRIES_PER_BLOCK];
+};
+
+/* Cached copy of a leaf map block, in memory form */
+struct map_leaf_cache {
+  uint32_t block;
+  uint64_t entries[MAP_ENTRIES_PER_BLOCK];
+};
+
+/* Last root and leaf map blocks accessed */
+static struct map_cache map_root;
+static struct map_leaf_cache map_leaf;
+
+int fs_map_read_leaf(uint32_t block, uint64_t entries[MAP_ENTRIES_PER_BLOCK])
+{
+  uint32_t raw[MAP_ENTRIES_PER_BLOCK];
+
+  if (superblock.version != 1)
+    return block_read(fs_cluster_block(block), entries);
+
+  /* Version 1 entries hold a 16-bit block index, and the extra bits above */
+  if (block_read(fs_cluster_block(block), raw) < 0)
+    return -1;
+  for (uint32_t i = 0; i < MAP_ENTRIES_PER_BLOCK; i++)
+    entries[i] = (raw[i] & 0xffff) |
+                 (uint64_t)(raw[i] >> 16) << MAP_EXTRA_SHIFT;
+  return 0;
+}
+
+int fs_map_write_leaf(uint32_t block,
+                      const uint64_t entries[MAP_ENTRIES_PER_BLOCK])
+{
+  uint32_t raw[MAP_ENTRIES_PER_BLOCK];
+
+  if (superblock.version != 1)
+    return block_write(fs_cluster_block(block), entries);
+
+  for (uint32_t i = 0; i < MAP_ENTRIES_PER_BLOCK; i++)
+    raw[i] = (entries[i] & 0xffff) | (entries[i] >> MAP_EXTRA_SHIFT) << 16;
+  return block_write(fs_cluster_block(block), raw);
+}
+
+static int map_load(struct map_cache *cache, uint32_t block)
+{
+  if (cache->block == block)
+    return 0;
+
+  if (block_read(fs_cluster_block(block), cache->entries) < 0) {
+    cache->block = 0;
+    return -1;
+  }
+  cache->block = block;
+  return 0;
+}
+
+/* Write the cached map block back to the disk */
+static int map_store(struct map_cache *cache)
+{
+  if (block_write(fs_cluster_block(cache->block), cache->entries) < 0) {
+    cache->block = 0;
+    return -1;
+  }
+  return 0;
+}
+
+static int map_leaf_read(uint32_t block)
+{
+  if (map_leaf.block == block)
+    return 0;
+
+  if (fs_map_read_leaf(block, map_leaf.entries) < 0) {
+    map_leaf.block = 0;
+    return -1;
+  }
+  map_leaf.block = block;
+  return 0;
+}
+
+static int map_leaf_store(void)
+{
+  if (fs_map_write_leaf(map_leaf.block, map_leaf.entries) < 0) {
+    map_leaf.block = 0;
+    return -1;
+  }
+  return 0;
+}
+
+void fs_map_forget(uint32_t block)
+{
+  if (map_root.block == block)
+    map_root.block = 0;
+  if (map_leaf.block == block)
+    map_leaf.block = 0;
+}
+
+void fs_map_reset(void)
+{
+  map_root.block = 0;
+  map_leaf.block = 0;
+}
+
+/* Allocate a map block full of holes */
+static uint32_t map_alloc(void)
+{
+  uint32_t block = fs_findfirstblock();
+
+  if (block == FAT_EOC)
+    return FAT_EOC;
+
+  if (block_write(fs_cluster_block(block), zero_block) < 0) {
+    fat[block] = 0;
+    return FAT_EOC;
+  }
+  return block;
+}
+
+/*
+ * Load the leaf map block describing logical block @lblk of @entry, allocating
+ * it if needed when @alloc is set. Return -1 if there is no such leaf.
+ */
+static int map_leaf_load(uint32_t entry, uint32_t lblk, int alloc)
+{
+  uint32_t slot = lblk / fs_map_leaf_entries();
+  uint32_t leaf;
+
+  /* Past the range covered by the root */
+  if (slot >= MAP_ENTRIES_PER_BLOCK)
+    return -1;
+  if (map_load(&map_root, rootdir[entry].index_first_datablk) < 0)
+    return -1;
+
+  leaf = map_root.entries[slot];
+  if (leaf == 0) {
+    if (!alloc)
+      return -1;
+    leaf = map_alloc();
+    if (leaf == FAT_EOC)
+      return -1;
+    map_root.entries[slot] = leaf;
+    if (map_store(&map_root) < 0) {
+      fat[leaf] = 0;
+      return -1;
+    }
+  }
+
+  return map_leaf_read(leaf);
+}
+
+uint64_t fs_map_get(uint32_t entry, uint32_t lblk)
+{
+  if (map_leaf_load(entry, lblk, 0) < 0)
+    return 0;
+  return map_leaf.entries[lblk % fs_map_leaf_entries()];
+}
+
+int fs_map_set(uint32_t entry, uint32_t lblk, uint64_t value)
+{
+  return fs_map_set_range(entry, lblk, &value, 1);
+}
+
+void fs_map_get_range(uint32_t entry, uint32_t lblk, uint64_t *values,
+                      uint32_t n)
+{
+  if (map_leaf_load(entry, lblk, 0) < 0) {
+    memset(values, 0, n * sizeof(*values));
+    return;
+  }
+  memcpy(values, &map_leaf.entries[lblk % fs_map_leaf_entries()],
+         n * sizeof(*values));
+}
+
+int fs_map_set_range(uint32_t entry, uint32_t lblk, const uint64_t *values,
+                     uint32_t n)
+{
+  if (map_leaf_load(entry, lblk, 1) < 0)
+    return -1;
+
+  memcpy(&map_leaf.entries[lblk % fs_map_leaf_entries()], values,
+         n * sizeof(*values));
+  return map_leaf_store();
+}
+
+uint32_t fs_map_leaf(uint32_t entry, uint32_t slot)
+{
+  if (slot >= MAP_ENTRIES_PER_BLOCK ||
+      map_load(&map_root, rootdir[entry].index_first_datablk) < 0)
+    return 0;
+  return map_root.entries[slot];
+}
+
+int fs_map_set_leaf(uint32_t entry, uint32_t slot, uint32_t leaf)
+{
+  if (slot >= MAP_ENTRIES_PER_BLOCK ||
+      map_load(&map_root, rootdir[entry].index_first_datablk) < 0)
+    return -1;
+  map_root.entries[slot] = leaf;
+  return map_store(&map_root);
+}
+
+uint32_t fs_map_next(uint32_t entry, uint32_t lblk, uint32_t end, int data)
+{
+  uint32_t per_leaf = fs_map_leaf_entries();
+
+  while (lblk < end) {
+    uint32_t slot = lblk / per_leaf;
+
+    /* Nothing is mapped past the range covered by the root */
+    if (slot >= MAP_ENTRIES_PER_BLOCK)
+      return data ? end : lblk;
+    if (map_load(&map_root, rootdir[entry].index_first_datablk) < 0)
+      return end;
+
+    /* A missing leaf is a hole over its whole range */
+    if (map_root.entries[slot] == 0) {
+      if (!data)
+        return lblk;
+      lblk = (slot + 1) * per_leaf;
+      continue;
+    }
+
+    if (map_leaf_read(map_root.entries[slot]) < 0)
+      return end;
+    for (; lblk < end && lblk / per_leaf == slot; lblk++) {
+      if ((map_leaf.entries[lblk % per_leaf] != 0) == data)
+        return lblk;
+    }
+  }
+
+  return end;
+}
+
+int fs_make_mapped(uint32_t entry)
+{
+  struct RootDir *file = &rootdir[entry];
+  uint64_t leaf[MAP_ENTRIES_PER_BLOCK];
+  uint32_t block = file->index_first_datablk;
+  uint32_t root;
+
+  root = map_alloc();
+  if (root == FAT_EOC || map_load(&map_root, root) < 0)
+    goto fail;
+
+  /* Write the whole map first, the chain is left untouched on failure */
+  for (uint32_t slot = 0; block != FAT_EOC; slot++) {
+    uint32_t n = 0;
+    uint32_t leafblk;
+
+    /* The chain is longer than what a map can cover */
+    if (slot == MAP_ENTRIES_PER_BLOCK)
+      goto fail;
+    memset(leaf, 0, sizeof(leaf));
+    while (block != FAT_EOC && n < fs_map_leaf_entries()) {
+      leaf[n++] = block;
+      block = fat[block];
+    }
+
+    leafblk = fs_findfirstblock();
+    if (leafblk == FAT_EOC || fs_map_write_leaf(leafblk, leaf) < 0) {
+      if (leafblk != FAT_EOC)
+        fat[leafblk] = 0;
+      goto fail;
+    }
+    map_root.entries[slot] = leafblk;
+  }
+  if (map_store(&map_root) < 0)
+    goto fail;
+
+  block = file->index_first_datablk;
+  while (block != FAT_EOC) {
+    uint32_t next = fat[block];
+    fat[block] = FAT_EOC;
+    block = next;
+  }
+
+  file->index_first_datablk = root;
+  file->flags |= RDIR_MAPPED;
+  return 0;
+
+fail:
+  if (root != FAT_EOC && map_root.block == root) {
+    for (uint32_t slot = 0; slot < MAP_ENTRIES_PER_BLOCK; slot++) {
+      if (map_root.entries[slot])
+        fat[map_root.entries[slot]] = 0;
+    }
+  }
+  if (root != FAT_EOC)
+    fat[root] = 0;
+  fs_map_reset();
+  return -1;
+}
+
+uint32_t fs_map_clone(uint32_t rootblk)
+{
+  uint32_t root[MAP_ENTRIES_PER_BLOCK];
+  /* Leaves are copied as they are stored */
+  uint8_t leaf[BLOCK_SIZE];
+  uint32_t slot = 0;
+  uint32_t copy = FAT_EOC;
+
+  if (block_read(fs_cluster_block(rootblk), root) < 0)
+    return FAT_EOC;
+
+  for (; slot < MAP_ENTRIES_PER_BLOCK; slot++) {
+    uint32_t leafblk;
+
+    if (root[slot] == 0)
+      continue;
+    if (block_read(fs_cluster_block(root[slot]), leaf) < 0)
+      goto fail;
+    leafblk = fs_findfirstblock();
+    if (leafblk == FAT_EOC)
+      goto fail;
+    if (block_write(fs_cluster_block(leafblk), leaf) < 0) {
+      fat[leafblk] = 0;
+      goto fail;
+    }
+    root[slot] = leafblk;
+  }
+
+  copy = fs_findfirstblock();
+  if (copy != FAT_EOC &&
+      block_write(fs_cluster_block(copy), root) == 0)
+    return copy;
+  if (copy != FAT_EOC)
+    fat[copy] = 0;
+
+fail:
+  /* The slots before @slot point to copies of the leaves */
+  while (slot-- > 0) {
+    if (root[slot])
+      fat[root[slot]] = 0;
+  }
+  return FAT_EOC;
+}
+
+/* Free data block @block of a mapped file, shared if @shared is set */
+static void map_free_block(uint32_t block, int shared)
+{
+  if (block == 0 || block >= superblock.num_data_blks)
+    return;
+  if (shared)
+    fs_dedup_put(block);
+  else
+    fat[block] = 0;
+}
+
+void fs_free_mapped(const struct RootDir *file)
+{
+  uint32_t root[MAP_ENTRIES_PER_BLOCK];
+  uint64_t leaf[MAP_ENTRIES_PER_BLOCK];
+  uint32_t rootblk = file->index_first_datablk;
+  int shared = file->flags & RDIR_DEDUP;
+
+  if (rootblk == 0 || rootblk >= superblock.num_data_blks)
+    return;
+
+  if (block_read(fs_cluster_block(rootblk), root) == 0) {
+    for (uint32_t slot = 0; slot < MAP_ENTRIES_PER_BLOCK; slot++) {
+      if (root[slot] == 0 || root[slot] >= superblock.num_data_blks)
+        continue;
+      if (fs_map_read_leaf(root[slot], leaf) == 0) {
+        for (uint32_t i = 0; i < fs_map_leaf_entries(); i++)
+          map_free_block(leaf[i] & MAP_BLOCK_MASK, shared);
+      }
+      fat[root[slot]] = 0;
+      fs_map_forget(root[slot]);
+    }
+  }
+  fat[rootblk] = 0;
+  /* Only the caches of the freed blocks are dropped: this can run while
+   * another map is being modified, when the allocator reclaims blocks */
+  fs_map_forget(rootblk);
+}
+
+int fs_map_truncate(uint32_t entry, uint32_t lblk)
+{
+  const struct RootDir *file = &rootdir[entry];
+  int shared = file->flags & RDIR_DEDUP;
+  uint32_t per_leaf = fs_map_leaf_entries();
+  uint32_t first = lblk / per_leaf;
+  uint32_t leaves[MAP_ENTRIES_PER_BLOCK];
+  uint32_t nleaves = 0;
+
+  if (first >= MAP_ENTRIES_PER_BLOCK)
+    return 0;
+  if (map_load(&map_root, file->index_first_datablk) < 0)
+    return -1;
+
+  /* The leaf holding @lblk keeps the entries before it */
+  if (lblk % per_leaf && map_root.entries[first]) {
+    uint64_t old[MAP_ENTRIES_PER_BLOCK];
+    uint32_t start = lblk % per_leaf;
+
+    if (map_leaf_read(map_root.entries[first]) < 0)
+      return -1;
+    memcpy(old, map_leaf.entries, sizeof(old));
+    memset(&map_leaf.entries[start], 0,
+           (per_leaf - start) * sizeof(*map_leaf.entries));
+    if (map_leaf_store() < 0)
+      return -1;
+    for (uint32_t i = start; i < per_leaf; i++)
+      map_free_block(old[i] & MAP_BLOCK_MASK, shared);
+  }
+  if (lblk % per_leaf)
+    first++;
+
+  /* The following leaves go as a whole */
+  for (uint32_t slot = first; slot < MAP_ENTRIES_PER_BLOCK; slot++) {
+    if (map_root.entries[slot]) {
+      leaves[nleaves++] = map_root.entries[slot];
+      map_root.entries[slot] = 0;
+    }
+  }
+  if (nleaves == 0)
+    return 0;
+  if (map_store(&map_root) < 0)
+    return -1;
+
+  for (uint32_t i = 0; i < nleaves; i++) {
+    uint64_t leaf[MAP_ENTRIES_PER_BLOCK];
+
+    if (leaves[i] >= superblock.num_data_blks)
+      continue;
+    if (fs_map_read_leaf(leaves[i], leaf) == 0) {
+      for (uint32_t j = 0; j < per_leaf; j++)
+        map_free_block(leaf[j] & MAP_BLOCK_MASK, shared);
+    }
+    fat[leaves[i]] = 0;
+    fs_map_forget(leaves[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,235 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fs_internal.h"
+
+/*
+ * Packed files (see RDIR_PACKED). The free space of packed blocks is not
+ * recorded on disk: it is found from the packed files stored in each block,
+ * which are listed in memory when mounting.
+ */
+
+/* First packed file of each data block, then chained through pack_next */
+static uint32_t *pack_head;
+static uint32_t *pack_next;
+static uint32_t pack_capacity;
+/* Packed block that took data last, tried before starting a new one */
+static uint32_t pack_last;
+
+static inline int pack_valid(uint32_t block)
+{
+  return block != 0 && block < superblock.num_data_blks;
+}
+
+static int pack_link(uint32_t entry, uint32_t block)
+{
+  if (entry >= pack_capacity) {
+    uint32_t *next = realloc(pack_next, rootdir_count * sizeof(*next));
+
+    if (!next)
+      return -1;
+    pack_next = next;
+    pack_capacity = rootdir_count;
+  }
+
+  pack_next[entry] = pack_head[block];
+  pack_head[block] = entry;
+  return 0;
+}
+
+static void pack_unlink(uint32_t entry, uint32_t block)
+{
+  uint32_t *link = &pack_head[block];
+
+  while (*link != DIR_NONE && *link != entry)
+    link = &pack_next[*link];
+  if (*link != DIR_NONE)
+    *link = pack_next[entry];
+}
+
+int fs_pack_load(void)
+{
+  fs_pack_unload();
+
+  pack_head = malloc(superblock.num_data_blks * sizeof(*pack_head));
+  if (!pack_head)
+    return -1;
+  memset(pack_head, 0xff, superblock.num_data_blks * sizeof(*pack_head));
+
+  for (uint32_t i = 0; i < rootdir_count; i++) {
+    uint32_t block = rootdir[i].index_first_datablk;
+
+    if (*rootdir[i].filename == 0 || !(rootdir[i].flags & RDIR_PACKED) ||
+        !pack_valid(block))
+      continue;
+    if (pack_link(i, block) < 0) {
+      fs_pack_unload();
+      return -1;
+    }
+    pack_last = block;
+  }
+  return 0;
+}
+
+void fs_pack_unload(void)
+{
+  free(pack_head);
+  free(pack_next);
+  pack_head = NULL;
+  pack_next = NULL;
+  pack_capacity = 0;
+  pack_last = 0;
+}
+
+/* Drop @entry from the files of packed block @block, freeing it if empty */
+static void pack_release(uint32_t entry, uint32_t block)
+{
+  pack_unlink(entry, block);
+  if (pack_head[block] == DIR_NONE) {
+    fat[block] = 0;
+    if (pack_last == block)
+      pack_last = 0;
+  }
+}
+
+void fs_pack_free(uint32_t entry)
+{
+  uint32_t block = rootdir[entry].index_first_datablk;
+
+  if (pack_valid(block))
+    pack_release(entry, block);
+}
+
+/*
+ * Return the offset of the first gap of at least @len bytes in packed block
+ * @block, ignoring the data of @entry, or -1 if there is none.
+ */
+static int pack_find_gap(uint32_t block, uint32_t entry, uint32_t len)
+{
+  uint32_t pos = 0;
+
+  /* Jump over the data lying at the current position until a gap is found;
+   * each pass either moves forward or ends the search */
+  for (;;) {
+    uint32_t next = pos;
+
+    for (uint32_t i = pack_head[block]; i != DIR_NONE; i = pack_next[i]) {
+      uint32_t start = rootdir[i].pack_offset;
+      uint32_t end = start + rootdir[i].size_of_file;
+
+      if (i != entry && start < pos + len && end > pos && end > next)
+        next = end;
+    }
+    if (next == pos)
+      return pos + len <= BLOCK_SIZE ? (int)pos : -1;
+    pos = next;
+    if (pos + len > BLOCK_SIZE)
+      return -1;
+  }
+}
+
+int fs_pack_read(uint32_t entry, uint32_t offset, uint8_t *buf,
+                 uint32_t count)
+{
+  const struct RootDir *file = &rootdir[entry];
+  uint8_t tmp[BLOCK_SIZE];
+
+  if (block_read(fs_cluster_block(file->index_first_datablk), tmp) < 0)
+    return -1;
+  memcpy(buf, tmp + file->pack_offset + offset, count);
+  return count;
+}
+
+int fs_pack_write(uint32_t entry, uint32_t offset, const uint8_t *buf,
+                  uint32_t count)
+{
+  struct RootDir *file = &rootdir[entry];
+  uint32_t size = file->size_of_file;
+  int packed = file->flags & RDIR_PACKED;
+  uint32_t old = packed ? file->index_first_datablk : 0;
+  uint32_t block = 0;
+  uint8_t data[PACK_MAX_SIZE];
+  uint8_t tmp[BLOCK_SIZE];
+  int pos = -1;
+
+  if (offset + count > size)
+    size = offset + count;
+
+  /* The whole content is rewritten, possibly elsewhere */
+  memset(data, 0, sizeof(data));
+  if (packed && fs_pack_read(entry, 0, data, file->size_of_file) < 0)
+    return 0;
+  memcpy(data + offset, buf, count);
+
+  /* Stay in the current block if possible, then try the block that took
+   * data last, then start a new one */
+  if (packed)
+    pos = pack_find_gap(old, entry, size);
+  if (pos >= 0) {
+    block = old;
+  } else if (pack_last != 0 && pack_last != old) {
+    block = pack_last;
+    pos = pack_find_gap(block, entry, size);
+  }
+
+  if (pos >= 0) {
+    if (block_read(fs_cluster_block(block), tmp) < 0)
+      return 0;
+  } else {
+    block = fs_findfirstblock();
+    if (block == FAT_EOC)
+      return 0;
+    memset(tmp, 0, BLOCK_SIZE);
+    pos = 0;
+  }
+
+  memcpy(tmp + pos, data, size);
+  if (block_write(fs_cluster_block(block), tmp) < 0) {
+    if (pack_head[block] == DIR_NONE)
+      fat[block] = 0;
+    return 0;
+  }
+
+  if (block != old) {
+    /* Linking cannot fail for an entry that was already linked */
+    if (packed)
+      pack_release(entry, old);
+    if (pack_link(entry, block) < 0) {
+      if (pack_head[block] == DIR_NONE)
+        fat[block] = 0;
+      return 0;
+    }
+  }
+  file->index_first_datablk = block;
+  file->pack_offset = pos;
+  file->flags |= RDIR_PACKED;
+  pack_last = block;
+  return count;
+}
+
+int fs_unpack(uint32_t entry)
+{
+  struct RootDir *file = &rootdir[entry];
+  uint8_t tmp[BLOCK_SIZE];
+  uint32_t block;
+
+  memset(tmp, 0, BLOCK_SIZE);
+  if (fs_pack_read(entry, 0, tmp, file->size_of_file) < 0)
+    return -1;
+
+  block = fs_findfirstblock();
+  if (block == FAT_EOC)
+    return -1;
+  if (block_write(fs_cluster_block(block), tmp) < 0) {
+    fat[block] = 0;
+    return -1;
+  }
+
+  fs_pack_free(entry);
+  file->index_first_datablk = block;
+  file->pack_offset = 0;
+  file->flags &= ~RDIR_PACKED;
+  return 0;
+}
@@ -0,0 +1,130 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Deferred reclamation of the blocks of deleted or truncated files. When it is
+ * enabled, detaching a plain chain or the block map of a file only queues it,
+ * and the FAT entries are cleared later in batches: by fs_reclaim() when the
+ * caller is idle, when the allocator runs out of free blocks, and before
+ * anything that needs an exact FAT (fs_info(), fs_check(), unmounting). Queued
+ * blocks are never on the disk as such: the FAT is only written back when
+ * unmounting or syncing, after everything has been reclaimed.
+ */
+
+/* A detached plain chain (no flags) or the block map of a mapped file */
+static struct RootDir *reclaim_queue;
+static size_t reclaim_count;
+static size_t reclaim_capacity;
+static int reclaim_deferred;
+
+static int reclaim_push(const struct RootDir *file)
+{
+  if (reclaim_count == reclaim_capacity) {
+    size_t capacity = reclaim_capacity ? 2 * reclaim_capacity : 16;
+    struct RootDir *queue = realloc(reclaim_queue,
+                                    capacity * sizeof(*queue));
+
+    if (!queue)
+      return -1;
+    reclaim_queue = queue;
+    reclaim_capacity = capacity;
+  }
+  reclaim_queue[reclaim_count++] = *file;
+  return 0;
+}
+
+void fs_reclaim_chain(uint32_t block)
+{
+  struct RootDir chain = { .index_first_datablk = block };
+
+  if (block == FAT_EOC || block == 0)
+    return;
+  /* The blocks are freed right away when they cannot be queued */
+  if (!reclaim_deferred || reclaim_push(&chain) < 0)
+    fs_free_chain(block);
+}
+
+void fs_reclaim_mapped(const struct RootDir *file)
+{
+  if (!reclaim_deferred || reclaim_push(file) < 0)
+    fs_free_mapped(file);
+}
+
+/*
+ * Reclaim queued blocks, last queued first, clearing about @budget FAT entries
+ * at most (0: no limit). Return whether blocks remain queued.
+ */
+static int reclaim_run(size_t budget)
+{
+  size_t done = 0;
+
+  while (reclaim_count > 0 && (budget == 0 || done < budget)) {
+    struct RootDir *item = &reclaim_queue[reclaim_count - 1];
+
+    if (item->flags & RDIR_MAPPED) {
+      /* A block map is reclaimed as a whole */
+      done += 1 + ((uint64_t)item->size_of_file + BLOCK_SIZE - 1) /
+                  BLOCK_SIZE;
+      fs_free_mapped(item);
+      reclaim_count--;
+      continue;
+    }
+
+    uint32_t block = item->index_first_datablk;
+    while (block != FAT_EOC && block != 0 &&
+           block < superblock.num_data_blks &&
+           (budget == 0 || done < budget)) {
+      uint32_t next = fat[block];
+      fat[block] = 0;
+      block = next;
+      done++;
+    }
+    if (block == FAT_EOC || block == 0 || block >= superblock.num_data_blks)
+      reclaim_count--;
+    else
+      item->index_first_datablk = block;
+  }
+
+  return reclaim_count > 0;
+}
+
+int fs_reclaim_all(void)
+{
+  int queued = reclaim_count > 0;
+
+  reclaim_run(0);
+  return queued;
+}
+
+void fs_reclaim_reset(void)
+{
+  free(reclaim_queue);
+  reclaim_queue = NULL;
+  reclaim_count = 0;
+  reclaim_capacity = 0;
+  reclaim_deferred = 0;
+}
+
+int fs_set_deferred_free(int enable)
+{
+  if (!mounted)
+    return -1;
+
+  reclaim_deferred = enable != 0;
+  if (!reclaim_deferred)
+    reclaim_run(0);
+  return 0;
+}
+
+int fs_reclaim(size_t budget)
+{
+  if (!mounted)
+    return -1;
+
+  return reclaim_run(budget);
+}
@@ -0,0 +1,253 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fs_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#endif
+
+_Static_assert(sizeof(struct RootDir) == 32, "kernels assume 32-byte entries");
+_Static_assert(FS_FILENAME_LEN == 16, "kernels assume 16-byte filenames");
+
+/* Scalar implementation */
+
+static size_t scalar_count_zero32(const uint32_t *a, size_t n)
+{
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) {
+    count += a[i] == 0;
+  }
+  return count;
+}
+
+static size_t scalar_find_zero32(const uint32_t *a, size_t from, size_t n)
+{
+  for (size_t i = from; i < n; i++) {
+    if (a[i] == 0)
+      return i;
+  }
+  return n;
+}
+
+static size_t scalar_find_name(const struct RootDir *entries, size_t n,
+                               const uint8_t key[FS_FILENAME_LEN])
+{
+  for (size_t i = 0; i < n; i++) {
+    if (memcmp(entries[i].filename, key, FS_FILENAME_LEN) == 0)
+      return i;
+  }
+  return n;
+}
+
+static const struct simd_ops scalar_ops = {
+  .name = "scalar",
+  .count_zero32 = scalar_count_zero32,
+  .find_zero32 = scalar_find_zero32,
+  .find_name = scalar_find_name,
+};
+
+#ifdef SIMD_X86
+
+/*
+ * The comparisons of 32-bit lanes are either packed down to one byte per lane
+ * before movemask, or turned into one bit per lane by the float movemask.
+ */
+
+/* SSE2 implementation */
+
+__attribute__((target("sse2,popcnt")))
+static size_t sse2_count_zero32(const uint32_t *a, size_t n)
+{
+  const __m128i zero = _mm_setzero_si128();
+  size_t bits = 0;
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i v0 = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(a + i + 4));
+    __m128i v2 = _mm_loadu_si128((const __m128i *)(a + i + 8));
+    __m128i v3 = _mm_loadu_si128((const __m128i *)(a + i + 12));
+    /* Pack the four comparisons into one register of byte masks */
+    __m128i p0 = _mm_packs_epi32(_mm_cmpeq_epi32(v0, zero),
+                                 _mm_cmpeq_epi32(v1, zero));
+    __m128i p1 = _mm_packs_epi32(_mm_cmpeq_epi32(v2, zero),
+                                 _mm_cmpeq_epi32(v3, zero));
+    bits += __builtin_popcount(_mm_movemask_epi8(_mm_packs_epi16(p0, p1)));
+  }
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+    bits += __builtin_popcount(
+              _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))));
+  }
+
+  return bits + scalar_count_zero32(a + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_find_zero32(const uint32_t *a, size_t from, size_t n)
+{
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = from;
+
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero)));
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+
+  return scalar_find_zero32(a, i, n);
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_find_name(const struct RootDir *entries, size_t n,
+                             const uint8_t key[FS_FILENAME_LEN])
+{
+  const __m128i k = _mm_loadu_si128((const __m128i *)key);
+
+  for (size_t i = 0; i < n; i++) {
+    __m128i name = _mm_loadu_si128((const __m128i *)entries[i].filename);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(name, k)) == 0xffff)
+      return i;
+  }
+  return n;
+}
+
+static const struct simd_ops sse2_ops = {
+  .name = "sse2",
+  .count_zero32 = sse2_count_zero32,
+  .find_zero32 = sse2_find_zero32,
+  .find_name = sse2_find_name,
+};
+
+/* AVX2 implementation */
+
+__attribute__((target("avx2,popcnt")))
+static size_t avx2_count_zero32(const uint32_t *a, size_t n)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  size_t bits = 0;
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i v1 = _mm256_loadu_si256((const __m256i *)(a + i + 8));
+    __m256i v2 = _mm256_loadu_si256((const __m256i *)(a + i + 16));
+    __m256i v3 = _mm256_loadu_si256((const __m256i *)(a + i + 24));
+    /* Lane order is shuffled by the packs, which is fine for a count */
+    __m256i p0 = _mm256_packs_epi32(_mm256_cmpeq_epi32(v0, zero),
+                                    _mm256_cmpeq_epi32(v1, zero));
+    __m256i p1 = _mm256_packs_epi32(_mm256_cmpeq_epi32(v2, zero),
+                                    _mm256_cmpeq_epi32(v3, zero));
+    bits += __builtin_popcount(
+              (uint32_t)_mm256_movemask_epi8(_mm256_packs_epi16(p0, p1)));
+  }
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+    bits += __builtin_popcount(_mm256_movemask_ps(
+              _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero))));
+  }
+
+  return bits + scalar_count_zero32(a + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_find_zero32(const uint32_t *a, size_t from, size_t n)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = from;
+
+  for (; i + 16 <= n; i += 16) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i v1 = _mm256_loadu_si256((const __m256i *)(a + i + 8));
+    __m256i c0 = _mm256_cmpeq_epi32(v0, zero);
+    __m256i c1 = _mm256_cmpeq_epi32(v1, zero);
+    if (!_mm256_testz_si256(_mm256_or_si256(c0, c1),
+                            _mm256_or_si256(c0, c1))) {
+      int mask = _mm256_movemask_ps(_mm256_castsi256_ps(c0));
+      if (mask)
+        return i + __builtin_ctz(mask);
+      mask = _mm256_movemask_ps(_mm256_castsi256_ps(c1));
+      return i + 8 + __builtin_ctz(mask);
+    }
+  }
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+    int mask = _mm256_movemask_ps(
+                 _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero)));
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+
+  return scalar_find_zero32(a, i, n);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_find_name(const struct RootDir *entries, size_t n,
+                             const uint8_t key[FS_FILENAME_LEN])
+{
+  const __m256i k = _mm256_broadcastsi128_si256(
+                      _mm_loadu_si128((const __m128i *)key));
+  size_t i = 0;
+
+  /* Compare the filenames of two consecutive entries at once */
+  for (; i + 2 <= n; i += 2) {
+    __m256i names = _mm256_loadu2_m128i(
+                      (const __m128i *)entries[i + 1].filename,
+                      (const __m128i *)entries[i].filename);
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(names, k));
+    if ((mask & 0xffff) == 0xffff)
+      return i;
+    if ((mask >> 16) == 0xffff)
+      return i + 1;
+  }
+
+  return i + scalar_find_name(entries + i, n - i, key);
+}
+
+static const struct simd_ops avx2_ops = {
+  .name = "avx2",
+  .count_zero32 = avx2_count_zero32,
+  .find_zero32 = avx2_find_zero32,
+  .find_name = avx2_find_name,
+};
+
+#endif /* SIMD_X86 */
+
+const struct simd_ops *simd_ops_level(enum simd_level level)
+{
+  switch (level) {
+  case SIMD_SCALAR:
+    return &scalar_ops;
+#ifdef SIMD_X86
+  case SIMD_SSE2:
+    if (__builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt"))
+      return &sse2_ops;
+    break;
+  case SIMD_AVX2:
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+      return &avx2_ops;
+    break;
+#endif
+  default:
+    break;
+  }
+  return NULL;
+}
+
+const struct simd_ops *simd_ops(void)
+{
+  static const struct simd_ops *best;
+
+  if (!best) {
+    const struct simd_ops *ops = NULL;
+    for (int level = SIMD_NR_LEVELS - 1; !ops; level--) {
+      ops = simd_ops_level(level);
+    }
+    best = ops;
+  }
+  return best;
+}
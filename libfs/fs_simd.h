@@ -0,0 +1,49 @@
+#ifndef _FS_SIMD_H
+#define _FS_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fs_format.h"
+
+/*
+ * Vectorized kernels for the hot metadata scans (FAT and root directory).
+ * Each kernel has a scalar, an SSE2 and an AVX2 implementation; the best one
+ * supported by the CPU is selected at runtime.
+ */
+
+enum simd_level {
+  SIMD_SCALAR,
+  SIMD_SSE2,
+  SIMD_AVX2,
+  SIMD_NR_LEVELS,
+};
+
+struct simd_ops {
+  const char *name;
+  /* Number of zero entries in @a[0..@n) */
+  size_t (*count_zero32)(const uint32_t *a, size_t n);
+  /* Index of the first zero entry in @a[@from..@n), @n if there is none */
+  size_t (*find_zero32)(const uint32_t *a, size_t from, size_t n);
+  /*
+   * Index of the first of the @n entries whose filename field is equal to
+   * the 16 bytes of @key, @n if there is none
+   */
+  size_t (*find_name)(const struct RootDir *entries, size_t n,
+                      const uint8_t key[FS_FILENAME_LEN]);
+};
+
+/**
+ * simd_ops - Get the best kernels supported by the CPU
+ */
+const struct simd_ops *simd_ops(void);
+
+/**
+ * simd_ops_level - Get the kernels of a given implementation
+ * @level: Implementation level
+ *
+ * Return: NULL if @level is not supported by the CPU.
+ */
+const struct simd_ops *simd_ops_level(enum simd_level level);
+
+#endif /* _FS_SIMD_H */
@@ -0,0 +1,255 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Clones and snapshots (see RDIR_SNAPSHOT). Both rely on the reference counts
+ * of deduplicated files: a file is first turned into a deduplicated file, then
+ * only its block map is copied, and the reference count of each data block is
+ * incremented. Writing to any of the copies afterwards copies the shared
+ * blocks it modifies, so that cloning costs O(metadata).
+ */
+
+struct RootDir *fs_snapshot_load(const struct RootDir *snap, uint32_t *count)
+{
+  uint32_t nblocks = snap->size_of_file / BLOCK_SIZE;
+  uint32_t block = snap->index_first_datablk;
+  struct RootDir *saved;
+
+  if (nblocks == 0 || nblocks > superblock.num_data_blks)
+    return NULL;
+  saved = malloc(nblocks * BLOCK_SIZE);
+  if (!saved)
+    return NULL;
+
+  for (uint32_t i = 0; i < nblocks; i++) {
+    if (block == 0 || block >= superblock.num_data_blks ||
+        fs_dir_read(fs_cluster_block(block),
+                    saved + i * DIR_ENTRIES_PER_BLOCK) < 0) {
+      free(saved);
+      return NULL;
+    }
+    block = fat[block];
+  }
+  *count = nblocks * DIR_ENTRIES_PER_BLOCK;
+  return saved;
+}
+
+void fs_snapshot_free(const struct RootDir *snap)
+{
+  uint32_t count;
+  struct RootDir *saved = fs_snapshot_load(snap, &count);
+
+  if (saved) {
+    for (uint32_t i = 0; i < count; i++) {
+      if (*saved[i].filename != 0 && (saved[i].flags & RDIR_MAPPED))
+        fs_free_mapped(&saved[i]);
+    }
+    free(saved);
+  }
+  fs_free_chain(snap->index_first_datablk);
+}
+
+/*
+ * Turn file @entry into a deduplicated file, so that its data blocks can be
+ * shared. The tags of its blocks are unknown, they are not indexed.
+ */
+static int snapshot_share(uint32_t entry)
+{
+  struct RootDir *file = &rootdir[entry];
+
+  if (file->flags & RDIR_DEDUP)
+    return 0;
+  /* Compressed chunks are rewritten in place, and clusters cannot be
+   * shared */
+  if ((file->flags & (RDIR_COMPRESSED | RDIR_SNAPSHOT)) ||
+      superblock.cluster_shift)
+    return -1;
+
+  /* Asynchronous writes must land before the blocks get shared */
+  fs_async_drain();
+
+  if ((file->flags & RDIR_PACKED) && fs_unpack(entry) < 0)
+    return -1;
+  if (!(file->flags & RDIR_MAPPED) && fs_make_mapped(entry) < 0)
+    return -1;
+  file->flags |= RDIR_DEDUP;
+  fs_dedup_ref(file);
+  return 0;
+}
+
+/* Make @copy a copy of deduplicated file @file sharing its data blocks */
+static int snapshot_copy(const struct RootDir *file, struct RootDir *copy)
+{
+  uint32_t root = fs_map_clone(file->index_first_datablk);
+
+  if (root == FAT_EOC)
+    return -1;
+
+  *copy = *file;
+  copy->index_first_datablk = root;
+  fs_dedup_ref(copy);
+  return 0;
+}
+
+static uint32_t snapshot_lookup(const char *filename)
+{
+  if (!mounted || !filename || strlen(filename) >= FS_FILENAME_LEN ||
+      *filename == '\0')
+    return DIR_NONE;
+  return fs_lookup(filename);
+}
+
+int fs_clone(const char *src, const char *dst)
+{
+  uint32_t s = snapshot_lookup(src);
+  uint8_t filename[FS_FILENAME_LEN];
+  uint32_t d;
+
+  if (readonly || s == DIR_NONE || snapshot_share(s) < 0)
+    return -1;
+  if (fs_create(dst) < 0)
+    return -1;
+
+  d = fs_lookup(dst);
+  memcpy(filename, rootdir[d].filename, FS_FILENAME_LEN);
+  if (snapshot_copy(&rootdir[s], &rootdir[d]) < 0) {
+    fs_delete(dst);
+    return -1;
+  }
+  memcpy(rootdir[d].filename, filename, FS_FILENAME_LEN);
+  return 0;
+}
+
+int fs_snapshot(const char *name)
+{
+  struct RootDir *saved;
+  uint32_t snap, count;
+  uint32_t last = 0;
+
+  if (!mounted || readonly || superblock.cluster_shift)
+    return -1;
+
+  /* Compressed files cannot share their blocks */
+  for (uint32_t i = 0; i < rootdir_count; i++) {
+    if (*rootdir[i].filename != 0 && (rootdir[i].flags & RDIR_COMPRESSED))
+      return -1;
+  }
+
+  if (fs_create(name) < 0)
+    return -1;
+  snap = fs_lookup(name);
+  count = rootdir_count;
+  saved = calloc(count, sizeof(*saved));
+  if (!saved)
+    goto fail;
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (i == snap || *rootdir[i].filename == 0 ||
+        (rootdir[i].flags & RDIR_SNAPSHOT))
+      continue;
+    if (snapshot_share(i) < 0 || snapshot_copy(&rootdir[i], &saved[i]) < 0)
+      goto fail;
+  }
+
+  /* One block per block of the directory, chained like a plain file so that
+   * deleting the entry before it is complete frees them */
+  for (uint32_t i = 0; i < count / DIR_ENTRIES_PER_BLOCK; i++) {
+    uint32_t block = fs_findfirstblock();
+
+    if (block == FAT_EOC)
+      goto fail;
+    if (i == 0)
+      rootdir[snap].index_first_datablk = block;
+    else
+      fat[last] = block;
+    last = block;
+    if (fs_dir_write(fs_cluster_block(block),
+                     saved + i * DIR_ENTRIES_PER_BLOCK) < 0)
+      goto fail;
+  }
+
+  rootdir[snap].size_of_file = count / DIR_ENTRIES_PER_BLOCK * BLOCK_SIZE;
+  rootdir[snap].flags = RDIR_SNAPSHOT;
+  free(saved);
+  return 0;
+
+fail:
+  for (uint32_t i = 0; saved && i < count; i++) {
+    if (*saved[i].filename != 0)
+      fs_free_mapped(&saved[i]);
+  }
+  free(saved);
+  fs_delete(name);
+  return -1;
+}
+
+int fs_snapshot_restore(const char *name)
+{
+  struct RootDir *saved, *copies = NULL;
+  uint32_t snap = snapshot_lookup(name);
+  uint32_t count, nfiles = 0, live = 0;
+  int ret = -1;
+
+  if (readonly || snap == DIR_NONE || !(rootdir[snap].flags & RDIR_SNAPSHOT))
+    return -1;
+  saved = fs_snapshot_load(&rootdir[snap], &count);
+  if (!saved)
+    return -1;
+
+  for (uint32_t i = 0; i < rootdir_count; i++) {
+    if (fs_entry_open(i))
+      goto out;
+    if (*rootdir[i].filename != 0 && !(rootdir[i].flags & RDIR_SNAPSHOT))
+      live++;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t other;
+
+    if (*saved[i].filename == 0)
+      continue;
+    nfiles++;
+    /* The name may have been given to a snapshot since */
+    other = fs_lookup((const char *)saved[i].filename);
+    if (other != DIR_NONE && (rootdir[other].flags & RDIR_SNAPSHOT))
+      goto out;
+  }
+
+  /* Make room and copy the saved files first, a full disk leaves the live
+   * files intact */
+  if (nfiles > live && fs_dir_reserve(nfiles - live) < 0)
+    goto out;
+  copies = calloc(count, sizeof(*copies));
+  if (!copies)
+    goto out;
+  for (uint32_t i = 0; i < count; i++) {
+    if (*saved[i].filename != 0 && snapshot_copy(&saved[i], &copies[i]) < 0) {
+      while (i-- > 0) {
+        if (*copies[i].filename != 0)
+          fs_free_mapped(&copies[i]);
+      }
+      goto out;
+    }
+  }
+
+  for (uint32_t i = 0; i < rootdir_count; i++) {
+    if (*rootdir[i].filename != 0 && !(rootdir[i].flags & RDIR_SNAPSHOT))
+      fs_delete((const char *)rootdir[i].filename);
+  }
+
+  /* The entries were reserved above, none of these can fail */
+  for (uint32_t i = 0; i < count; i++) {
+    if (*copies[i].filename != 0)
+      rootdir[fs_dir_alloc(copies[i].filename)] = copies[i];
+  }
+  ret = 0;
+
+out:
+  free(saved);
+  free(copies);
+  return ret;
+}
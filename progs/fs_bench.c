@@ -0,0 +1,736 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+#include <fs_crc.h>
+#include <fs_internal.h>
+#include <fs_simd.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define fs_bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Largest FAT the on-disk format can hold */
+#define BENCH_FAT_ENTRIES 65535
+
+struct bench_arg {
+	int argc;
+	char **argv;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *kernel, const char *impl, size_t bytes,
+		   size_t iters, double secs, size_t result)
+{
+	printf("%-14s %-7s %8.2f GB/s  (%zu iterations, result %zu)\n", kernel,
+	       impl, (double)bytes * iters / secs / 1e9, iters, result);
+}
+
+/* Volatile sink so that the kernel calls are not optimized away */
+static volatile size_t sink;
+
+static void bench_scan(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t iters = 20000;
+	uint32_t *fat;
+	struct RootDir *rootdir;
+	uint8_t key[FS_FILENAME_LEN] = { 0 };
+
+	if (b_arg->argc > 0)
+		iters = strtoul(b_arg->argv[0], NULL, 0);
+	if (!iters)
+		die("Usage: [iterations]");
+
+	/* Full FAT: a single free entry, at the very end */
+	fat = malloc(BENCH_FAT_ENTRIES * sizeof(*fat));
+	if (!fat)
+		die("Cannot malloc");
+	for (size_t i = 0; i < BENCH_FAT_ENTRIES; i++)
+		fat[i] = i + 1;
+	fat[BENCH_FAT_ENTRIES - 1] = 0;
+
+	/* Full root directory, looking up the last entry */
+	rootdir = calloc(FS_FILE_MAX_COUNT, sizeof(*rootdir));
+	if (!rootdir)
+		die("Cannot malloc");
+	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++)
+		snprintf((char *)rootdir[i].filename, FS_FILENAME_LEN,
+			 "file%zu", i);
+	memcpy(key, rootdir[FS_FILE_MAX_COUNT - 1].filename, FS_FILENAME_LEN);
+
+	printf("FAT of %d entries, root directory of %d entries\n",
+	       BENCH_FAT_ENTRIES, FS_FILE_MAX_COUNT);
+
+	for (int level = 0; level < SIMD_NR_LEVELS; level++) {
+		const struct simd_ops *ops = simd_ops_level(level);
+		double start;
+		size_t i;
+
+		if (!ops) {
+			printf("%-14s %-7s unsupported\n", "-", "-");
+			continue;
+		}
+
+		start = now();
+		for (i = 0; i < iters; i++)
+			sink = ops->count_zero32(fat, BENCH_FAT_ENTRIES);
+		report("count_zero32", ops->name,
+		       BENCH_FAT_ENTRIES * sizeof(*fat), iters, now() - start,
+		       sink);
+
+		start = now();
+		for (i = 0; i < iters; i++)
+			sink = ops->find_zero32(fat, 1, BENCH_FAT_ENTRIES);
+		report("find_zero32", ops->name,
+		       BENCH_FAT_ENTRIES * sizeof(*fat), iters, now() - start,
+		       sink);
+
+		start = now();
+		for (i = 0; i < iters * 100; i++)
+			sink = ops->find_name(rootdir, FS_FILE_MAX_COUNT, key);
+		report("find_name", ops->name,
+		       FS_FILE_MAX_COUNT * sizeof(*rootdir), iters * 100,
+		       now() - start, sink);
+	}
+
+	free(rootdir);
+	free(fat);
+}
+
+/* Fill @buf with log-like text */
+static void fill_log(char *buf, size_t size)
+{
+	static const char *const levels[] = { "INFO", "DEBUG", "WARN" };
+	size_t pos = 0;
+	unsigned int line = 0;
+
+	while (pos < size) {
+		char tmp[128];
+		int n = snprintf(tmp, sizeof(tmp),
+				 "2024-05-%02u 12:%02u:%02u %s request id=%u "
+				 "served in %u ms\n", line / 86400 % 28 + 1,
+				 line / 60 % 60, line % 60, levels[line % 3],
+				 line * 7919 % 100000, line * 31 % 500);
+		size_t len = n < (int)(size - pos) ? (size_t)n : size - pos;
+
+		memcpy(buf + pos, tmp, len);
+		pos += len;
+		line++;
+	}
+}
+
+/* Write then read back @size bytes of @buf as file @name */
+static void bench_file(const char *name, int compress, char *buf,
+		       size_t size)
+{
+	struct fs_compression_stats stats;
+	double start, wsecs, rsecs;
+	int fd;
+
+	if (fs_create(name) || fs_set_compression(name, compress))
+		die("Cannot create file");
+	fd = fs_open(name);
+	if (fd < 0)
+		die("Cannot open file");
+
+	start = now();
+	if (fs_write(fd, buf, size) != (int)size)
+		die("Cannot write file, disk too small?");
+	wsecs = now() - start;
+
+	fs_lseek(fd, 0);
+	start = now();
+	if (fs_read(fd, buf, size) != (int)size)
+		die("Cannot read file");
+	rsecs = now() - start;
+
+	fs_compression_stats(fd, &stats);
+	fs_close(fd);
+	fs_delete(name);
+
+	printf("%-10s write %8.1f MB/s  read %8.1f MB/s  %zu/%zu blocks\n",
+	       compress ? "compressed" : "plain", size / wsecs / 1e6,
+	       size / rsecs / 1e6, stats.stored_blocks, stats.data_blocks);
+}
+
+static void bench_compress(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t size = 16 << 20;
+	char *buf;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [MiB]");
+	if (b_arg->argc > 1)
+		size = strtoul(b_arg->argv[1], NULL, 0) << 20;
+	if (!size)
+		die("Usage: <diskname> [MiB]");
+
+	buf = malloc(size);
+	if (!buf)
+		die("Cannot malloc");
+	fill_log(buf, size);
+
+	if (fs_mount(b_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	printf("%zu MiB of log text\n", size >> 20);
+	bench_file("bench_plain", 0, buf, size);
+	bench_file("bench_lz", 1, buf, size);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(buf);
+}
+
+/* Number of data blocks in use on the mounted disk */
+static size_t used_blocks(void)
+{
+	return superblock.num_data_blks -
+	       simd_ops()->count_zero32(fat, superblock.num_data_blks);
+}
+
+/* Write @copies variants of @base, each with a few blocks of its own */
+static void bench_ingest(int dedup, const char *base, char *buf, size_t size,
+			 int copies)
+{
+	size_t before = used_blocks();
+	double start = now();
+	char name[FS_FILENAME_LEN];
+
+	for (int i = 0; i < copies; i++) {
+		int fd;
+
+		memcpy(buf, base, size);
+		for (size_t off = i * BLOCK_SIZE; off < size; off += size / 4)
+			buf[off] ^= 0xff;
+
+		snprintf(name, sizeof(name), "copy%d", i);
+		if (fs_create(name) || fs_set_dedup(name, dedup))
+			die("Cannot create file");
+		fd = fs_open(name);
+		if (fd < 0)
+			die("Cannot open file");
+		if (fs_write(fd, buf, size) != (int)size)
+			die("Cannot write file, disk too small?");
+		fs_close(fd);
+	}
+
+	printf("%-6s write %8.1f MB/s  %zu blocks used for %zu blocks of data\n",
+	       dedup ? "dedup" : "plain", size * copies / (now() - start) / 1e6,
+	       used_blocks() - before, size * copies / BLOCK_SIZE);
+
+	for (int i = 0; i < copies; i++) {
+		snprintf(name, sizeof(name), "copy%d", i);
+		fs_delete(name);
+	}
+}
+
+static void bench_dedup(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t size = 4 << 20;
+	int copies = 8;
+	char *base, *buf;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [copies]");
+	if (b_arg->argc > 1)
+		copies = atoi(b_arg->argv[1]);
+	if (copies <= 0)
+		die("Usage: <diskname> [copies]");
+
+	base = malloc(size);
+	buf = malloc(size);
+	if (!base || !buf)
+		die("Cannot malloc");
+	for (size_t i = 0; i < size; i++)
+		base[i] = rand();
+
+	if (fs_mount(b_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	printf("%d copies of a %zu MiB artifact\n", copies, size >> 20);
+	bench_ingest(0, base, buf, size, copies);
+	bench_ingest(1, base, buf, size, copies);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(buf);
+	free(base);
+}
+
+/* Small files, packed on a disk made with fs_make -P */
+static void bench_small(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	int count = 100, rounds = 100;
+	char name[FS_FILENAME_LEN];
+	char buf[PACK_MAX_SIZE];
+	size_t before, bytes = 0;
+	double start;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [files]");
+	if (b_arg->argc > 1)
+		count = atoi(b_arg->argv[1]);
+	if (count <= 0)
+		die("Usage: <diskname> [files]");
+
+	if (fs_mount(b_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	before = used_blocks();
+	for (int i = 0; i < count; i++) {
+		int len = 16 + rand() % (PACK_MAX_SIZE - 16);
+		int fd;
+
+		memset(buf, 'a' + i % 26, len);
+		snprintf(name, sizeof(name), "small%d", i);
+		if (fs_create(name))
+			die("Cannot create file");
+		fd = fs_open(name);
+		if (fd < 0)
+			die("Cannot open file");
+		if (fs_write(fd, buf, len) != len)
+			die("Cannot write file, disk too small?");
+		fs_close(fd);
+		bytes += len;
+	}
+	printf("%d files, %zu bytes: %zu blocks used\n", count, bytes,
+	       used_blocks() - before);
+
+	start = now();
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < count; i++) {
+			int fd;
+
+			snprintf(name, sizeof(name), "small%d", i);
+			fd = fs_open(name);
+			if (fd < 0 || fs_read(fd, buf, sizeof(buf)) < 0)
+				die("Cannot read file");
+			fs_close(fd);
+		}
+	}
+	printf("read %8.0f files/s\n", count * rounds / (now() - start));
+
+	for (int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "small%d", i);
+		fs_delete(name);
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+static void bench_dir(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	int count = 10000;
+	char name[FS_FILENAME_LEN];
+	double start;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [files]");
+	if (b_arg->argc > 1)
+		count = atoi(b_arg->argv[1]);
+	if (count <= 0)
+		die("Usage: <diskname> [files]");
+
+	if (fs_mount(b_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	start = now();
+	for (int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "dir%d", i);
+		if (fs_create(name))
+			die("Cannot create file, disk too small?");
+	}
+	printf("create %8.0f files/s (%u directory entries)\n",
+	       count / (now() - start), rootdir_count);
+
+	start = now();
+	for (int i = 0; i < count; i++) {
+		int fd;
+
+		snprintf(name, sizeof(name), "dir%d", (i * 7919) % count);
+		fd = fs_open(name);
+		if (fd < 0)
+			die("Cannot open file");
+		fs_close(fd);
+	}
+	printf("lookup %8.0f files/s\n", count / (now() - start));
+
+	start = now();
+	for (int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "dir%d", i);
+		if (fs_delete(name))
+			die("Cannot delete file");
+	}
+	printf("delete %8.0f files/s\n", count / (now() - start));
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/*
+ * Throughput of the CRC32C implementations on blocks, then of plain file I/O
+ * on a disk, to be compared between disks made with and without checksums
+ */
+static void bench_csum(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t iters = 200000;
+	size_t size = 64 << 20;
+	uint8_t *block;
+	char *buf;
+
+	block = malloc(BLOCK_SIZE);
+	if (!block)
+		die("Cannot malloc");
+	for (size_t i = 0; i < BLOCK_SIZE; i++)
+		block[i] = i * 7919 >> 3;
+
+	for (int level = 0; level < CRC_NR_LEVELS; level++) {
+		const struct crc_ops *ops = crc_ops_level(level);
+		double start;
+
+		if (!ops) {
+			printf("%-14s %-7s unsupported\n", "-", "-");
+			continue;
+		}
+
+		start = now();
+		for (size_t i = 0; i < iters; i++)
+			sink = ops->crc32c(0, block, BLOCK_SIZE);
+		report("crc32c", ops->name, BLOCK_SIZE, iters, now() - start,
+		       sink);
+	}
+	free(block);
+
+	if (b_arg->argc < 1)
+		return;
+	if (b_arg->argc > 1)
+		size = strtoul(b_arg->argv[1], NULL, 0) << 20;
+	if (!size)
+		die("Usage: [<diskname> [MiB]]");
+
+	buf = malloc(size);
+	if (!buf)
+		die("Cannot malloc");
+	fill_log(buf, size);
+
+	if (fs_mount(b_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	printf("%zu MiB file, block checksums %s\n", size >> 20,
+	       superblock.csum_blk_index ? "on" : "off");
+	bench_file("bench_csum", 0, buf, size);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(buf);
+}
+
+/* Evict the file @name from the page cache */
+static void drop_cache(const char *name)
+{
+	int fd = open(name, O_RDONLY);
+
+	if (fd < 0)
+		die("Cannot open %s", name);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+/* Read a whole disk in requests of a full stripe row, at least 1 MiB */
+static void bench_stripe(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	const char *const *disknames;
+	size_t stripe, count, chunk;
+	int ndisks;
+	double start, secs;
+	char *buf;
+
+	if (b_arg->argc < 2)
+		die("Usage: <stripe KiB> <diskname>...");
+	stripe = strtoul(b_arg->argv[0], NULL, 0) * 1024 / BLOCK_SIZE;
+	disknames = (const char *const *)&b_arg->argv[1];
+	ndisks = b_arg->argc - 1;
+	if (!stripe)
+		die("Usage: <stripe KiB> <diskname>...");
+
+	for (int i = 0; i < ndisks; i++)
+		drop_cache(disknames[i]);
+
+	if (block_disk_open_striped(disknames, ndisks, stripe))
+		die("Cannot open the disk");
+	count = block_disk_count();
+	chunk = stripe * ndisks;
+	if (chunk < (1 << 20) / BLOCK_SIZE)
+		chunk = (1 << 20) / BLOCK_SIZE;
+	buf = malloc(chunk * BLOCK_SIZE);
+	if (!buf)
+		die("Cannot malloc");
+
+	start = now();
+	for (size_t block = 0; block < count; block += chunk) {
+		size_t n = count - block < chunk ? count - block : chunk;
+
+		if (block_read_range(block, n, buf))
+			die("Cannot read blocks %zu+%zu", block, n);
+	}
+	secs = now() - start;
+
+	printf("%d file(s), stripe of %zu blocks: %zu MiB read in %.2f s, "
+	       "%.1f MB/s\n", ndisks, stripe, count * BLOCK_SIZE >> 20, secs,
+	       count * BLOCK_SIZE / secs / 1e6);
+
+	block_disk_close();
+	free(buf);
+}
+
+/*
+ * Create, write, read back and delete files, @rounds times, mounted with
+ * @mount
+ */
+static double bench_memory_run(int (*mount)(const char *),
+			       const char *diskname, int count, int rounds,
+			       char *buf, size_t size)
+{
+	char name[FS_FILENAME_LEN];
+	double start = now();
+
+	if (mount(diskname))
+		die("Cannot mount diskname");
+
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < count; i++) {
+			int fd;
+
+			snprintf(name, sizeof(name), "mem%d", i);
+			if (fs_create(name))
+				die("Cannot create file");
+			fd = fs_open(name);
+			if (fd < 0)
+				die("Cannot open file");
+			if (fs_write(fd, buf, size) != (int)size)
+				die("Cannot write file, disk too small?");
+			fs_close(fd);
+		}
+		for (int i = 0; i < count; i++) {
+			int fd;
+
+			snprintf(name, sizeof(name), "mem%d", i);
+			fd = fs_open(name);
+			if (fd < 0 || fs_read(fd, buf, size) != (int)size)
+				die("Cannot read file");
+			fs_close(fd);
+		}
+		for (int i = 0; i < count; i++) {
+			snprintf(name, sizeof(name), "mem%d", i);
+			if (fs_delete(name))
+				die("Cannot delete file");
+		}
+	}
+
+	/* Writing everything back is part of the cost */
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	return now() - start;
+}
+
+/* The same workload on a disk accessed block by block, and held in memory */
+static void bench_memory(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t size = 16 * BLOCK_SIZE;
+	int count = 1000, rounds = 10;
+	double secs;
+	char *buf;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [files]");
+	if (b_arg->argc > 1)
+		count = atoi(b_arg->argv[1]);
+	if (count <= 0)
+		die("Usage: <diskname> [files]");
+
+	buf = malloc(size);
+	if (!buf)
+		die("Cannot malloc");
+	memset(buf, 'm', size);
+
+	secs = bench_memory_run(fs_mount, b_arg->argv[0], count, rounds, buf,
+				size);
+	printf("on disk   %8.0f files/s\n", count * rounds / secs);
+	secs = bench_memory_run(fs_mount_memory, b_arg->argv[0], count, rounds,
+				buf, size);
+	printf("in memory %8.0f files/s\n", count * rounds / secs);
+
+	free(buf);
+}
+
+struct sched_arg {
+	size_t first;
+	size_t stride;
+	size_t count;
+};
+
+/* Read @count blocks one by one, @stride blocks apart */
+static void *sched_reader(void *arg)
+{
+	struct sched_arg *s_arg = arg;
+	char buf[BLOCK_SIZE];
+
+	for (size_t i = 0; i < s_arg->count; i++) {
+		size_t block = s_arg->first + i * s_arg->stride;
+
+		if (block_read(block, buf))
+			die("Cannot read block %zu", block);
+	}
+	return NULL;
+}
+
+/*
+ * Threads reading the disk block by block out of the page cache, each its own
+ * region or interleaved, with and without the request scheduler
+ */
+static void bench_sched(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	struct sched_arg s_args[64];
+	pthread_t threads[64];
+	unsigned int windows[2] = { 0, 200 };
+	int nthreads = 8;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [threads] [window us]");
+	if (b_arg->argc > 1)
+		nthreads = atoi(b_arg->argv[1]);
+	if (b_arg->argc > 2)
+		windows[1] = atoi(b_arg->argv[2]);
+	if (nthreads <= 0 || nthreads > 64 || !windows[1])
+		die("Usage: <diskname> [threads] [window us]");
+
+	for (int run = 0; run < 4; run++) {
+		int interleaved = run / 2;
+		unsigned int window = windows[run % 2];
+		struct block_sched_stats stats;
+		double start, secs;
+		size_t count;
+
+		drop_cache(b_arg->argv[0]);
+		if (block_disk_open(b_arg->argv[0]))
+			die("Cannot open the disk");
+		block_sched_set(window);
+		count = block_disk_count() / nthreads;
+
+		start = now();
+		for (int i = 0; i < nthreads; i++) {
+			s_args[i].first = interleaved ? i : i * count;
+			s_args[i].stride = interleaved ? nthreads : 1;
+			s_args[i].count = count;
+			if (pthread_create(&threads[i], NULL, sched_reader,
+					   &s_args[i]))
+				die("Cannot start thread");
+		}
+		for (int i = 0; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+		secs = now() - start;
+
+		block_sched_stats(&stats);
+		printf("%-11s window %4u us: %8.1f MB/s",
+		       interleaved ? "interleaved" : "regions", window,
+		       count * nthreads * BLOCK_SIZE / secs / 1e6);
+		if (stats.batches)
+			printf(", depth %.1f (max %zu), %.0f%% merged, "
+			       "%zu expired", (double)stats.requests /
+			       stats.batches, stats.max_depth, 100.0 *
+			       (stats.requests - stats.transfers) /
+			       stats.requests, stats.expired);
+		printf("\n");
+		block_disk_close();
+	}
+}
+
+static struct {
+	const char *name;
+	void(*func)(void *);
+} commands[] = {
+	{ "scan",	bench_scan },
+	{ "compress",	bench_compress },
+	{ "dedup",	bench_dedup },
+	{ "small",	bench_small },
+	{ "dir",	bench_dir },
+	{ "csum",	bench_csum },
+	{ "stripe",	bench_stripe },
+	{ "memory",	bench_memory },
+	{ "sched",	bench_sched },
+};
+
+static void usage(char *program)
+{
+	size_t i;
+	fprintf(stderr, "Usage: %s <benchmark> [<arg>]\n", program);
+	fprintf(stderr, "Possible benchmarks are:\n");
+	for (i = 0; i < ARRAY_SIZE(commands); i++)
+		fprintf(stderr, "\t%s\n", commands[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+	char *program;
+	char *cmd;
+	struct bench_arg arg;
+
+	program = argv[0];
+
+	if (argc == 1)
+		usage(program);
+
+	/* Skip argv[0] */
+	argc--;
+	argv++;
+
+	cmd = argv[0];
+	arg.argc = --argc;
+	arg.argv = &argv[1];
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(cmd, commands[i].name)) {
+			commands[i].func(&arg);
+			break;
+		}
+	}
+	if (i == ARRAY_SIZE(commands)) {
+		fs_bench_error("invalid benchmark '%s'", cmd);
+		usage(program);
+	}
+
+	return 0;
+}
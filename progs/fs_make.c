@@ -0,0 +1,401 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs_format.h>
+
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+#define fs_make_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_make_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+_Static_assert(sizeof(struct SuperblockV1) == BLOCK_SIZE,
+	       "superblock must span exactly one block");
+_Static_assert(sizeof(struct Superblock) == BLOCK_SIZE,
+	       "superblock must span exactly one block");
+_Static_assert(sizeof(struct RootDirV1) * FS_FILE_MAX_COUNT == BLOCK_SIZE,
+	       "root directory must span exactly one block");
+_Static_assert(sizeof(struct RootDir) * FS_FILE_MAX_COUNT == BLOCK_SIZE,
+	       "root directory must span exactly one block");
+
+static size_t fat_entries_per_block(int version)
+{
+	return version == 1 ? FAT_ENTRIES_PER_BLOCK : FAT_ENTRIES_PER_BLOCK_V2;
+}
+
+static size_t max_data_blocks(int version)
+{
+	return version == 1 ? FS_MAX_DATA_BLOCKS : FS_MAX_DATA_BLOCKS_V2;
+}
+
+/* Layout of a new file system, computed from its data cluster count */
+struct layout {
+	int version;
+	int cluster_shift;
+	size_t data_blocks;
+	size_t fat_blocks;
+	/* Checksum region, 0 blocks if the blocks have no checksum */
+	size_t csum_block;
+	size_t csum_blocks;
+	size_t rdir_block;
+	size_t data_start;
+	size_t total_blocks;
+	/* Small files packed into shared blocks */
+	int pack;
+};
+
+static void compute_layout(struct layout *l, size_t data_blocks, int version,
+			   int cluster_shift, int csum)
+{
+	l->version = version;
+	l->cluster_shift = cluster_shift;
+	l->data_blocks = data_blocks;
+	l->fat_blocks = DIV_ROUND_UP(data_blocks,
+				     fat_entries_per_block(version));
+	/*
+	 * Superblock is block #0, followed by the FAT, the checksums of the
+	 * following blocks and the root directory
+	 */
+	l->csum_block = 1 + l->fat_blocks;
+	l->csum_blocks = csum ? DIV_ROUND_UP(1 + (data_blocks << cluster_shift),
+					     CSUM_ENTRIES_PER_BLOCK) : 0;
+	l->rdir_block = l->csum_block + l->csum_blocks;
+	l->data_start = l->rdir_block + 1;
+	l->total_blocks = l->data_start + (data_blocks << cluster_shift);
+}
+
+/*
+ * Find the largest data cluster count whose complete layout fits in
+ * @total_blocks blocks
+ */
+static size_t data_blocks_for_size(size_t total_blocks, int version,
+				   int cluster_shift, int csum)
+{
+	size_t max = max_data_blocks(version);
+	struct layout l;
+	size_t n;
+
+	if (total_blocks < 4)
+		return 0;
+
+	n = total_blocks - 2 -
+	    DIV_ROUND_UP(total_blocks, fat_entries_per_block(version));
+	if (csum)
+		n -= DIV_ROUND_UP(total_blocks, CSUM_ENTRIES_PER_BLOCK);
+	n >>= cluster_shift;
+	if (n > max)
+		n = max;
+
+	compute_layout(&l, n + 1, version, cluster_shift, csum);
+	while (n < max && l.total_blocks <= total_blocks) {
+		n++;
+		compute_layout(&l, n + 1, version, cluster_shift, csum);
+	}
+
+	return n;
+}
+
+/* Parse a byte size with an optional K, M or G suffix */
+static size_t parse_size(const char *str)
+{
+	char *end;
+	unsigned long long size;
+
+	errno = 0;
+	size = strtoull(str, &end, 0);
+	if (errno || end == str)
+		die("invalid size '%s'", str);
+
+	switch (*end) {
+	case 'g': case 'G':
+		size <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		size <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		size <<= 10;
+		end++;
+		break;
+	}
+	if (*end != '\0')
+		die("invalid size '%s'", str);
+
+	return (size_t)size;
+}
+
+/*
+ * Number of the @total_blocks blocks of a disk striped over @count members by
+ * units of @stripe blocks that member @member holds
+ */
+static size_t member_blocks(size_t total_blocks, int count, size_t stripe,
+			    int member)
+{
+	size_t row = count * stripe;
+	size_t rest = total_blocks % row;
+	size_t start = member * stripe;
+
+	return total_blocks / row * stripe +
+	       (rest <= start ? 0 : rest - start < stripe ? rest - start : stripe);
+}
+
+/*
+ * Create the image sparsely: only the superblock and the first FAT block hold
+ * non-zero content, every other block (rest of the FAT, checksums, root
+ * directory, data blocks) is left as a hole that reads back as zeros. Blocks of
+ * zeros have a zero checksum. A striped image is made of @count files.
+ */
+static void make_disk(const char *const *disknames, int count, size_t stripe,
+		      const struct layout *l, int prealloc)
+{
+	struct SuperblockV1 sb1;
+	struct Superblock sb;
+	uint8_t fat[BLOCK_SIZE];
+	int fd, ret;
+
+	for (int i = 0; i < count; i++) {
+		off_t size = (off_t)member_blocks(l->total_blocks, count,
+						  stripe, i) * BLOCK_SIZE;
+
+		fd = open(disknames[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			die_perror("open");
+
+		if (ftruncate(fd, size))
+			die_perror("ftruncate");
+
+		if (prealloc) {
+			/* Reserve the extents up front without writing the
+			 * data */
+			ret = posix_fallocate(fd, 0, size);
+			if (ret) {
+				errno = ret;
+				die_perror("posix_fallocate");
+			}
+		}
+
+		if (close(fd))
+			die_perror("close");
+	}
+
+	if (block_disk_open_striped(disknames, count, stripe))
+		die("cannot open the image");
+
+	if (l->version == 1) {
+		memset(&sb1, 0, sizeof(sb1));
+		memcpy(sb1.signature, SIGNATURE, SIGNATURELENGTH);
+		sb1.total_blocks = l->total_blocks;
+		sb1.root_dir_blk_index = l->rdir_block;
+		sb1.data_blk_start_index = l->data_start;
+		sb1.num_data_blks = l->data_blocks;
+		sb1.num_blk_FAT = l->fat_blocks;
+		if (block_write(0, &sb1))
+			die("cannot write the superblock");
+	} else {
+		memset(&sb, 0, sizeof(sb));
+		memcpy(sb.signature, SIGNATURE_V2, SIGNATURELENGTH);
+		sb.total_blocks = l->total_blocks;
+		sb.root_dir_blk_index = l->rdir_block;
+		sb.data_blk_start_index = l->data_start;
+		sb.num_data_blks = l->data_blocks;
+		sb.num_blk_FAT = l->fat_blocks;
+		sb.version = 2;
+		sb.cluster_shift = l->cluster_shift;
+		sb.csum_blk_index = l->csum_blocks ? l->csum_block : 0;
+		sb.num_blk_csum = l->csum_blocks;
+		sb.pack = l->pack;
+		/* The geometry is checked when mounting, see fs_mount_striped() */
+		if (count > 1) {
+			sb.stripe_blocks = stripe;
+			sb.stripe_count = count;
+		}
+		if (block_write(0, &sb))
+			die("cannot write the superblock");
+	}
+
+	/* FAT entry #0 is always invalid */
+	memset(fat, 0, sizeof(fat));
+	if (l->version == 1) {
+		uint16_t eoc = FAT_EOC_V1;
+		memcpy(fat, &eoc, sizeof(eoc));
+	} else {
+		uint32_t eoc = FAT_EOC;
+		memcpy(fat, &eoc, sizeof(eoc));
+	}
+	if (block_write(1, fat))
+		die("cannot write the FAT");
+
+	if (block_disk_close())
+		die("cannot close the image");
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [-kpP] [-v <version>] [-c <cluster size>] "
+		"<diskname> <data cluster count>\n", program);
+	fprintf(stderr, "       %s [-kpP] [-v <version>] [-c <cluster size>] "
+		"-s <size> <diskname>\n", program);
+	fprintf(stderr, "       %s [options] -S <stripe size> <diskname>... "
+		"<data cluster count>\n", program);
+	fprintf(stderr, "       %s [options] -S <stripe size> -s <size> "
+		"<diskname>...\n", program);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "\t-c\tallocate plain files by clusters of <cluster "
+		"size> bytes,\n\t\ta power of two from 4K to 64K (version 2 "
+		"only)\n");
+	fprintf(stderr, "\t-k\tkeep a CRC32C checksum of each block, "
+		"verified on reads\n\t\t(version 2 only)\n");
+	fprintf(stderr, "\t-p\tpreallocate the whole image on the host\n");
+	fprintf(stderr, "\t-P\tpack files of up to %d bytes into shared "
+		"blocks\n\t\t(version 2 only, without clusters)\n",
+		PACK_MAX_SIZE);
+	fprintf(stderr, "\t-s\tsize the image to fit in <size> bytes "
+		"(K, M and G suffixes accepted)\n");
+	fprintf(stderr, "\t-S\tstripe the image over the <diskname> files "
+		"by units of\n\t\t<stripe size> bytes (see "
+		"fs_mount_striped()), version 2 only\n");
+	fprintf(stderr, "\t-v\tformat version, 1 (16-bit block indices) or 2 "
+		"(32-bit);\n\t\tby default 1, unless the image is too large "
+		"for it\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct layout l;
+	const char *program = argv[0];
+	const char *const *disknames;
+	const char *diskname;
+	size_t size = 0, cluster = BLOCK_SIZE, stripe = 0, data_blocks;
+	int ndisks = 1;
+	int prealloc = 0;
+	int csum = 0;
+	int pack = 0;
+	int version = 0;
+	int cluster_shift = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:kpPs:S:v:")) != -1) {
+		switch (opt) {
+		case 'c':
+			cluster = parse_size(optarg);
+			break;
+		case 'k':
+			csum = 1;
+			break;
+		case 'p':
+			prealloc = 1;
+			break;
+		case 'P':
+			pack = 1;
+			break;
+		case 's':
+			size = parse_size(optarg);
+			break;
+		case 'S':
+			stripe = parse_size(optarg);
+			if (!stripe || stripe % BLOCK_SIZE ||
+			    stripe / BLOCK_SIZE > UINT32_MAX)
+				die("invalid stripe size '%s', expected a "
+				    "multiple of %d", optarg, BLOCK_SIZE);
+			break;
+		case 'v':
+			version = atoi(optarg);
+			if (version != 1 && version != 2)
+				die("invalid version '%s'", optarg);
+			break;
+		default:
+			usage(program);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	/* Several disk names when striped */
+	if (stripe)
+		ndisks = argc - (size ? 0 : 1);
+	if (ndisks < 1 || argc != ndisks + (size ? 0 : 1))
+		usage(program);
+
+	while (cluster_shift <= FS_MAX_CLUSTER_SHIFT &&
+	       ((size_t)BLOCK_SIZE << cluster_shift) != cluster)
+		cluster_shift++;
+	if (cluster_shift > FS_MAX_CLUSTER_SHIFT)
+		die("invalid cluster size %zu, expected a power of two from %d "
+		    "to %d", cluster, BLOCK_SIZE,
+		    BLOCK_SIZE << FS_MAX_CLUSTER_SHIFT);
+	if (cluster_shift && version == 1)
+		die("clusters need version 2");
+	if (csum && version == 1)
+		die("checksums need version 2");
+	if (ndisks > 1 && version == 1)
+		die("striping needs version 2");
+	if (pack && version == 1)
+		die("packing needs version 2");
+	if (pack && cluster_shift)
+		die("packing needs clusters of %d bytes", BLOCK_SIZE);
+	if (cluster_shift || csum || ndisks > 1 || pack)
+		version = 2;
+
+	disknames = (const char *const *)argv;
+	diskname = argv[0];
+	if (size) {
+		/* Version 2 only when the image would not fit in version 1 */
+		if (!version) {
+			size_t blocks = size / BLOCK_SIZE;
+
+			version = data_blocks_for_size(blocks, 1, 0, 0) <
+				  data_blocks_for_size(blocks, 2, 0, 0) ? 2 : 1;
+		}
+		data_blocks = data_blocks_for_size(size / BLOCK_SIZE, version,
+						   cluster_shift, csum);
+	} else {
+		char *end;
+		long n = strtol(argv[ndisks], &end, 0);
+		data_blocks = (n < 0 || *end != '\0') ? 0 : (size_t)n;
+		if (!version)
+			version = data_blocks > FS_MAX_DATA_BLOCKS ? 2 : 1;
+	}
+
+	if (data_blocks < 1 || data_blocks > max_data_blocks(version))
+		die("data cluster count invalid, range is [1, %zu]",
+		    max_data_blocks(version));
+
+	compute_layout(&l, data_blocks, version, cluster_shift, csum);
+	l.pack = pack;
+	if (l.total_blocks > INT32_MAX)
+		die("image too large, at most %d blocks", INT32_MAX);
+	make_disk(disknames, ndisks, stripe ? stripe / BLOCK_SIZE : 1, &l,
+		  prealloc);
+
+	if (cluster_shift)
+		printf("Created virtual disk '%s' with '%zu' data clusters of "
+		       "%zu bytes\n", diskname, data_blocks, cluster);
+	else
+		printf("Created virtual disk '%s' with '%zu' data blocks\n",
+		       diskname, data_blocks);
+	if (ndisks > 1)
+		printf("Striped over %d files by units of %zu bytes\n", ndisks,
+		       stripe);
+
+	return 0;
+}
@@ -0,0 +1,196 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fsd_client.h"
+
+/*
+ * Counterpart of test_fs.x working through a file system daemon (fsd.x)
+ * instead of mounting the disk itself.
+ */
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define fsc_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fsc_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+static void fsc_cmd_ls(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	if (fsc_ls())
+		die("Cannot list files");
+}
+
+static void fsc_cmd_add(int argc, char **argv)
+{
+	char *filename, *buf = NULL;
+	int fd, fs_fd;
+	struct stat st;
+	int written;
+
+	if (argc < 1)
+		die("need <host filename>");
+	filename = argv[0];
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", filename);
+	if (st.st_size) {
+		buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED)
+			die_perror("mmap");
+	}
+
+	if (fsc_create(filename))
+		die("Cannot create file");
+	fs_fd = fsc_open(filename);
+	if (fs_fd < 0)
+		die("Cannot open file");
+	written = fsc_write(fs_fd, buf, st.st_size);
+	if (fsc_close(fs_fd))
+		die("Cannot close file");
+
+	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
+	       (size_t)st.st_size);
+
+	if (buf)
+		munmap(buf, st.st_size);
+	close(fd);
+}
+
+static void fsc_cmd_cat(int argc, char **argv)
+{
+	char *filename, *buf;
+	int fs_fd;
+	int stat, read;
+
+	if (argc < 1)
+		die("need <filename>");
+	filename = argv[0];
+
+	fs_fd = fsc_open(filename);
+	if (fs_fd < 0)
+		die("Cannot open file");
+	stat = fsc_stat(fs_fd);
+	if (stat < 0)
+		die("Cannot stat file");
+	if (!stat) {
+		/* Nothing to read, file is empty */
+		printf("Empty file\n");
+		return;
+	}
+	buf = malloc(stat);
+	if (!buf)
+		die("Cannot malloc");
+
+	read = fsc_read(fs_fd, buf, stat);
+	if (fsc_close(fs_fd))
+		die("Cannot close file");
+
+	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
+	printf("Content of the file:\n");
+	fwrite(buf, 1, stat, stdout);
+	fflush(stdout);
+
+	free(buf);
+}
+
+static void fsc_cmd_rm(int argc, char **argv)
+{
+	if (argc < 1)
+		die("need <filename>");
+
+	if (fsc_delete(argv[0]))
+		die("Cannot delete file");
+
+	printf("Removed file '%s'\n", argv[0]);
+}
+
+static void fsc_cmd_stat(int argc, char **argv)
+{
+	int fs_fd;
+	int stat;
+
+	if (argc < 1)
+		die("need <filename>");
+
+	fs_fd = fsc_open(argv[0]);
+	if (fs_fd < 0)
+		die("Cannot open file");
+	stat = fsc_stat(fs_fd);
+	if (stat < 0)
+		die("Cannot stat file");
+	if (fsc_close(fs_fd))
+		die("Cannot close file");
+
+	printf("Size of file '%s' is %d bytes\n", argv[0], stat);
+}
+
+static struct {
+	const char *name;
+	void (*func)(int, char **);
+} commands[] = {
+	{ "ls",		fsc_cmd_ls },
+	{ "add",	fsc_cmd_add },
+	{ "rm",		fsc_cmd_rm },
+	{ "cat",	fsc_cmd_cat },
+	{ "stat",	fsc_cmd_stat },
+};
+
+static void usage(const char *program)
+{
+	size_t i;
+
+	fprintf(stderr, "Usage: %s <socket path> <command> [<arg>]\n",
+		program);
+	fprintf(stderr, "Possible commands are:\n");
+	for (i = 0; i < ARRAY_SIZE(commands); i++)
+		fprintf(stderr, "\t%s\n", commands[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+
+	if (argc < 3)
+		usage(argv[0]);
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(argv[2], commands[i].name))
+			break;
+	}
+	if (i == ARRAY_SIZE(commands)) {
+		fsc_error("invalid command '%s'", argv[2]);
+		usage(argv[0]);
+	}
+
+	if (fsc_connect(argv[1]))
+		die("Cannot connect to '%s'", argv[1]);
+	commands[i].func(argc - 3, argv + 3);
+	fsc_disconnect();
+
+	return 0;
+}
@@ -0,0 +1,478 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#include "fsd_proto.h"
+
+/*
+ * File system daemon: mounts a disk once and serves the requests of any number
+ * of local clients (see fsd_proto.h), so that they can share the disk. A
+ * single thread runs a poll() loop, hence the calls to the library never run
+ * concurrently. The requests received from all the clients ready in a round
+ * are served first, then the replies of each client are sent at once. The
+ * blocks of deleted files are reclaimed in batches while no request is
+ * pending.
+ */
+
+#define fsd_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fsd_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Requests received in one go from a client */
+#define FSD_BATCH 64
+
+/* Stop reading the requests of a client that does not read its replies */
+#define FSD_MAX_PENDING 4096
+
+/* Blocks reclaimed at a time, and idle time before doing so (ms) */
+#define FSD_RECLAIM_BATCH 4096
+#define FSD_RECLAIM_IDLE 10
+
+struct client {
+	int sock;
+	/* Unique identifier, owner of the descriptors opened by the client */
+	unsigned int id;
+	/* Shared memory region, NULL until the hello is received */
+	uint8_t *shm;
+	size_t shm_size;
+	/* Partially received requests */
+	uint8_t in[FSD_BATCH * sizeof(struct fsd_request)];
+	size_t in_len;
+	/* Replies not sent yet */
+	struct fsd_reply *out;
+	size_t out_len, out_sent, out_cap;
+};
+
+static struct client **clients;
+static size_t nclients;
+static unsigned int next_id = 1;
+
+/* Client owning each descriptor, 0 if none */
+static unsigned int *fd_owner;
+static size_t fd_owner_cap;
+
+static volatile sig_atomic_t quit;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	quit = 1;
+}
+
+static int fd_owned(int fd, unsigned int id)
+{
+	return fd >= 0 && (size_t)fd < fd_owner_cap && fd_owner[fd] == id;
+}
+
+static int fd_own(int fd, unsigned int id)
+{
+	if ((size_t)fd >= fd_owner_cap) {
+		size_t cap = fd_owner_cap ? fd_owner_cap : FS_OPEN_MAX_COUNT;
+		unsigned int *owner;
+
+		while (cap <= (size_t)fd)
+			cap *= 2;
+		owner = realloc(fd_owner, cap * sizeof(*owner));
+		if (!owner)
+			return -1;
+		memset(owner + fd_owner_cap, 0,
+		       (cap - fd_owner_cap) * sizeof(*owner));
+		fd_owner = owner;
+		fd_owner_cap = cap;
+	}
+	fd_owner[fd] = id;
+	return 0;
+}
+
+/* Whether @count bytes at @offset lie in the shared memory region of @c */
+static int shm_valid(const struct client *c, uint64_t offset, uint64_t count)
+{
+	return offset <= c->shm_size && count <= c->shm_size - offset;
+}
+
+static int32_t serve_ls(struct client *c, const struct fsd_request *req)
+{
+	struct fsd_dirent *dirents;
+	struct fs_dirent ent;
+	size_t pos;
+	uint32_t n = 0;
+
+	if (req->fd < 0 ||
+	    !shm_valid(c, req->offset, (uint64_t)req->count * sizeof(*dirents)))
+		return -1;
+	dirents = (struct fsd_dirent *)(c->shm + req->offset);
+
+	/* One at a time, the position past each file giving its entry */
+	for (pos = req->fd; n < req->count && fs_readdir(&pos, &ent, 1) == 1;
+	     n++) {
+		memcpy(dirents[n].filename, ent.name, FS_FILENAME_LEN);
+		dirents[n].size = ent.size;
+		dirents[n].entry = pos - 1;
+	}
+	return n;
+}
+
+static int32_t serve(struct client *c, const struct fsd_request *req)
+{
+	char filename[FS_FILENAME_LEN + 1];
+	int ret;
+
+	memcpy(filename, req->filename, FS_FILENAME_LEN);
+	filename[FS_FILENAME_LEN] = '\0';
+
+	switch (req->op) {
+	case FSD_CREATE:
+		return fs_create(filename);
+	case FSD_DELETE:
+		return fs_delete(filename);
+	case FSD_OPEN:
+		ret = fs_open(filename);
+		if (ret >= 0 && fd_own(ret, c->id) < 0) {
+			fs_close(ret);
+			return -1;
+		}
+		return ret;
+	case FSD_LS:
+		return serve_ls(c, req);
+	}
+
+	/* Descriptors can only be used by the client that opened them */
+	if (!fd_owned(req->fd, c->id))
+		return -1;
+
+	switch (req->op) {
+	case FSD_CLOSE:
+		ret = fs_close(req->fd);
+		if (ret == 0)
+			fd_owner[req->fd] = 0;
+		return ret;
+	case FSD_STAT:
+		return fs_stat(req->fd);
+	case FSD_LSEEK:
+		return fs_lseek(req->fd, req->offset);
+	case FSD_READ:
+		if (!shm_valid(c, req->offset, req->count))
+			return -1;
+		return fs_read(req->fd, c->shm + req->offset, req->count);
+	case FSD_WRITE:
+		if (!shm_valid(c, req->offset, req->count))
+			return -1;
+		return fs_write(req->fd, c->shm + req->offset, req->count);
+	default:
+		return -1;
+	}
+}
+
+static int queue_reply(struct client *c, uint32_t seq, int32_t ret)
+{
+	if (c->out_len == c->out_cap) {
+		size_t cap = c->out_cap ? 2 * c->out_cap : FSD_BATCH;
+		struct fsd_reply *out = realloc(c->out, cap * sizeof(*out));
+
+		if (!out)
+			return -1;
+		c->out = out;
+		c->out_cap = cap;
+	}
+	c->out[c->out_len].seq = seq;
+	c->out[c->out_len].ret = ret;
+	c->out_len++;
+	return 0;
+}
+
+/* Send the queued replies of @c, as many as the socket takes */
+static int flush_replies(struct client *c)
+{
+	const uint8_t *data = (const uint8_t *)c->out;
+	size_t len = c->out_len * sizeof(*c->out);
+	ssize_t n;
+
+	while (c->out_sent < len) {
+		n = send(c->sock, data + c->out_sent, len - c->out_sent,
+			 MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		c->out_sent += n;
+	}
+	c->out_len = 0;
+	c->out_sent = 0;
+	return 0;
+}
+
+/* Receive the hello of @c and map its shared memory region */
+static int client_hello(struct client *c)
+{
+	struct fsd_hello hello;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { &hello, sizeof(hello) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr *cmsg;
+	struct stat st;
+	void *shm;
+	int fd, seals;
+
+	if (recvmsg(c->sock, &msg, 0) != sizeof(hello) ||
+	    hello.magic != FSD_MAGIC || hello.shm_size == 0)
+		return -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+		return -1;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+	/*
+	 * Accesses past the end of the region's file would kill the daemon
+	 * with SIGBUS: the file must be large enough, and stay so
+	 */
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &st) < 0 ||
+	    (uint64_t)st.st_size < hello.shm_size) {
+		close(fd);
+		return -1;
+	}
+
+	shm = mmap(NULL, hello.shm_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return -1;
+	c->shm = shm;
+	c->shm_size = hello.shm_size;
+	return queue_reply(c, 0, 0);
+}
+
+/* Receive and serve the requests of @c, queueing the replies */
+static int client_input(struct client *c)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	if (!c->shm)
+		return client_hello(c);
+
+	n = recv(c->sock, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+	if (n < 0 && errno == EINTR)
+		return 0;
+	if (n <= 0)
+		return -1;
+	c->in_len += n;
+
+	while (c->in_len - done >= sizeof(struct fsd_request)) {
+		struct fsd_request req;
+
+		memcpy(&req, c->in + done, sizeof(req));
+		done += sizeof(req);
+		if (queue_reply(c, req.seq, serve(c, &req)) < 0)
+			return -1;
+	}
+	memmove(c->in, c->in + done, c->in_len - done);
+	c->in_len -= done;
+	return 0;
+}
+
+static void client_add(int sock)
+{
+	struct client *c = calloc(1, sizeof(*c));
+	struct client **array;
+
+	array = realloc(clients, (nclients + 1) * sizeof(*array));
+	if (!c || !array) {
+		free(c);
+		if (array)
+			clients = array;
+		close(sock);
+		return;
+	}
+	clients = array;
+	c->sock = sock;
+	c->id = next_id++;
+	clients[nclients++] = c;
+}
+
+/* Disconnect client @i, closing the descriptors it left open */
+static void client_remove(size_t i)
+{
+	struct client *c = clients[i];
+
+	for (size_t fd = 0; fd < fd_owner_cap; fd++) {
+		if (fd_owner[fd] == c->id) {
+			fs_close(fd);
+			fd_owner[fd] = 0;
+		}
+	}
+	if (c->shm)
+		munmap(c->shm, c->shm_size);
+	close(c->sock);
+	free(c->out);
+	free(c);
+	clients[i] = clients[--nclients];
+}
+
+static void serve_loop(int listener)
+{
+	struct pollfd *pfds = NULL;
+	size_t pfds_cap = 0;
+	int reclaim = 0;
+
+	while (!quit) {
+		size_t n = nclients;
+		int ready;
+
+		if (pfds_cap < n + 1) {
+			struct pollfd *p = realloc(pfds, (n + 1) * sizeof(*p));
+
+			if (!p)
+				die("Cannot malloc");
+			pfds = p;
+			pfds_cap = n + 1;
+		}
+		pfds[0].fd = listener;
+		pfds[0].events = POLLIN;
+		for (size_t i = 0; i < n; i++) {
+			struct client *c = clients[i];
+
+			pfds[i + 1].fd = c->sock;
+			pfds[i + 1].events = c->out_len ? POLLOUT : 0;
+			if (c->out_len < FSD_MAX_PENDING)
+				pfds[i + 1].events |= POLLIN;
+		}
+
+		ready = poll(pfds, n + 1, reclaim ? FSD_RECLAIM_IDLE : -1);
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+			die_perror("poll");
+		}
+		if (ready == 0) {
+			reclaim = fs_reclaim(FSD_RECLAIM_BATCH) == 1;
+			continue;
+		}
+		/* Requests may queue blocks, check once idle again */
+		reclaim = 1;
+
+		/* Serve every ready client, then send the replies of each at
+		 * once; removals go backwards so that indices remain valid */
+		for (size_t i = n; i-- > 0;) {
+			struct client *c = clients[i];
+			short revents = pfds[i + 1].revents;
+			int err = 0;
+
+			if (revents & POLLIN)
+				err = client_input(c) < 0;
+			else if (revents & (POLLHUP | POLLERR | POLLNVAL))
+				err = 1;
+			if (!err && c->out_len)
+				err = flush_replies(c) < 0;
+			if (err)
+				client_remove(i);
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			int sock = accept(listener, NULL, NULL);
+
+			if (sock >= 0)
+				client_add(sock);
+		}
+	}
+
+	free(pfds);
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [-r] <diskname> <socket path>\n", program);
+	fprintf(stderr, "  -r: serve the disk read-only, alongside other "
+		"read-only mounts\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct sigaction sa = { .sa_handler = on_signal };
+	const char *diskname, *path;
+	int listener, readonly = 0;
+
+	if (argc == 4 && !strcmp(argv[1], "-r")) {
+		readonly = 1;
+		argc--;
+		argv++;
+	}
+	if (argc != 3)
+		usage(argv[0]);
+	diskname = argv[1];
+	path = argv[2];
+	if (strlen(path) >= sizeof(addr.sun_path))
+		die("socket path too long");
+	strcpy(addr.sun_path, path);
+
+	if (readonly ? fs_mount_readonly(diskname) : fs_mount(diskname))
+		die("Cannot mount diskname");
+	fs_set_deferred_free(1);
+
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0)
+		die_perror("socket");
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)))
+		die_perror("bind");
+	if (listen(listener, SOMAXCONN))
+		die_perror("listen");
+
+	/* Interrupt poll() to unmount cleanly */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("Serving '%s' on '%s'\n", diskname, path);
+	fflush(stdout);
+	serve_loop(listener);
+
+	while (nclients)
+		client_remove(nclients - 1);
+	free(clients);
+	free(fd_owner);
+	close(listener);
+	unlink(path);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	return 0;
+}
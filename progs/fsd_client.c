@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fsd_client.h"
+#include "fsd_proto.h"
+
+/* Connection to the daemon, -1 when not connected */
+static int sock = -1;
+static uint8_t *shm;
+static uint32_t seq;
+
+static int send_all(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len > 0) {
+		ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int recv_all(void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len > 0) {
+		ssize_t n = recv(sock, p, len, 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Send a request and wait for its reply */
+static int call(uint32_t op, int fd, const char *filename, uint64_t offset,
+		uint32_t count)
+{
+	struct fsd_request req;
+	struct fsd_reply reply;
+
+	if (sock < 0)
+		return -1;
+
+	memset(&req, 0, sizeof(req));
+	req.seq = ++seq;
+	req.op = op;
+	req.fd = fd;
+	req.count = count;
+	req.offset = offset;
+	if (filename) {
+		/* Longer names are invalid, let the daemon reject them */
+		if (strlen(filename) >= FS_FILENAME_LEN)
+			return -1;
+		strcpy(req.filename, filename);
+	}
+
+	if (send_all(&req, sizeof(req)) < 0 ||
+	    recv_all(&reply, sizeof(reply)) < 0 || reply.seq != req.seq)
+		return -1;
+	return reply.ret;
+}
+
+int fsc_connect(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct fsd_hello hello = { FSD_MAGIC, FSD_SHM_SIZE };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { &hello, sizeof(hello) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr *cmsg;
+	struct fsd_reply reply;
+	int memfd;
+
+	if (sock >= 0 || strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, path);
+
+	memfd = memfd_create("fsd_client", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0)
+		return -1;
+	/* The daemon only maps a region that cannot shrink */
+	if (ftruncate(memfd, FSD_SHM_SIZE) < 0 ||
+	    fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0)
+		goto fail;
+	shm = mmap(NULL, FSD_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   memfd, 0);
+	if (shm == MAP_FAILED) {
+		shm = NULL;
+		goto fail;
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+		goto fail;
+
+	/* The daemon maps the buffer, then acknowledges */
+	memset(&control, 0, sizeof(control));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &memfd, sizeof(memfd));
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(hello) ||
+	    recv_all(&reply, sizeof(reply)) < 0 || reply.ret != 0)
+		goto fail;
+
+	close(memfd);
+	seq = 0;
+	return 0;
+
+fail:
+	if (sock >= 0)
+		close(sock);
+	sock = -1;
+	if (shm)
+		munmap(shm, FSD_SHM_SIZE);
+	shm = NULL;
+	close(memfd);
+	return -1;
+}
+
+int fsc_disconnect(void)
+{
+	if (sock < 0)
+		return -1;
+
+	close(sock);
+	munmap(shm, FSD_SHM_SIZE);
+	sock = -1;
+	shm = NULL;
+	return 0;
+}
+
+int fsc_create(const char *filename)
+{
+	return call(FSD_CREATE, -1, filename, 0, 0);
+}
+
+int fsc_delete(const char *filename)
+{
+	return call(FSD_DELETE, -1, filename, 0, 0);
+}
+
+int fsc_ls(void)
+{
+	const struct fsd_dirent *dirents = (const struct fsd_dirent *)shm;
+	uint32_t max = FSD_SHM_SIZE / sizeof(*dirents);
+	int32_t entry = 0;
+	int n;
+
+	if (sock < 0)
+		return -1;
+
+	printf("FS Ls:\n");
+	do {
+		n = call(FSD_LS, entry, NULL, 0, max);
+		if (n < 0)
+			return -1;
+		for (int i = 0; i < n; i++) {
+			printf("file: %.*s, size: %u\n", FS_FILENAME_LEN,
+			       dirents[i].filename, dirents[i].size);
+		}
+		if (n > 0)
+			entry = dirents[n - 1].entry + 1;
+	} while ((uint32_t)n == max);
+
+	return 0;
+}
+
+int fsc_open(const char *filename)
+{
+	return call(FSD_OPEN, -1, filename, 0, 0);
+}
+
+int fsc_close(int fd)
+{
+	return call(FSD_CLOSE, fd, NULL, 0, 0);
+}
+
+int fsc_stat(int fd)
+{
+	return call(FSD_STAT, fd, NULL, 0, 0);
+}
+
+int fsc_lseek(int fd, size_t offset)
+{
+	return call(FSD_LSEEK, fd, NULL, offset, 0);
+}
+
+int fsc_write(int fd, const void *buf, size_t count)
+{
+	const uint8_t *p = buf;
+	size_t done = 0;
+
+	if (sock < 0)
+		return -1;
+
+	while (done < count) {
+		uint32_t n = count - done < FSD_SHM_SIZE ? count - done
+							 : FSD_SHM_SIZE;
+		int ret;
+
+		memcpy(shm, p + done, n);
+		ret = call(FSD_WRITE, fd, NULL, 0, n);
+		if (ret < 0)
+			return done ? (int)done : -1;
+		done += ret;
+		/* The disk is full */
+		if ((uint32_t)ret < n)
+			break;
+	}
+	return done;
+}
+
+int fsc_read(int fd, void *buf, size_t count)
+{
+	uint8_t *p = buf;
+	size_t done = 0;
+
+	if (sock < 0)
+		return -1;
+
+	while (done < count) {
+		uint32_t n = count - done < FSD_SHM_SIZE ? count - done
+							 : FSD_SHM_SIZE;
+		int ret;
+
+		ret = call(FSD_READ, fd, NULL, 0, n);
+		if (ret < 0)
+			return done ? (int)done : -1;
+		memcpy(p + done, shm, ret);
+		done += ret;
+		/* The end of the file */
+		if ((uint32_t)ret < n)
+			break;
+	}
+	return done;
+}
@@ -0,0 +1,95 @@
+#ifndef _FSD_CLIENT_H
+#define _FSD_CLIENT_H
+
+#include <stddef.h>
+
+/*
+ * Client library of the file system daemon (see fsd.c). Once connected, the
+ * functions behave like their fs.h counterparts, except that the disk is
+ * mounted by the daemon and can be shared with other clients.
+ */
+
+/**
+ * fsc_connect - Connect to a file system daemon
+ * @path: Path of the socket of the daemon
+ *
+ * Connect to the daemon listening on socket @path, and share a buffer of
+ * %FSD_SHM_SIZE bytes with it for the data of reads, writes and listings.
+ *
+ * Return: -1 if already connected, or if the connection or the buffer cannot be
+ * set up. 0 otherwise.
+ */
+int fsc_connect(const char *path);
+
+/**
+ * fsc_disconnect - Disconnect from the daemon
+ *
+ * The file descriptors still open are closed by the daemon.
+ *
+ * Return: -1 if not connected. 0 otherwise.
+ */
+int fsc_disconnect(void);
+
+/**
+ * fsc_create - Create a new file, see fs_create()
+ * @filename: File name
+ */
+int fsc_create(const char *filename);
+
+/**
+ * fsc_delete - Delete a file, see fs_delete()
+ * @filename: File name
+ */
+int fsc_delete(const char *filename);
+
+/**
+ * fsc_ls - List files on the daemon's file system, see fs_ls()
+ */
+int fsc_ls(void);
+
+/**
+ * fsc_open - Open a file, see fs_open()
+ * @filename: File name
+ *
+ * The file descriptor can only be used by the client that opened it.
+ */
+int fsc_open(const char *filename);
+
+/**
+ * fsc_close - Close a file, see fs_close()
+ * @fd: File descriptor
+ */
+int fsc_close(int fd);
+
+/**
+ * fsc_stat - Get file status, see fs_stat()
+ * @fd: File descriptor
+ */
+int fsc_stat(int fd);
+
+/**
+ * fsc_lseek - Set file offset, see fs_lseek()
+ * @fd: File descriptor
+ * @offset: File offset
+ */
+int fsc_lseek(int fd, size_t offset);
+
+/**
+ * fsc_write - Write to a file, see fs_write()
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ *
+ * Transfers larger than the shared buffer are split into several requests.
+ */
+int fsc_write(int fd, const void *buf, size_t count);
+
+/**
+ * fsc_read - Read from a file, see fs_read()
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ */
+int fsc_read(int fd, void *buf, size_t count);
+
+#endif /* _FSD_CLIENT_H */
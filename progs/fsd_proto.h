@@ -0,0 +1,72 @@
+#ifndef _FSD_PROTO_H
+#define _FSD_PROTO_H
+
+#include <stdint.h>
+
+#include <fs.h>
+
+/*
+ * Protocol between the file system daemon (fsd) and its clients, over a Unix
+ * stream socket.
+ *
+ * A client first sends a struct fsd_hello, along with the file descriptor of a
+ * shared memory region (SCM_RIGHTS ancillary data), a memfd sealed against
+ * shrinking (F_SEAL_SHRINK) that is at least as large as announced: fsd
+ * rejects any other, which could make it fault. The data of reads, writes
+ * and listings travels through that region, only the fixed-size requests and
+ * replies go through the socket. Each struct fsd_request is answered by a
+ * struct fsd_reply carrying the same sequence number. Requests are served in
+ * order, and a client may send several of them before reading the replies.
+ */
+
+#define FSD_MAGIC 0x31445346 /* "FSD1" */
+
+/** Default size of the shared memory region of a client */
+#define FSD_SHM_SIZE (1 << 20)
+
+enum fsd_op {
+	FSD_CREATE,	/* fs_create(filename) */
+	FSD_DELETE,	/* fs_delete(filename) */
+	FSD_OPEN,	/* fs_open(filename) */
+	FSD_CLOSE,	/* fs_close(fd) */
+	FSD_STAT,	/* fs_stat(fd) */
+	FSD_LSEEK,	/* fs_lseek(fd, offset) */
+	FSD_READ,	/* fs_read(fd, shm + offset, count) */
+	FSD_WRITE,	/* fs_write(fd, shm + offset, count) */
+	FSD_LS,		/* up to count struct fsd_dirent at shm + offset */
+	FSD_NR_OPS,
+};
+
+struct fsd_hello {
+	uint32_t magic;
+	/* Size of the shared memory region */
+	uint32_t shm_size;
+};
+
+struct fsd_request {
+	uint32_t seq;
+	uint32_t op;
+	/* Descriptor, or first root directory entry to list for FSD_LS */
+	int32_t fd;
+	/* Number of bytes to read or write, or of entries to list */
+	uint32_t count;
+	/* Offset of the data in the shared memory region, or lseek offset */
+	uint64_t offset;
+	char filename[FS_FILENAME_LEN];
+};
+
+struct fsd_reply {
+	uint32_t seq;
+	/* Return value of the fs.h function, number of entries for FSD_LS */
+	int32_t ret;
+};
+
+/* File listed by FSD_LS */
+struct fsd_dirent {
+	char filename[FS_FILENAME_LEN];
+	uint32_t size;
+	/* Root directory entry of the file, to resume the listing after it */
+	uint32_t entry;
+};
+
+#endif /* _FSD_PROTO_H */
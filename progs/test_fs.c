@@ -7,6 +7,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fs.h>
@@ -28,6 +29,8 @@ do {							\
 	exit(1);					\
 } while (0)
 
+/* Size of the reads when measuring the throughput */
+#define DEFRAG_READ_SIZE (1 << 20)
 
 struct thread_arg {
 	int argc;
@@ -40,6 +43,7 @@ void thread_fs_stat(void *arg)
 	char *diskname, *filename;
 	int fs_fd;
 	int stat;
+	struct fs_compression_stats cstats;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -47,7 +51,7 @@ void thread_fs_stat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_readonly(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -70,6 +74,12 @@ void thread_fs_stat(void *arg)
 		return;
 	}
 
+	if (fs_compression_stats(fs_fd, &cstats)) {
+		fs_close(fs_fd);
+		fs_umount();
+		die("Cannot get compression stats");
+	}
+
 	if (fs_close(fs_fd)) {
 		fs_umount();
 		die("Cannot close file");
@@ -79,6 +89,10 @@ void thread_fs_stat(void *arg)
 		die("cannot unmount diskname");
 
 	printf("Size of file '%s' is %d bytes\n", filename, stat);
+	if (cstats.stored_blocks < cstats.data_blocks)
+		printf("Compressed from %zu to %zu blocks (ratio %.2f)\n",
+			   cstats.data_blocks, cstats.stored_blocks,
+			   (double)cstats.data_blocks / cstats.stored_blocks);
 }
 
 void thread_fs_cat(void *arg)
@@ -94,7 +108,7 @@ void thread_fs_cat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_readonly(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -163,7 +177,90 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
-void thread_fs_add(void *arg)
+void thread_fs_clone(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <new filename>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src, dst)) {
+		fs_umount();
+		die("Cannot clone file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cloned file '%s' as '%s'\n", src, dst);
+}
+
+void thread_fs_snapshot(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <snapshot name>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot(name)) {
+		fs_umount();
+		die("Cannot take snapshot");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Took snapshot '%s'\n", name);
+}
+
+void thread_fs_restore(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <snapshot name>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot_restore(name)) {
+		fs_umount();
+		die("Cannot restore snapshot");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Restored snapshot '%s'\n", name);
+}
+
+/* Storage modes of added files */
+enum add_mode {
+	ADD_PLAIN,
+	ADD_COMPRESSED,
+	ADD_DEDUP,
+};
+
+static void add_file(void *arg, enum add_mode mode)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename, *buf;
@@ -203,6 +300,15 @@ void thread_fs_add(void *arg)
 		die("Cannot create file");
 	}
 
+	if (mode == ADD_COMPRESSED && fs_set_compression(filename, 1)) {
+		fs_umount();
+		die("Cannot compress file");
+	}
+	if (mode == ADD_DEDUP && fs_set_dedup(filename, 1)) {
+		fs_umount();
+		die("Cannot deduplicate file");
+	}
+
 	fs_fd = fs_open(filename);
 	if (fs_fd < 0) {
 		fs_umount();
@@ -226,6 +332,21 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+void thread_fs_add(void *arg)
+{
+	add_file(arg, ADD_PLAIN);
+}
+
+void thread_fs_addz(void *arg)
+{
+	add_file(arg, ADD_COMPRESSED);
+}
+
+void thread_fs_adddedup(void *arg)
+{
+	add_file(arg, ADD_DEDUP);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -236,7 +357,7 @@ void thread_fs_ls(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_mount_readonly(diskname))
 		die("Cannot mount diskname");
 
 	fs_ls();
@@ -255,7 +376,7 @@ void thread_fs_info(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_mount_readonly(diskname))
 		die("Cannot mount diskname");
 
 	fs_info();
@@ -264,6 +385,147 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+/* Print the fragmentation of the files, and return the number of runs */
+static size_t defrag_report(void)
+{
+	struct fs_dirent ents[16], st;
+	size_t pos = 0, runs = 0, files = 0, fragmented = 0;
+	int n;
+
+	while ((n = fs_readdir(&pos, ents, ARRAY_SIZE(ents))) > 0) {
+		for (int i = 0; i < n; i++) {
+			/* The runs are only counted for a single file */
+			if (fs_stat_name(ents[i].name, &st))
+				die("Cannot stat file %s", ents[i].name);
+			files++;
+			runs += st.runs;
+			fragmented += st.runs > 1;
+		}
+	}
+	if (n < 0)
+		die("Cannot read directory");
+	printf("%zu files, %zu fragmented, %zu runs\n", files, fragmented,
+	       runs);
+	return runs;
+}
+
+/* Read every file from start to end, out of the page cache, in MB/s */
+static double defrag_throughput(char *diskname)
+{
+	struct fs_dirent ents[16];
+	struct timespec start, end;
+	size_t pos = 0, bytes = 0;
+	char *buf;
+	double secs;
+	int n, fd;
+
+	/* Drop the cached pages of the image (written back first) */
+	fd = open(diskname, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+
+	buf = malloc(DEFRAG_READ_SIZE);
+	if (!buf)
+		die("Cannot malloc");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((n = fs_readdir(&pos, ents, ARRAY_SIZE(ents))) > 0) {
+		for (int i = 0; i < n; i++) {
+			int fs_fd = fs_open(ents[i].name);
+			int read;
+
+			if (fs_fd < 0)
+				die("Cannot open file");
+			while ((read = fs_read(fs_fd, buf,
+					       DEFRAG_READ_SIZE)) > 0)
+				bytes += read;
+			fs_close(fs_fd);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(buf);
+
+	secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+	return secs > 0 ? bytes / secs / 1e6 : 0;
+}
+
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t step = 1024, steps = 0;
+	double before;
+	int ret;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [blocks per step]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1) {
+		step = strtoul(t_arg->argv[1], NULL, 0);
+		if (!step)
+			die("Usage: <diskname> [blocks per step]");
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	defrag_report();
+	before = defrag_throughput(diskname);
+
+	while ((ret = fs_defrag(step)) > 0)
+		steps++;
+	if (ret < 0) {
+		fs_umount();
+		die("Cannot defragment");
+	}
+	printf("Defragmented in %zu steps of %zu blocks\n", steps + 1, step);
+
+	defrag_report();
+	printf("Sequential read: %.1f MB/s before, %.1f MB/s after\n", before,
+	       defrag_throughput(diskname));
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_fsck(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int repair = 0;
+	int problems;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [repair]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1) {
+		if (strcmp(t_arg->argv[1], "repair"))
+			die("Usage: <diskname> [repair]");
+		repair = 1;
+	}
+
+	/* Only repairs write to the disk */
+	if (repair ? fs_mount(diskname) : fs_mount_readonly(diskname))
+		die("Cannot mount diskname");
+
+	problems = fs_check(repair);
+	if (problems < 0) {
+		fs_umount();
+		die("Cannot check diskname");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (problems && !repair)
+		exit(1);
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -279,9 +541,16 @@ static struct {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
+	{ "addz",	thread_fs_addz },
+	{ "adddedup",	thread_fs_adddedup },
 	{ "rm",		thread_fs_rm },
+	{ "clone",	thread_fs_clone },
+	{ "snapshot",	thread_fs_snapshot },
+	{ "restore",	thread_fs_restore },
 	{ "cat",	thread_fs_cat },
-	{ "stat",	thread_fs_stat }
+	{ "stat",	thread_fs_stat },
+	{ "defrag",	thread_fs_defrag },
+	{ "fsck",	thread_fs_fsck }
 };
 
 void usage(char *program)